@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""
+Time --aggregate over generated recordings with one to N jobs.
+
+    aggregate-bench.py <lswt> <directory> [jobs]
+
+Generates recordings with recordings.py into the directory unless it already
+holds them, then reports the best of three runs for every job count from one
+to the given number, which defaults to the number of CPUs.
+"""
+
+import glob
+import os
+import subprocess
+import sys
+import time
+
+import recordings
+
+COUNT = 64
+RECORDS = 50000
+RUNS = 3
+
+
+def best_time(command):
+    best = None
+    for _ in range(RUNS):
+        start = time.perf_counter()
+        subprocess.run(command, stdout=subprocess.DEVNULL, check=True)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main(lswt, directory, max_jobs):
+    paths = sorted(glob.glob(os.path.join(directory, "r*.tsv")))
+    if len(paths) != COUNT:
+        paths = recordings.write(directory, COUNT, RECORDS)
+    size = sum(os.path.getsize(path) for path in paths)
+    print("%d recordings, %.1f MiB" % (len(paths), size / (1024 * 1024)))
+    print("%-6s %10s %10s %8s" % ("jobs", "seconds", "MiB/s", "speedup"))
+    single = None
+    for jobs in range(1, max_jobs + 1):
+        seconds = best_time([lswt, "--json", "--jobs", str(jobs), "--aggregate"] + paths)
+        single = seconds if single is None else single
+        print("%-6d %10.3f %10.1f %7.2fx" % (jobs, seconds, size / (1024 * 1024) / seconds, single / seconds))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (3, 4):
+        sys.exit(__doc__.strip())
+    main(sys.argv[1], sys.argv[2], int(sys.argv[3]) if len(sys.argv) == 4 else os.cpu_count() or 1)
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""
+Compare the report of --aggregate with a reference implementation.
+
+    aggregate-check.py <lswt> [directory]
+
+Generates recordings with recordings.py into the directory, or a temporary
+one, and runs "lswt --cbor --jobs N --aggregate" on them with one and with
+several jobs. CBOR is compared, because it carries times exactly, and the
+JSON report is checked to parse with the same app-ids. Exits non-zero if any
+report differs from the reference.
+"""
+
+import json
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+import recordings
+
+EVENTS = {"created": "created", "changed": "changed", "present": None, "closed": "closed", "focus": "focus"}
+
+
+def number(field):
+    """Parse a numeric field like record_number(), None if it is none."""
+    if not 1 <= len(field) <= 19 or not all("0" <= c <= "9" for c in field):
+        return None
+    return int(field)
+
+
+def unescape(value):
+    if value == "\\N":
+        return None
+    out = []
+    i = 0
+    while i < len(value):
+        if value[i] == "\\" and i + 1 < len(value):
+            i += 1
+            out.append({"t": "\t", "n": "\n", "r": "\r"}.get(value[i], value[i]))
+        else:
+            out.append(value[i])
+        i += 1
+    return "".join(out)
+
+
+def normalize(app_id):
+    """Return the app-id as escaped again by aggregate_normalize()."""
+    value = unescape(app_id)
+    if value is not None:
+        value = value.encode("utf-8", "surrogateescape").decode("utf-8", "replace")
+    return recordings.escape(value)
+
+
+def reference(paths):
+    """Aggregate the recordings the way --aggregate documents it."""
+    apps = {}
+    records = 0
+    malformed = 0
+    duration = 0
+
+    def app(app_id):
+        return apps.setdefault(normalize(app_id), {"focus": 0, "toplevels": 0,
+                                        "created": 0, "changed": 0, "closed": 0, "focus-events": 0})
+
+    for path in paths:
+        with open(path, "rb") as f:
+            data = f.read().decode("utf-8", "surrogateescape")
+        toplevels = {}
+        first = None
+        last = 0
+
+        def end_focus(toplevel, time):
+            if toplevel["activated"] and time > toplevel["since"]:
+                app(toplevel["app-id"])["focus"] += time - toplevel["since"]
+            toplevel["activated"] = False
+
+        for line in data.split("\n"):
+            if not line:
+                continue
+            records += 1
+            fields = line.split("\t", 7)
+            time = number(fields[1]) if len(fields) >= 3 else None
+            if time is None:
+                malformed += 1
+                continue
+            if fields[2] != "reset":
+                if len(fields) != 8 or number(fields[3]) is None \
+                        or (fields[4] != "\\N" and number(fields[4]) is None):
+                    malformed += 1
+                    continue
+                if fields[2] not in EVENTS:
+                    continue
+
+            first = time if first is None else min(first, time)
+            last = max(last, time)
+            if fields[2] == "reset":
+                for toplevel in toplevels.values():
+                    end_focus(toplevel, time)
+                continue
+
+            event = EVENTS[fields[2]]
+            if event == "focus" and fields[4] != "\\N" and int(fields[4]) in toplevels:
+                end_focus(toplevels[int(fields[4])], time)
+            toplevel_id = int(fields[3])
+            app_id = fields[6]
+            if toplevel_id in toplevels:
+                end_focus(toplevels[toplevel_id], time)
+            else:
+                toplevels[toplevel_id] = {"activated": False}
+                app(app_id)["toplevels"] += 1
+            toplevel = toplevels[toplevel_id]
+            toplevel["app-id"] = app_id
+            toplevel["since"] = time
+            toplevel["activated"] = event != "closed" and "A" in fields[5]
+            if event is not None:
+                app(app_id)["focus-events" if event == "focus" else event] += 1
+
+        for toplevel in toplevels.values():
+            end_focus(toplevel, last)
+        duration += last - (first or 0)
+
+    hours = duration / 3.6e9
+    report = {"recordings": len(paths), "records": records, "malformed-records": malformed,
+              "duration": duration / 1e6, "apps": []}
+    order = sorted(apps.items(), key=lambda item: (-item[1]["focus"], -item[1]["toplevels"],
+                                                   item[0].encode("utf-8")))
+    for app_id, counts in order:
+        events = counts["created"] + counts["changed"] + counts["closed"] + counts["focus-events"]
+        report["apps"].append({
+            "app-id": unescape(app_id),
+            "focus-time": counts["focus"] / 1e6,
+            "toplevels": counts["toplevels"],
+            "created": counts["created"],
+            "changed": counts["changed"],
+            "closed": counts["closed"],
+            "focus": counts["focus-events"],
+            "events-per-hour": events / hours if hours > 0 else 0,
+        })
+    return report
+
+
+def cbor_decode(data):
+    """Decode the subset of CBOR written by lswt."""
+    pos = 0
+
+    def item():
+        nonlocal pos
+        initial = data[pos]
+        pos += 1
+        major, info = initial >> 5, initial & 31
+        if initial == 0xf6:
+            return None
+        if initial == 0xfb:
+            pos += 8
+            return struct.unpack(">d", data[pos-8:pos])[0]
+        if info < 24:
+            value = info
+        else:
+            size = {24: 1, 25: 2, 26: 4, 27: 8}[info]
+            value = int.from_bytes(data[pos:pos+size], "big")
+            pos += size
+        if major == 0:
+            return value
+        if major == 3:
+            pos += value
+            return data[pos-value:pos].decode("utf-8", "surrogateescape")
+        if major == 4:
+            return [item() for _ in range(value)]
+        if major == 5:
+            return {item(): item() for _ in range(value)}
+        raise ValueError("unexpected CBOR major type %d" % major)
+
+    value = item()
+    if pos != len(data):
+        raise ValueError("trailing data after CBOR item")
+    return value
+
+
+def rounded(value):
+    """Round times to the microseconds of the recordings."""
+    if isinstance(value, dict):
+        return {k: rounded(v) for k, v in value.items()}
+    if isinstance(value, list):
+        return [rounded(v) for v in value]
+    if isinstance(value, float):
+        return round(value, 6)
+    return value
+
+
+def check(lswt, directory):
+    paths = recordings.write(directory, 12, 5000)
+    expected = rounded(reference(paths))
+    ok = True
+    for jobs in (1, 4):
+        output = subprocess.run([lswt, "--cbor", "--jobs", str(jobs), "--aggregate"] + paths,
+                                stdout=subprocess.PIPE, check=True).stdout
+        if rounded(cbor_decode(output)) != expected:
+            print("FAIL: --aggregate with --jobs %d differs from the reference." % jobs)
+            ok = False
+        else:
+            print("PASS: --aggregate with --jobs %d matches the reference." % jobs)
+
+    # The app-ids contain backslashes and tabs, which must be escaped.
+    output = subprocess.run([lswt, "--json", "--aggregate"] + paths, stdout=subprocess.PIPE, check=True).stdout
+    try:
+        app_ids = [app["app-id"] for app in json.loads(output.decode("utf-8", "surrogateescape"))["apps"]]
+    except ValueError:
+        app_ids = None
+    if app_ids != [app["app-id"] for app in expected["apps"]]:
+        print("FAIL: The JSON report of --aggregate is invalid or differs from the reference.")
+        ok = False
+    else:
+        print("PASS: The JSON report of --aggregate is valid.")
+    return ok
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__.strip())
+    if len(sys.argv) == 3:
+        ok = check(sys.argv[1], sys.argv[2])
+    else:
+        with tempfile.TemporaryDirectory() as directory:
+            ok = check(sys.argv[1], directory)
+    sys.exit(0 if ok else 1)
@@ -0,0 +1,244 @@
+/*
+ * lswt - list Wayland toplevels
+ *
+ * Copyright (C) 2021 - 2023 Leon Henrik Plickat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The tested functions are static, so include the whole program instead of linking it. */
+#define main lswt_main
+#include "../lswt.c"
+#undef main
+
+/* Checks of internals which can not be reached without a compositor. Every
+ * check prints a line and returns false on failure.
+ *
+ * Usage: check
+ */
+
+#define CHECK_JOURNAL_CAPACITY 4
+
+struct Check
+{
+	const char *name;
+	bool (*run)(void);
+};
+
+/**********************
+ *                    *
+ *    Feed journal    *
+ *                    *
+ **********************/
+static struct Toplevel check_toplevel;
+
+/** Connect a streaming feed client to a socket pair, returns the peer end. */
+static int check_feed_connect (struct Feed_client *client)
+{
+	int fds[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 )
+	{
+		fprintf(stderr, "ERROR: socketpair(): %s\n", strerror(errno));
+		return -1;
+	}
+	*client = (struct Feed_client){ .fd = fds[0], .streaming = true, .cursor = record_next_seq };
+	return fds[1];
+}
+
+/** Fill the socket of the client until it takes no more, returns the number of bytes. */
+static size_t check_feed_clog (struct Feed_client *client)
+{
+	static const char junk[4096] = { 0 };
+	size_t total = 0;
+	ssize_t n;
+	while ( (n = send(client->fd, junk, sizeof(junk), MSG_DONTWAIT)) > 0 )
+		total += (size_t)n;
+	return total;
+}
+
+/**
+ * Read what the client has been sent, skipping the first skip bytes, and
+ * check that it is exactly the records from first to the last one.
+ */
+static bool check_feed_receive (struct Feed_client *client, int peer, size_t skip, uint64_t first)
+{
+	char *received = NULL;
+	size_t received_len = 0;
+	FILE *f = open_memstream(&received, &received_len);
+	if ( f == NULL )
+		return false;
+	for (;;)
+	{
+		char buffer[4096];
+		const ssize_t n = recv(peer, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if ( n > 0 )
+		{
+			fwrite(buffer, 1, (size_t)n, f);
+			continue;
+		}
+		if ( client->fd < 0 || client->cursor == record_next_seq )
+			break;
+		feed_client_flush(client);
+	}
+	fclose(f);
+
+	bool ok = received_len >= skip;
+	uint64_t expected = first;
+	for (char *line = received + skip; ok && line < received + received_len; expected++)
+	{
+		char *end = memchr(line, '\n', received_len - (size_t)(line - received));
+		uint64_t seq;
+		ok = end != NULL && sscanf(line, "%" SCNu64 "\t", &seq) == 1 && seq == expected;
+		line = end + 1;
+	}
+	ok = ok && expected == record_next_seq;
+	free(received);
+	return ok;
+}
+
+static bool check_feed_caught_up (void)
+{
+	struct Feed_client *client = &feed_clients[0];
+	const int peer = check_feed_connect(client);
+	if ( peer < 0 )
+		return false;
+
+	/* Every record is sent as part of appending it. */
+	bool ok = true;
+	for (size_t i = 0; ok && i < 3 * CHECK_JOURNAL_CAPACITY; i++)
+	{
+		const uint64_t seq = record_next_seq;
+		record_event(&check_toplevel, EVENT_CHANGED, 1);
+		ok = client->cursor == record_next_seq && check_feed_receive(client, peer, 0, seq);
+	}
+	feed_client_close(client);
+	close(peer);
+	return ok;
+}
+
+static bool check_feed_lagging (void)
+{
+	struct Feed_client *client = &feed_clients[0];
+	const int peer = check_feed_connect(client);
+	if ( peer < 0 )
+		return false;
+
+	/* A client as far behind as the journal reaches gets all records once
+	 * it reads again.
+	 */
+	const uint64_t first = record_next_seq;
+	const size_t clogged = check_feed_clog(client);
+	for (size_t i = 0; i < CHECK_JOURNAL_CAPACITY; i++)
+		record_event(&check_toplevel, EVENT_CHANGED, 1);
+	bool ok = client->fd >= 0 && check_feed_receive(client, peer, clogged, first);
+	feed_client_close(client);
+	close(peer);
+	if (!ok)
+		return false;
+
+	/* One more record reuses the slot the client is waiting for. */
+	const int peer2 = check_feed_connect(client);
+	if ( peer2 < 0 )
+		return false;
+	check_feed_clog(client);
+	for (size_t i = 0; i < CHECK_JOURNAL_CAPACITY + 1; i++)
+		record_event(&check_toplevel, EVENT_CHANGED, 1);
+	ok = client->fd < 0;
+	if ( client->fd >= 0 )
+		feed_client_close(client);
+	close(peer2);
+	return ok;
+}
+
+static bool check_feed (bool (*run)(void))
+{
+	int fds[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0 )
+	{
+		fprintf(stderr, "ERROR: socketpair(): %s\n", strerror(errno));
+		return false;
+	}
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+		feed_clients[i] = (struct Feed_client){ .fd = -1 };
+	journal_capacity = CHECK_JOURNAL_CAPACITY;
+	journal = calloc(journal_capacity, sizeof(struct Feed_record));
+	if ( journal == NULL )
+		return false;
+
+	/* record_event() only needs the listening socket to exist. */
+	feed_socket = fds[0];
+	const bool ok = run();
+	feed_socket = -1;
+	close(fds[0]);
+	close(fds[1]);
+	feed_finish();
+	return ok;
+}
+
+static bool check_feed_journal_caught_up (void)
+{
+	return check_feed(check_feed_caught_up);
+}
+
+static bool check_feed_journal_lagging (void)
+{
+	return check_feed(check_feed_lagging);
+}
+
+/**************
+ *            *
+ *    JSON    *
+ *            *
+ **************/
+static bool check_json_title (void)
+{
+	static const char title[] = "back\\slash \"quoted\"\r\b\f\x01\x1f\x7f\t\n";
+	static const char expected[] = "\"title\": \"back\\\\slash \\\"quoted\\\"\\r\\b\\f"
+		"\\u0001\\u001f\\u007f\\t\\n\",\n";
+
+	struct Toplevel toplevel = { 0 };
+	if (!string_set(&toplevel.title, title, 0))
+		return false;
+
+	char *output = NULL;
+	size_t output_len = 0;
+	FILE *f = open_memstream(&output, &output_len);
+	if ( f == NULL )
+		return false;
+	output_format = JSON;
+	out_write_toplevel(&toplevel, NULL, f);
+	fclose(f);
+
+	const bool ok = strstr(output, expected) != NULL;
+	free(output);
+	string_free(&toplevel.title);
+	return ok;
+}
+
+static const struct Check checks[] = {
+	{ "feed journal, caught up client", check_feed_journal_caught_up },
+	{ "feed journal, lagging client",   check_feed_journal_lagging   },
+	{ "JSON title escaping",            check_json_title             },
+};
+
+int main (int argc, char *argv[])
+{
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+	{
+		const bool passed = checks[i].run();
+		fprintf(stdout, "%s: %s\n", passed ? "PASS" : "FAIL", checks[i].name);
+		ok = ok && passed;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
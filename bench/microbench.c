@@ -0,0 +1,511 @@
+/*
+ * lswt - list Wayland toplevels
+ *
+ * Copyright (C) 2021 - 2023 Leon Henrik Plickat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The kernels are static, so include the whole program instead of linking it. */
+#define main lswt_main
+#include "../lswt.c"
+#undef main
+
+#include <time.h>
+
+/* Microbenchmark for the string output kernels. Every kernel runs over each
+ * category of a corpus of titles and app-ids and writes into a memory buffer,
+ * so the numbers are not dominated by stdio flushing to a terminal or pipe.
+ *
+ * Afterwards, walking all toplevels as the output does is measured for the
+ * slab and for a linked list of separately allocated toplevels, the layout
+ * lswt used before the slab.
+ *
+ * Usage: microbench [corpus] [seconds per measurement]
+ */
+
+#define SINK_SIZE (16 * 1024 * 1024)
+#define MAX_CATEGORIES 16
+
+/** Slab sizes for which iterating all toplevels is measured. */
+static const size_t iteration_sizes[] = { 1000, 100000, 1000000 };
+
+struct Category
+{
+	char *name;
+	struct Toplevel **toplevels;
+	size_t len;
+
+	/** Bytes of titles and app-ids, the input of every kernel. */
+	size_t bytes;
+};
+
+struct Kernel
+{
+	const char *name;
+	void (*run)(struct Toplevel *toplevel, FILE *restrict f);
+};
+
+static struct Category categories[MAX_CATEGORIES];
+static size_t categories_len = 0;
+
+/* Results of kernels which do not write anything go here, so the compiler
+ * can not optimize them away.
+ */
+static volatile size_t blackhole = 0;
+
+/*************************
+ *                       *
+ *    Kernel wrappers    *
+ *                       *
+ *************************/
+static void kernel_string_needs_quotes (struct Toplevel *toplevel, FILE *restrict f)
+{
+	blackhole += string_needs_quotes(string_get(&toplevel->title));
+	blackhole += string_needs_quotes(string_get(&toplevel->app_id));
+}
+
+static void kernel_real_strlen (struct Toplevel *toplevel, FILE *restrict f)
+{
+	blackhole += real_strlen(string_get(&toplevel->title));
+	blackhole += real_strlen(string_get(&toplevel->app_id));
+}
+
+static void kernel_utf8_valid (struct Toplevel *toplevel, FILE *restrict f)
+{
+	blackhole += utf8_valid(string_get(&toplevel->title), toplevel->title.len);
+	blackhole += utf8_valid(string_get(&toplevel->app_id), toplevel->app_id.len);
+}
+
+static void kernel_quoted_fputs (struct Toplevel *toplevel, FILE *restrict f)
+{
+	size_t len;
+	quoted_fputs(&len, string_get(&toplevel->title), f);
+	blackhole += len;
+	quoted_fputs(&len, string_get(&toplevel->app_id), f);
+	blackhole += len;
+}
+
+/** Padding of the app-id column, as done for the NORMAL format. */
+static void kernel_write_padding (struct Toplevel *toplevel, FILE *restrict f)
+{
+	write_padding(real_strlen(string_get(&toplevel->app_id)), max_app_id_padding, f);
+}
+
+static void kernel_out_write_custom (struct Toplevel *toplevel, FILE *restrict f)
+{
+	out_write_toplevel(toplevel, NULL, f);
+}
+
+static const struct Kernel kernels[] = {
+	{ "string_needs_quotes", kernel_string_needs_quotes },
+	{ "real_strlen",         kernel_real_strlen         },
+	{ "utf8_valid",          kernel_utf8_valid          },
+	{ "quoted_fputs",        kernel_quoted_fputs        },
+	{ "write_padding",       kernel_write_padding       },
+	{ "out_write_toplevel",  kernel_out_write_custom    },
+};
+
+/****************
+ *              *
+ *    Corpus    *
+ *              *
+ ****************/
+/** Undo the escaping of "\t", "\n" and "\\" in place. */
+static void unescape (char *str)
+{
+	char *out = str;
+	for (; *str != '\0'; str++)
+	{
+		if ( *str == '\\' && str[1] != '\0' )
+		{
+			str++;
+			switch (*str)
+			{
+				case 't': *out++ = '\t'; break;
+				case 'n': *out++ = '\n'; break;
+				default:  *out++ = *str; break;
+			}
+		}
+		else
+			*out++ = *str;
+	}
+	*out = '\0';
+}
+
+static struct Category *get_category (const char *name)
+{
+	for (size_t i = 0; i < categories_len; i++)
+		if ( strcmp(categories[i].name, name) == 0 )
+			return &categories[i];
+
+	if ( categories_len == MAX_CATEGORIES )
+	{
+		fputs("ERROR: Too many categories in corpus.\n", stderr);
+		return NULL;
+	}
+	struct Category *category = &categories[categories_len++];
+	category->name = strdup(name);
+	if ( category->name == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		return NULL;
+	}
+	return category;
+}
+
+static bool load_corpus (const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: Can not open corpus '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+
+	/* The slab may be reallocated while loading, so remember indices. */
+	struct Index_record { struct Category *category; uint32_t index; } *records = NULL;
+	size_t records_len = 0;
+
+	bool ok = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t n;
+	while ( (n = getline(&line, &line_size, f)) > 0 )
+	{
+		if ( line[n-1] == '\n' )
+			line[n-1] = '\0';
+		if ( line[0] == '#' || line[0] == '\0' )
+			continue;
+
+		char *app_id = strchr(line, '\t');
+		char *title = app_id != NULL ? strchr(app_id + 1, '\t') : NULL;
+		if ( title == NULL )
+		{
+			fprintf(stderr, "ERROR: Malformed corpus line: %s\n", line);
+			ok = false;
+			break;
+		}
+		*app_id++ = '\0';
+		*title++ = '\0';
+		unescape(title);
+
+		struct Category *category = get_category(line);
+		struct Toplevel *toplevel = toplevel_new();
+		if ( category == NULL || toplevel == NULL )
+		{
+			ok = false;
+			break;
+		}
+		void *tmp = realloc(records, (records_len + 1) * sizeof(struct Index_record));
+		if ( tmp == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+			ok = false;
+			break;
+		}
+		records = tmp;
+		toplevel_set_title(toplevel, title);
+		toplevel_set_app_id(toplevel, app_id);
+		toplevel_done(toplevel);
+		records[records_len].category = category;
+		records[records_len].index = toplevel_index(toplevel);
+		records_len++;
+		category->len++;
+		category->bytes += strlen(title) + strlen(app_id);
+	}
+	free(line);
+	fclose(f);
+
+	for (size_t i = 0; ok && i < categories_len; i++)
+	{
+		categories[i].toplevels = calloc(categories[i].len, sizeof(struct Toplevel *));
+		if ( categories[i].toplevels == NULL )
+			ok = false;
+		categories[i].len = 0;
+	}
+	for (size_t i = 0; ok && i < records_len; i++)
+	{
+		struct Category *category = records[i].category;
+		category->toplevels[category->len++] = toplevel_get(records[i].index);
+	}
+	free(records);
+
+	if ( ok && categories_len == 0 )
+	{
+		fputs("ERROR: Corpus is empty.\n", stderr);
+		ok = false;
+	}
+	return ok;
+}
+
+/*******************
+ *                 *
+ *    Measuring    *
+ *                 *
+ *******************/
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * Run the kernel over all toplevels of the category until at least the given
+ * amount of nanoseconds passed. Returns the nanoseconds per pass.
+ */
+static double measure (const struct Kernel *kernel, const struct Category *category,
+		FILE *restrict sink, double min_ns)
+{
+	/* Warm up caches and the branch predictor. */
+	for (size_t i = 0; i < category->len; i++)
+		kernel->run(category->toplevels[i], sink);
+	rewind(sink);
+
+	size_t passes = 0;
+	const double start = now();
+	double elapsed;
+	do
+	{
+		for (size_t i = 0; i < category->len; i++)
+			kernel->run(category->toplevels[i], sink);
+		rewind(sink);
+		passes++;
+		elapsed = now() - start;
+	} while ( elapsed < min_ns );
+
+	return elapsed / (double)passes;
+}
+
+/*******************
+ *                 *
+ *    Iteration    *
+ *                 *
+ *******************/
+/** A toplevel as lswt allocated it before the slab, for comparison. */
+struct List_toplevel
+{
+	struct List_toplevel *prev, *next;
+	size_t id;
+	void *handle;
+	char *title, *app_id, *identifier;
+	bool fullscreen, activated, maximized, minimized, listed;
+};
+
+static struct List_toplevel list_head = { .prev = &list_head, .next = &list_head };
+
+/** Add toplevels to the slab, copying the corpus, until it has len of them. */
+static bool grow_slab (size_t len)
+{
+	const size_t corpus_len = toplevels_len;
+	for (size_t i = toplevels_len; i < len; i++)
+	{
+		const struct Toplevel *original = &toplevels[i % corpus_len];
+		char *title = strdup(string_get(&original->title));
+		char *app_id = strdup(string_get(&original->app_id));
+		struct Toplevel *toplevel = toplevel_new();
+		if ( title == NULL || app_id == NULL || toplevel == NULL )
+		{
+			free(title);
+			free(app_id);
+			fputs("ERROR: Can not grow the slab.\n", stderr);
+			return false;
+		}
+		toplevel_set_title(toplevel, title);
+		toplevel_set_app_id(toplevel, app_id);
+		toplevel_set_identifier(toplevel, "ext-0123456789abcdef");
+		toplevel_set_state(toplevel, TOPLEVEL_ACTIVATED, i % 97 == 0);
+		toplevel_done(toplevel);
+		free(title);
+		free(app_id);
+	}
+	return true;
+}
+
+/**
+ * Copy the slab into the linked list. Other allocations are interleaved with
+ * the toplevels, as they would be in a long running session.
+ */
+static bool build_list (void)
+{
+	void **others = calloc(toplevels_len, sizeof(void *));
+	if ( others == NULL )
+		return false;
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < toplevels_len; i++)
+	{
+		const struct Toplevel *toplevel = &toplevels[i];
+		struct List_toplevel *node = calloc(1, sizeof(struct List_toplevel));
+		others[i] = malloc(64 + (size_t)(rand() % 256));
+		if ( node == NULL )
+		{
+			ok = false;
+			break;
+		}
+		node->id = toplevel->id;
+		node->title = strdup(string_get(&toplevel->title));
+		node->app_id = strdup(string_get(&toplevel->app_id));
+		node->identifier = strdup(string_get(&toplevel->identifier));
+		node->activated = toplevel_has(toplevel, TOPLEVEL_ACTIVATED);
+		node->listed = toplevel_has(toplevel, TOPLEVEL_LISTED);
+		node->next = list_head.next;
+		node->prev = &list_head;
+		list_head.next->prev = node;
+		list_head.next = node;
+		ok = node->title != NULL && node->app_id != NULL && node->identifier != NULL;
+	}
+	for (uint32_t i = 0; i < toplevels_len; i++)
+		free(others[i]);
+	free(others);
+	if (!ok)
+		fputs("ERROR: Can not build the list.\n", stderr);
+	return ok;
+}
+
+static void free_list (void)
+{
+	struct List_toplevel *node = list_head.next;
+	while ( node != &list_head )
+	{
+		struct List_toplevel *next = node->next;
+		free(node->title);
+		free(node->app_id);
+		free(node->identifier);
+		free(node);
+		node = next;
+	}
+	list_head.prev = list_head.next = &list_head;
+}
+
+/**
+ * Visit every listed toplevel, checking its state and reading app-id and
+ * identifier, like the loops of the output do.
+ */
+static void walk_slab (void)
+{
+	size_t sum = 0;
+	for (uint32_t i = 0; i < toplevels_len; i++)
+	{
+		const struct Toplevel *toplevel = &toplevels[i];
+		if (!toplevel_has(toplevel, TOPLEVEL_LISTED))
+			continue;
+		sum += toplevel_has(toplevel, TOPLEVEL_ACTIVATED);
+		sum += (unsigned char)string_get(&toplevel->app_id)[0];
+		sum += (unsigned char)string_get(&toplevel->identifier)[4];
+	}
+	blackhole += sum;
+}
+
+static void walk_list (void)
+{
+	size_t sum = 0;
+	for (const struct List_toplevel *node = list_head.prev; node != &list_head; node = node->prev)
+	{
+		if (!node->listed)
+			continue;
+		sum += node->activated;
+		sum += (unsigned char)node->app_id[0];
+		sum += (unsigned char)node->identifier[4];
+	}
+	blackhole += sum;
+}
+
+/** Returns the nanoseconds per call of walk, called for at least min_ns. */
+static double measure_walk (void (*walk)(void), double min_ns)
+{
+	walk();
+	size_t passes = 0;
+	const double start = now();
+	double elapsed;
+	do
+	{
+		walk();
+		passes++;
+		elapsed = now() - start;
+	} while ( elapsed < min_ns );
+	return elapsed / (double)passes;
+}
+
+static bool measure_iteration (double seconds)
+{
+	for (uint32_t i = 0; i < toplevels_len; i++)
+		toplevel_set_identifier(&toplevels[i], "ext-0123456789abcdef");
+
+	fprintf(stdout, "\n%-12s %14s %14s %9s\n", "toplevels:", "list ns/item:", "slab ns/item:", "speedup:");
+	for (size_t i = 0; i < sizeof(iteration_sizes) / sizeof(iteration_sizes[0]); i++)
+	{
+		const size_t len = iteration_sizes[i];
+		if ( len < toplevels_len )
+			continue;
+		if ( !grow_slab(len) || !build_list() )
+			return false;
+		const double list_ns = measure_walk(walk_list, seconds * 1e9);
+		const double slab_ns = measure_walk(walk_slab, seconds * 1e9);
+		free_list();
+		fprintf(stdout, "%-12zu %14.2f %14.2f %8.1fx\n", len,
+				list_ns / (double)len, slab_ns / (double)len, list_ns / slab_ns);
+	}
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *corpus = argc > 1 ? argv[1] : "bench/corpus.tsv";
+	const double seconds = argc > 2 ? atof(argv[2]) : 0.2;
+
+	/* All fields, so every branch of the CUSTOM format is taken. */
+	output_format = CUSTOM;
+	custom_output_format = strdup("\tatAfmMis");
+	if ( custom_output_format == NULL || !out_check_custom_format(custom_output_format) )
+		return EXIT_FAILURE;
+
+	if (!load_corpus(corpus))
+		return EXIT_FAILURE;
+
+	static char sink_buffer[SINK_SIZE];
+	FILE *sink = fmemopen(sink_buffer, sizeof(sink_buffer), "w");
+	if ( sink == NULL )
+	{
+		fprintf(stderr, "ERROR: fmemopen(): %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stdout, "%-20s %-10s %8s %8s %12s %10s\n",
+			"kernel:", "category:", "records:", "bytes:", "ns/record:", "ns/byte:");
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+	{
+		for (size_t c = 0; c < categories_len; c++)
+		{
+			const double ns = measure(&kernels[k], &categories[c], sink, seconds * 1e9);
+			fprintf(stdout, "%-20s %-10s %8zu %8zu %12.2f %10.3f\n",
+					kernels[k].name, categories[c].name,
+					categories[c].len, categories[c].bytes,
+					ns / (double)categories[c].len,
+					ns / (double)categories[c].bytes);
+		}
+	}
+
+	fclose(sink);
+	if (!measure_iteration(seconds))
+		return EXIT_FAILURE;
+
+	for (size_t c = 0; c < categories_len; c++)
+	{
+		free(categories[c].name);
+		free(categories[c].toplevels);
+	}
+	free(custom_output_format);
+	free_data();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Generate feed recordings, as written by --feed, for benchmarking and testing
+--aggregate.
+
+    recordings.py <directory> <count> <records>
+
+Every recording is generated from its own seed, so the same arguments always
+produce the same files. Besides regular events, the recordings contain
+resets followed by present records, events unknown to lswt, malformed lines
+and escaped or unset app-ids. Some app-ids are spelled in different ways,
+with needless escapes or with different invalid UTF-8, which --aggregate has
+to count as one.
+"""
+
+import os
+import random
+import sys
+
+# Invalid bytes are written through surrogate escapes.
+APP_IDS = ["firefox", "foot", "org.gnome.Nautilus", "app\twith tab", "ünï", "back\\slash", None,
+           "bad\udcff", "bad\udcfe"]
+APP_IDS += ["app%d" % i for i in range(40)]
+
+# Spellings of an escaped app-id which unescape to the same app-id.
+SPELLINGS = {"foot": "f\\o\\ot", "back\\\\slash": "\\back\\\\slash"}
+
+
+def escape(value):
+    if value is None:
+        return "\\N"
+    return value.replace("\\", "\\\\").replace("\t", "\\t").replace("\n", "\\n").replace("\r", "\\r")
+
+
+def generate(seed, records):
+    """Return the lines of a recording with about the given number of records."""
+    rng = random.Random(seed)
+    time = 1700000000000000 + seed * 1000
+    seq = 1
+    lines = []
+    toplevels = {}
+    next_id = 1
+    focused = None
+
+    def record(event, toplevel, previous=None):
+        nonlocal seq
+        app_id, title, activated = toplevels[toplevel]
+        app_id = escape(app_id)
+        if app_id in SPELLINGS and rng.random() < 0.5:
+            app_id = SPELLINGS[app_id]
+        lines.append("%d\t%d\t%s\t%d\t%s\t%s\t%s\t%s" % (
+            seq, time, event, toplevel, "\\N" if previous is None else previous,
+            ("A" if activated else "-") + "----", app_id, escape(title)))
+        seq += 1
+
+    def snapshot():
+        lines.append("%d\t%d\treset" % (seq - 1, time))
+        for toplevel in toplevels:
+            record("present", toplevel)
+
+    for _ in range(rng.randint(0, 4)):
+        toplevels[next_id] = [rng.choice(APP_IDS), "t%d" % next_id, False]
+        next_id += 1
+    snapshot()
+
+    for _ in range(records):
+        time += rng.randint(1, 5000000)
+        choice = rng.random()
+        if choice < 0.1 and len(toplevels) < 32 or not toplevels:
+            toplevels[next_id] = [rng.choice(APP_IDS), "t%d" % next_id, False]
+            record("created", next_id)
+            next_id += 1
+        elif choice < 0.18:
+            toplevel = rng.choice(list(toplevels))
+            toplevels[toplevel][2] = False
+            record("closed", toplevel)
+            del toplevels[toplevel]
+            if focused == toplevel:
+                focused = None
+        elif choice < 0.45:
+            # The activation changes of a focus switch are part of the
+            # focus record.
+            toplevel = rng.choice(list(toplevels))
+            if toplevel == focused:
+                continue
+            if focused is not None:
+                toplevels[focused][2] = False
+            toplevels[toplevel][2] = True
+            record("focus", toplevel, focused)
+            focused = toplevel
+        elif choice < 0.47 and focused is not None:
+            toplevels[focused][2] = False
+            record("changed", focused)
+            focused = None
+        elif choice < 0.49:
+            lines.append(rng.choice(["garbage line", "1\tx\tcreated", "%d\t%d\tclosed\t-1" % (seq, time),
+                                     "%d\t%d\tfocus\t1\tx\t-----\tfoot\tt" % (seq, time)]))
+        elif choice < 0.5:
+            lines.append("%d\t%d\tminimized\t1\t\\N\t-----\tfoot\tt" % (seq, time))
+        elif choice < 0.52:
+            snapshot()
+        else:
+            toplevel = rng.choice(list(toplevels))
+            if rng.random() < 0.1:
+                toplevels[toplevel][0] = rng.choice(APP_IDS)
+            toplevels[toplevel][1] = "x%d" % rng.randint(0, 9)
+            record("changed", toplevel)
+    return lines
+
+
+def write(directory, count, records):
+    """Write count recordings into the directory, returns their paths."""
+    os.makedirs(directory, exist_ok=True)
+    paths = []
+    for seed in range(count):
+        path = os.path.join(directory, "r%03d.tsv" % seed)
+        with open(path, "w", encoding="utf-8", errors="surrogateescape") as f:
+            f.write("\n".join(generate(seed, records)) + "\n")
+        paths.append(path)
+    return paths
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        sys.exit(__doc__.strip())
+    write(sys.argv[1], int(sys.argv[2]), int(sys.argv[3]))
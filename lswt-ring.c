@@ -0,0 +1,215 @@
+/*
+ * lswt - list Wayland toplevels
+ *
+ * Copyright (C) 2021 - 2023 Leon Henrik Plickat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "lswt-ring.h"
+
+/* Reader side of the ring published by "lswt -w --ring". See lswt-ring.h.
+ *
+ * Records are copied out first and only then checked for having been
+ * overwritten in the meantime, like a seqlock: The producer moves reserved
+ * before writing, so if reserved is still within capacity of the cursor after
+ * copying, the copy is intact.
+ */
+
+struct lswt_ring_reader
+{
+	struct lswt_ring_header *header;
+	const unsigned char *data;
+	const unsigned char *snapshot;
+	size_t size;
+	uint64_t cursor;
+};
+
+/** Copy bytes starting at a ring position, which may wrap around. */
+static void ring_copy_out (const struct lswt_ring_reader *reader, const unsigned char *area,
+		uint64_t position, void *dest, size_t len)
+{
+	const uint64_t capacity = reader->header->capacity;
+	const size_t offset = (size_t)(position % capacity);
+	const size_t first = len < capacity - offset ? len : (size_t)(capacity - offset);
+	memcpy(dest, area + offset, first);
+	memcpy((unsigned char *)dest + first, area, len - first);
+}
+
+struct lswt_ring_reader *lswt_ring_open (const char *name)
+{
+	/* Readers only write the waiters count, but that needs a writable
+	 * mapping of the whole header.
+	 */
+	const int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if ( fd < 0 )
+		return NULL;
+
+	struct stat st;
+	if ( fstat(fd, &st) < 0 )
+	{
+		close(fd);
+		return NULL;
+	}
+	const size_t size = (size_t)st.st_size;
+	if ( size < sizeof(struct lswt_ring_header) )
+	{
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED )
+		return NULL;
+
+	struct lswt_ring_header *header = map;
+	if ( header->magic != LSWT_RING_MAGIC || header->version != LSWT_RING_VERSION
+			|| header->capacity == 0
+			|| size != header->header_size + 2 * header->capacity )
+	{
+		munmap(map, size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct lswt_ring_reader *reader = malloc(sizeof(struct lswt_ring_reader));
+	if ( reader == NULL )
+	{
+		munmap(map, size);
+		return NULL;
+	}
+	reader->header = header;
+	reader->data = (const unsigned char *)map + header->header_size;
+	reader->snapshot = reader->data + header->capacity;
+	reader->size = size;
+
+	/* Start with new records. Call lswt_ring_snapshot() for the current state. */
+	reader->cursor = atomic_load_explicit(&header->published, memory_order_acquire);
+	return reader;
+}
+
+void lswt_ring_close (struct lswt_ring_reader *reader)
+{
+	if ( reader == NULL )
+		return;
+	munmap(reader->header, reader->size);
+	free(reader);
+}
+
+enum lswt_ring_status lswt_ring_read (struct lswt_ring_reader *reader,
+		char *buffer, size_t size, size_t *len)
+{
+	struct lswt_ring_header *header = reader->header;
+	const uint64_t published = atomic_load_explicit(&header->published, memory_order_acquire);
+	if ( reader->cursor == published )
+		return LSWT_RING_EMPTY;
+	if ( published - reader->cursor > header->capacity )
+		return LSWT_RING_OVERRUN;
+
+	uint32_t record_len;
+	ring_copy_out(reader, reader->data, reader->cursor, &record_len, sizeof(record_len));
+	const bool fits = record_len <= size && record_len <= header->capacity;
+	if (fits)
+		ring_copy_out(reader, reader->data, reader->cursor + sizeof(record_len), buffer, record_len);
+
+	atomic_thread_fence(memory_order_acquire);
+	const uint64_t reserved = atomic_load_explicit(&header->reserved, memory_order_relaxed);
+	if ( reserved - reader->cursor > header->capacity )
+		return LSWT_RING_OVERRUN;
+
+	*len = record_len;
+	if (!fits)
+		return LSWT_RING_TOO_SMALL;
+	reader->cursor += sizeof(record_len) + record_len;
+	return LSWT_RING_RECORD;
+}
+
+enum lswt_ring_status lswt_ring_snapshot (struct lswt_ring_reader *reader,
+		char *buffer, size_t size, size_t *len)
+{
+	struct lswt_ring_header *header = reader->header;
+	for (;;)
+	{
+		const uint64_t seq = atomic_load_explicit(&header->snapshot_seq, memory_order_acquire);
+		if ( seq % 2 == 1 )
+		{
+			/* The producer is writing the snapshot right now. */
+			sched_yield();
+			continue;
+		}
+
+		const uint64_t position = atomic_load_explicit(&header->snapshot_position, memory_order_relaxed);
+		const uint64_t snapshot_len = atomic_load_explicit(&header->snapshot_len, memory_order_relaxed);
+		const bool fits = snapshot_len <= size && snapshot_len <= header->capacity;
+		if (fits)
+			memcpy(buffer, reader->snapshot, (size_t)snapshot_len);
+
+		atomic_thread_fence(memory_order_acquire);
+		if ( atomic_load_explicit(&header->snapshot_seq, memory_order_relaxed) != seq )
+			continue;
+
+		if ( snapshot_len == UINT64_MAX )
+			return LSWT_RING_NO_SNAPSHOT;
+		*len = (size_t)snapshot_len;
+		if (!fits)
+			return LSWT_RING_TOO_SMALL;
+		reader->cursor = position;
+		return LSWT_RING_RECORD;
+	}
+}
+
+bool lswt_ring_wait (struct lswt_ring_reader *reader, int timeout)
+{
+	struct lswt_ring_header *header = reader->header;
+	const uint32_t notify = atomic_load_explicit(&header->notify, memory_order_acquire);
+	if ( atomic_load_explicit(&header->published, memory_order_acquire) != reader->cursor )
+		return true;
+
+#ifdef __linux__
+	struct timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+	atomic_fetch_add_explicit(&header->waiters, 1, memory_order_seq_cst);
+	const long ret = syscall(SYS_futex, &header->notify, FUTEX_WAIT, notify,
+			timeout < 0 ? NULL : &ts, NULL, 0);
+	atomic_fetch_sub_explicit(&header->waiters, 1, memory_order_seq_cst);
+	return ret == 0 || errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT;
+#else
+	/* Without futexes, poll in intervals of 10ms. */
+	(void)notify;
+	for (int waited = 0; timeout < 0 || waited < timeout; waited += 10)
+	{
+		const struct timespec ts = { .tv_nsec = 10000000L };
+		nanosleep(&ts, NULL);
+		if ( atomic_load_explicit(&header->published, memory_order_acquire) != reader->cursor )
+			break;
+	}
+	return true;
+#endif
+}
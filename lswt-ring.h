@@ -0,0 +1,132 @@
+/*
+ * lswt - list Wayland toplevels
+ *
+ * Copyright (C) 2021 - 2023 Leon Henrik Plickat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LSWT_RING_H
+#define LSWT_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* With --ring, "lswt -w" publishes its event records into a ring buffer in
+ * shared memory. Any number of local processes can read it, each with its own
+ * cursor, without the producer ever waiting for them. The records are the
+ * lines of the --feed socket, see lswt(1).
+ *
+ * A reader which falls behind by more than the ring holds has missed records.
+ * It is told so and can continue from a snapshot of all toplevels, which the
+ * producer keeps up to date next to the ring.
+ *
+ *   struct lswt_ring_reader *reader = lswt_ring_open("/lswt");
+ *   char buffer[4096];
+ *   size_t len;
+ *   for (;;) switch (lswt_ring_read(reader, buffer, sizeof(buffer), &len))
+ *   {
+ *           case LSWT_RING_RECORD:  handle(buffer, len);                  break;
+ *           case LSWT_RING_EMPTY:   lswt_ring_wait(reader, -1);           break;
+ *           case LSWT_RING_OVERRUN: lswt_ring_snapshot(reader, ...);      break;
+ *           default:                error();
+ *   }
+ */
+
+#define LSWT_RING_MAGIC   0x474e49525457534c /* "LSWTRING" */
+#define LSWT_RING_VERSION 1
+
+/**
+ * Layout of the shared memory object: This header, followed by the ring of
+ * capacity bytes and the snapshot area of another capacity bytes.
+ *
+ * Positions count the bytes ever written, the byte of a position being at
+ * position % capacity. Every record is a native endian uint32_t length
+ * followed by that many bytes of text, and may wrap around the end of the ring.
+ */
+struct lswt_ring_header
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t capacity;
+
+	/**
+	 * End of the record currently being written. Bytes before
+	 * reserved - capacity may already have been overwritten.
+	 */
+	_Atomic uint64_t reserved;
+
+	/** End of the last complete record. */
+	_Atomic uint64_t published;
+
+	/** Incremented for every record, readers wait on it with futex(2). */
+	_Atomic uint32_t notify;
+
+	/** Number of readers waiting, so the producer only wakes if needed. */
+	_Atomic uint32_t waiters;
+
+	/** Seqlock of the snapshot area, odd while the snapshot is written. */
+	_Atomic uint64_t snapshot_seq;
+
+	/** Ring position up to which records are contained in the snapshot. */
+	_Atomic uint64_t snapshot_position;
+
+	/** Length of the snapshot, UINT64_MAX if it did not fit. */
+	_Atomic uint64_t snapshot_len;
+};
+
+enum lswt_ring_status
+{
+	LSWT_RING_RECORD,
+	LSWT_RING_EMPTY,
+
+	/** Records have been overwritten before they could be read. */
+	LSWT_RING_OVERRUN,
+
+	/** The buffer is too small, the required size is stored in len. */
+	LSWT_RING_TOO_SMALL,
+
+	/** The snapshot did not fit into the shared memory object. */
+	LSWT_RING_NO_SNAPSHOT,
+};
+
+struct lswt_ring_reader;
+
+/** Open the ring of "lswt -w --ring <name>". Returns NULL and sets errno on error. */
+struct lswt_ring_reader *lswt_ring_open (const char *name);
+void lswt_ring_close (struct lswt_ring_reader *reader);
+
+/**
+ * Read the next record into the buffer. Never blocks. After an overrun, the
+ * cursor stays where it is until lswt_ring_snapshot() is called.
+ */
+enum lswt_ring_status lswt_ring_read (struct lswt_ring_reader *reader,
+		char *buffer, size_t size, size_t *len);
+
+/**
+ * Copy the current snapshot into the buffer and move the cursor to the first
+ * record not contained in it.
+ */
+enum lswt_ring_status lswt_ring_snapshot (struct lswt_ring_reader *reader,
+		char *buffer, size_t size, size_t *len);
+
+/**
+ * Wait until a record may be available or the timeout in milliseconds
+ * expired. A negative timeout waits forever. Returns false on error.
+ */
+bool lswt_ring_wait (struct lswt_ring_reader *reader, int timeout);
+
+#endif
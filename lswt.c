@@ -17,8 +17,16 @@
  */
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <regex.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,10 +34,20 @@
 #include <errno.h>
 #include <assert.h>
 #include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <wayland-client.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef __linux__
 #include <features.h>
+#include <linux/futex.h>
 #include <linux/landlock.h>
 #include <sys/syscall.h>
 #ifdef __GLIBC__
@@ -39,6 +57,8 @@
 
 #include "wlr-foreign-toplevel-management-unstable-v1.h"
 #include "ext-foreign-toplevel-list-v1.h"
+#include "cosmic-toplevel-info-unstable-v1.h"
+#include "lswt-ring.h"
 
 #define BOOL_TO_STR(B) (B) ? "true" : "false"
 
@@ -49,17 +69,104 @@ const char usage[] =
 	"  -h,        --help           Print this helpt text and exit.\n"
 	"  -v,        --version        Print version and exit.\n"
 	"  -j,        --json           Output data in JSON format.\n"
-	"  -w,        --watch          Run continously and log events.\n"
-	"  -c <fmt>, --custom <fmt>    Define a custom line-based output format.\n";
+	"  -t,        --tsv            Output data as tab separated values.\n"
+	"  -0,        --null           Output unescaped fields separated by the unit\n"
+	"                              separator (0x1F), toplevels terminated by NUL.\n"
+	"  -w,        --watch          Run continously and log events or snapshots.\n"
+	"  -c <fmt>, --custom <fmt>    Define a custom line-based output format.\n"
+	"  -s <query>, --search <query>\n"
+	"                              Only list toplevels matching the query, best first.\n"
+	"                              With -w, read new queries from stdin.\n"
+	"  --sort <keys>               Sort by comma separated keys: app-id, title, id,\n"
+	"                              state, mru. Prefix a key with '-' to reverse it.\n"
+	"  --group-by <key>            Keep toplevels with the same app-id together, or\n"
+	"                              normalized-app-id or normalized-title.\n"
+	"  --normalize <path>          Normalize titles and app-ids by the rules in path.\n"
+	"  --changed-within <time>     In watch mode, only list toplevels changed within\n"
+	"                              this many seconds (s, m, h, d suffixes).\n"
+	"  --max-memory <size>         Limit memory used for toplevels (K, M, G suffixes).\n"
+	"  --max-title-bytes <size>    Truncate longer titles.\n"
+	"  --on-created <template>     In watch mode, print a line for created,\n"
+	"  --on-changed <template>     changed or closed toplevels. Templates use %-fields\n"
+	"  --on-closed <template>      like -c, plus %I (id), %e (event), %c (changes).\n"
+	"                              -c and templates also have %C, %U, %L, the time\n"
+	"                              of creation, last change and last activation,\n"
+	"                              %T and %N the normalized title and app-id.\n"
+	"  --on-focus <template>       In watch mode, print a line when the focus moved\n"
+	"                              to another toplevel, %P being the previous id.\n"
+	"  --feed <path>               In watch mode, serve a resumable change feed on\n"
+	"                              a unix socket.\n"
+	"  --feed-size <records>       Number of records kept for resuming the feed.\n"
+	"  --ring <name>               In watch mode, publish events into a ring buffer\n"
+	"                              in shared memory, see lswt-ring.h.\n"
+	"  --ring-size <size>          Size of the ring buffer (K, M, G suffixes).\n"
+	"  --trace                     In watch mode, output state spans and events in\n"
+	"                              the Chrome trace event format.\n"
+	"  --replay <path>             Read a feed recording for --trace instead of\n"
+	"                              connecting to the Wayland server.\n"
+	"  --history <path>            In watch mode, record the number of toplevels per\n"
+	"                              app-id in a round-robin database.\n"
+	"  --history-query <from[,to]> Print the recorded history of the time range.\n"
+	"  --ping <ms>                 Measure sync round-trips in this interval, alone\n"
+	"                              or in watch mode, and print a histogram.\n"
+	"  --ping-count <n>            Stop after this many round-trips.\n"
+	"  --ping-stall <ms>           Report round-trips taking this long (default 50).\n"
+	"  --transitions <path>        In watch mode, count focus transitions between\n"
+	"                              app-ids, kept in path and dumped as JSON.\n"
+	"  --transitions-half-life <hours>\n"
+	"                              Half life of transition counts (default 168).\n"
+	"  --aggregate <path...>       Merge the focus time, toplevel count and event\n"
+	"                              rates per app-id of feed recordings into a JSON\n"
+	"                              report. Must be the last option.\n"
+	"  --cbor                      Write the report of --aggregate as CBOR.\n"
+	"  --jobs <n>                  Threads for --aggregate (default one per core).\n"
+	"  --protocol <name>           Use ext, zwlr or the best available protocol (auto).\n"
+	"  --stats                     Print protocol statistics on exit.\n";
 
 enum Output_format
 {
 	NORMAL,
 	CUSTOM,
 	JSON,
+	TSV,
+	NUL_SEPARATED,
 };
 enum Output_format output_format = NORMAL;
 char *custom_output_format = NULL;
+char *search_query = NULL;
+
+enum Sort_key
+{
+	SORT_APP_ID,
+	SORT_TITLE,
+	SORT_ID,
+	SORT_STATE,
+	SORT_MRU,
+};
+struct Sort_field
+{
+	enum Sort_key key;
+	bool reverse;
+};
+#define MAX_SORT_FIELDS 8
+struct Sort_field sort_fields[MAX_SORT_FIELDS];
+size_t sort_fields_len = 0;
+
+/** Set by --group-by. Groups are ordered by the key, see group_key(). */
+enum Group_key
+{
+	GROUP_NONE,
+	GROUP_APP_ID,
+	GROUP_NORMALIZED_APP_ID,
+	GROUP_NORMALIZED_TITLE,
+};
+enum Group_key group_by = GROUP_NONE;
+
+/**
+ * Set by --changed-within, in microseconds. Only toplevels which changed
+ * within this time before the output is written are listed, 0 meaning all.
+ */
+uint64_t changed_within = 0;
 
 enum Mode
 {
@@ -76,6 +183,33 @@ int ret = EXIT_SUCCESS;
 bool loop = true;
 bool debug_log = false;
 
+/**
+ * Set when a toplevel changed. In WATCH mode with an alternative output format
+ * a new snapshot is written once all pending events are handled.
+ */
+bool snapshot_outdated = false;
+
+/**
+ * CLOCK_MONOTONIC time at which the oldest change listed in the last snapshot
+ * is no longer within --changed-within, UINT64_MAX if none expires.
+ */
+uint64_t snapshot_expiry = UINT64_MAX;
+
+/**
+ * Set if any of --on-created, --on-changed, --on-closed and --on-focus is
+ * given. Those replace the default event log of WATCH mode.
+ */
+bool event_templates = false;
+
+/** Set by --trace, which replaces the output of WATCH mode. */
+bool trace = false;
+
+/** Set if --ping is used without --watch, which only pings. */
+bool ping_only = false;
+
+/** Set once the second sync is done and all initial toplevels are known. */
+bool toplevels_known = false;
+
 struct wl_display *wl_display = NULL;
 struct wl_registry *wl_registry = NULL;
 struct wl_callback *sync_callback = NULL;
@@ -88,6 +222,12 @@ struct wl_callback *sync_callback = NULL;
 struct zwlr_foreign_toplevel_manager_v1 *zwlr_toplevel_manager = NULL;
 struct ext_foreign_toplevel_list_v1 *ext_toplevel_list = NULL;
 
+/* Extension protocols for ext-foreign-toplevel-list-v1, which itself only
+ * provides title, app-id and identifier. They are only bound if the ext
+ * protocol is used and need one additional sync, see sync_handle_done().
+ */
+struct zcosmic_toplevel_info_v1 *cosmic_toplevel_info = NULL;
+
 enum UsedProtocol
 {
 	NONE,
@@ -96,10 +236,39 @@ enum UsedProtocol
 };
 enum UsedProtocol used_protocol;
 
-struct wl_list toplevels;
+/** Set by --protocol, NONE meaning the best available protocol is used. */
+enum UsedProtocol requested_protocol = NONE;
+
+/* Globals are only recorded while the registry advertises them and bound after
+ * the first sync, once we know which protocol to use. Binding both toplevel
+ * protocols would make the server enumerate every toplevel twice.
+ */
+struct Global
+{
+	bool advertised;
+	uint32_t name;
+	uint32_t version;
+};
+struct Global zwlr_toplevel_manager_global = { 0 };
+struct Global ext_toplevel_list_global = { 0 };
+struct Global cosmic_toplevel_info_global = { 0 };
+
+/** Counters printed by --stats. */
+struct
+{
+	bool enabled;
+	size_t globals;
+	size_t bound;
+	size_t syncs;
+	size_t toplevels;
+	size_t events;
+} stats = { 0 };
 
 static void noop () {}
 
+/** For events of toplevel handles we do not care about. */
+static void count_event () { stats.events++; }
+
 /* We want to cleanly exit on SIGINT (f.e. when Ctrl-C is pressed in WATCH mode)
  * however after exiting the signal handler wl_display_dispatch() will just
  * continue until the next event from the server. We can not sync in the signal
@@ -117,6 +286,7 @@ bool support_activated = false;
 bool support_maximized = false;
 bool support_minimized = false;
 bool support_identifier = false;
+bool support_sticky = false;
 
 static void update_capabilities (void)
 {
@@ -131,6 +301,14 @@ static void update_capabilities (void)
 
 		case EXT_FOREIGN_TOPLEVEL:
 			support_identifier = true;
+			if ( cosmic_toplevel_info != NULL )
+			{
+				support_fullscreen = true;
+				support_activated = true;
+				support_maximized = true;
+				support_minimized = true;
+				support_sticky = true;
+			}
 			break;
 
 		case NONE: /* Unreachable. */
@@ -139,942 +317,7257 @@ static void update_capabilities (void)
 	}
 }
 
-/******************
- *                *
- *    Toplevel    *
- *                *
- ******************/
-struct Toplevel
+/***********************
+ *                     *
+ *    Memory budget    *
+ *                     *
+ ***********************/
+/* Bytes held by the toplevel slab and the strings of toplevels, including
+ * cached renderings and the search index. Limited by --max-memory, 0 meaning
+ * no limit.
+ */
+size_t memory_used = 0;
+size_t memory_peak = 0;
+size_t memory_limit = 0;
+
+/** Limit for titles set by --max-title-bytes, 0 meaning no limit. */
+size_t max_title_bytes = 0;
+
+/**
+ * Strings shortened to fit the limits, toplevels ignored because of them and
+ * toplevels left out of the search index.
+ */
+size_t truncated_strings = 0;
+size_t ignored_toplevels = 0;
+size_t unindexed_toplevels = 0;
+
+static size_t memory_available (void)
 {
-	struct wl_list link;
+	if ( memory_limit == 0 )
+		return SIZE_MAX;
+	return memory_limit > memory_used ? memory_limit - memory_used : 0;
+}
 
-	/** Internal id, used in WATCH mode. */
-	size_t id;
+/** Account for bytes about to be allocated. Returns false if over budget. */
+static bool memory_reserve (size_t bytes)
+{
+	if ( bytes > memory_available() )
+		return false;
+	memory_used += bytes;
+	if ( memory_used > memory_peak )
+		memory_peak = memory_used;
+	return true;
+}
 
-	struct zwlr_foreign_toplevel_handle_v1 *zwlr_handle;
-	struct ext_foreign_toplevel_handle_v1 *ext_handle;
+static void memory_release (size_t bytes)
+{
+	assert(memory_used >= bytes);
+	memory_used -= bytes;
+}
 
-	char *title;
-	char *app_id;
+static void memory_report (void)
+{
+	if (debug_log)
+		fprintf(stderr, "[Peak memory used by toplevels: %zu bytes.]\n", memory_peak);
+	if ( truncated_strings > 0 || ignored_toplevels > 0 || unindexed_toplevels > 0 )
+		fprintf(stderr, "Memory limits: truncated %zu strings, ignored %zu toplevels, "
+				"left %zu toplevels out of the search index.\n",
+				truncated_strings, ignored_toplevels, unindexed_toplevels);
+}
 
-	/**
-	 * Optional data. Whether these are supported depends on the bound
-	 * protocol(s). See update_capabilities() and related globals.
-	 */
-	char *identifier;
-	bool fullscreen;
-	bool activated;
-	bool maximized;
-	bool minimized;
+/**
+ * Parse a size in bytes, optionally followed by a K, M or G suffix for
+ * multiples of 1024. Returns false if the size is invalid.
+ */
+static bool parse_size (const char *str, size_t *size)
+{
+	char *end;
+	errno = 0;
+	const unsigned long long value = strtoull(str, &end, 10);
+	if ( errno != 0 || end == str || *str == '-' )
+		return false;
 
-	/**
-	 * True if this toplevel has already been added to the list, false
-	 * otherwise. Used to prevent accidentally appending the same toplevel
-	 * multiple times if toplevel_handle_done is called more than once.
-	 */
-	bool listed;
-};
+	unsigned int shift = 0;
+	switch (*end)
+	{
+		case '\0':           break;
+		case 'K': case 'k': shift = 10; end++; break;
+		case 'M': case 'm': shift = 20; end++; break;
+		case 'G': case 'g': shift = 30; end++; break;
+		default:            return false;
+	}
+	if ( *end != '\0' || value > (SIZE_MAX >> shift) )
+		return false;
 
-/** Allocate a new Toplevel and initialize it. Returns pointer to the Toplevel. */
-static struct Toplevel *toplevel_new (void)
+	*size = (size_t)value << shift;
+	return true;
+}
+
+/****************
+ *              *
+ *    String    *
+ *              *
+ ****************/
+#define STRING_INLINE_SIZE 24
+
+/**
+ * A string which may be unset (like a NULL pointer). Strings shorter than
+ * STRING_INLINE_SIZE, which includes most app-ids and identifiers, are stored
+ * inline and do not need an allocation of their own.
+ */
+struct String
 {
-	struct Toplevel *new = calloc(1, sizeof(struct Toplevel));
-	if ( new == NULL )
+	union
 	{
-		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		char inline_data[STRING_INLINE_SIZE];
+		char *heap_data;
+	};
+	uint32_t len;
+	bool set;
+	bool on_heap;
+};
+
+/** Return the value of the string or NULL if it is unset. */
+static const char *string_get (const struct String *str)
+{
+	if (!str->set)
 		return NULL;
+	return str->on_heap ? str->heap_data : str->inline_data;
+}
+
+static void string_free (struct String *str)
+{
+	if (str->on_heap)
+	{
+		free(str->heap_data);
+		memory_release((size_t)str->len + 1);
 	}
+	str->set = false;
+	str->on_heap = false;
+	str->len = 0;
+}
 
-	static size_t id_counter = 0;
+/**
+ * Return the length of the longest prefix of the first len bytes of str which
+ * is at most max bytes long and does not end within a UTF-8 sequence.
+ */
+static size_t utf8_truncate (const char *str, size_t len, size_t max)
+{
+	if ( len <= max )
+		return len;
+	while ( max > 0 && ((unsigned char)str[max] & 0xC0) == 0x80 )
+		max--;
+	return max;
+}
 
-	new->id = id_counter++;
-	new->zwlr_handle = NULL;
-	new->ext_handle = NULL;
-	new->title = NULL;
-	new->app_id = NULL;
-	new->identifier = NULL;
-	new->listed = false;
-
-	new->fullscreen = false;
-	new->activated = false;
-	new->maximized = false;
-	new->minimized = false;
-
-	if ( mode == WATCH || debug_log )
-		fprintf(stdout, "toplevel %ld: created\n", new->id);
+/** Strings containing invalid UTF-8 which have been repaired. */
+size_t repaired_strings = 0;
 
-	return new;
+/**
+ * Return the number of leading ASCII bytes of the first len bytes of str.
+ * Looks at 16 bytes per step, as almost all titles and app-ids are ASCII.
+ */
+static size_t ascii_prefix (const unsigned char *str, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16)
+		if ( _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + i))) != 0 )
+			break;
+#else
+	for (; i + 16 <= len; i += 16)
+	{
+		uint64_t a, b;
+		memcpy(&a, str + i, sizeof(a));
+		memcpy(&b, str + i + 8, sizeof(b));
+		if ( ((a | b) & 0x8080808080808080) != 0 )
+			break;
+	}
+#endif
+	while ( i < len && str[i] < 0x80 )
+		i++;
+	return i;
 }
 
-/** Destroys a toplevel and removes it from the list, if it is listed. */
-static void toplevel_destroy (struct Toplevel *self)
+/**
+ * Return the length of the UTF-8 sequence at the start of the first len bytes
+ * of str and whether it is valid. Overlong encodings, surrogates and
+ * codepoints above U+10FFFF are invalid. For invalid sequences, the length is
+ * that of the longest prefix which could have started a valid one, but at
+ * least 1, so each is replaced by a single U+FFFD as Unicode recommends.
+ */
+static size_t utf8_sequence (const unsigned char *str, size_t len, bool *valid)
 {
-	if ( mode == WATCH || debug_log )
-		fprintf(stdout, "toplevel %ld: destroyed\n", self->id);
+	unsigned char low = 0x80, high = 0xBF;
+	size_t n;
+	*valid = false;
+	if ( str[0] < 0x80 )
+		n = 0;
+	else if ( str[0] >= 0xC2 && str[0] <= 0xDF )
+		n = 1;
+	else if ( str[0] >= 0xE0 && str[0] <= 0xEF )
+	{
+		n = 2;
+		if ( str[0] == 0xE0 )
+			low = 0xA0;
+		else if ( str[0] == 0xED )
+			high = 0x9F;
+	}
+	else if ( str[0] >= 0xF0 && str[0] <= 0xF4 )
+	{
+		n = 3;
+		if ( str[0] == 0xF0 )
+			low = 0x90;
+		else if ( str[0] == 0xF4 )
+			high = 0x8F;
+	}
+	else
+		return 1;
 
-	if ( self->zwlr_handle != NULL )
-		zwlr_foreign_toplevel_handle_v1_destroy(self->zwlr_handle);
-	if ( self->ext_handle != NULL )
-		ext_foreign_toplevel_handle_v1_destroy(self->ext_handle);
-	if ( self->title != NULL )
-		free(self->title);
-	if ( self->app_id != NULL )
-		free(self->app_id);
-	if ( self->identifier != NULL )
-		free(self->identifier);
-	if (self->listed)
-		wl_list_remove(&self->link);
-	free(self);
+	for (size_t i = 1; i <= n; i++)
+	{
+		if ( i >= len || str[i] < low || str[i] > high )
+			return i;
+		low = 0x80;
+		high = 0xBF;
+	}
+	*valid = true;
+	return n + 1;
 }
 
-/** Set the title of the toplevel. Called from protocol implementations. */
-static void toplevel_set_title (struct Toplevel *self, const char *title)
+/** Return the codepoint of a valid UTF-8 sequence of n bytes, see utf8_sequence(). */
+static uint32_t utf8_codepoint (const unsigned char *str, size_t n)
 {
-	if ( mode == WATCH || debug_log )
-		fprintf(stdout, "toplevel %ld: set title: '%s' -> '%s'\n",
-				self->id, self->title, title);
+	static const unsigned char lead_mask[] = { 0x7F, 0x1F, 0x0F, 0x07 };
+	uint32_t cp = str[0] & lead_mask[n-1];
+	for (size_t i = 1; i < n; i++)
+		cp = (cp << 6) | (str[i] & 0x3F);
+	return cp;
+}
 
-	if ( self->title != NULL )
-		free(self->title);
-	self->title = strdup(title);
-	if ( self->title == NULL )
-		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+static bool utf8_valid (const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t i = 0;
+	while ( (i += ascii_prefix(s + i, len - i)) < len )
+	{
+		bool valid;
+		i += utf8_sequence(s + i, len - i, &valid);
+		if (!valid)
+			return false;
+	}
+	return true;
 }
 
-/** Set the app-id of the toplevel. Called from protocol implementations. */
-static size_t real_strlen (const char *str);
-static void toplevel_set_app_id (struct Toplevel *self, const char *app_id)
+/**
+ * Return a copy of value with every invalid UTF-8 sequence replaced by U+FFFD,
+ * which the caller has to free, or NULL if value is valid UTF-8 or the copy
+ * could not be allocated. Strings are validated once when they are set, so
+ * output never has to deal with invalid UTF-8, which JSON parsers reject.
+ */
+static char *utf8_repair (const char *value)
 {
-	if ( mode == WATCH || debug_log )
-		fprintf(stdout, "toplevel %ld: set app-id: '%s' -> '%s'\n",
-				self->id, self->app_id, app_id);
+	const size_t len = strlen(value);
+	if (utf8_valid(value, len))
+		return NULL;
 
-	if ( self->app_id != NULL )
-		free(self->app_id);
-	self->app_id = strdup(app_id);
-	if ( self->app_id == NULL )
+	/* A replacement character is at most three times as long as what it replaces. */
+	char *repaired = malloc(len * 3 + 1);
+	if ( repaired == NULL )
 	{
-		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
-		return;
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return NULL;
 	}
+	const unsigned char *s = (const unsigned char *)value;
+	char *out = repaired;
+	size_t i = 0;
+	while ( i < len )
+	{
+		const size_t run = ascii_prefix(s + i, len - i);
+		memcpy(out, s + i, run);
+		out += run;
+		i += run;
+		if ( i == len )
+			break;
 
-	/* Used when printing output in the default human readable format. */
-	const size_t len = real_strlen(app_id);
-	if ( len > longest_app_id && max_app_id_padding > len )
-		longest_app_id = len;
+		bool valid;
+		const size_t n = utf8_sequence(s + i, len - i, &valid);
+		if (valid)
+		{
+			memcpy(out, s + i, n);
+			out += n;
+		}
+		else
+		{
+			memcpy(out, "\xEF\xBF\xBD", 3);
+			out += 3;
+		}
+		i += n;
+	}
+	*out = '\0';
+	repaired_strings++;
+	return repaired;
 }
 
-/** Set the identifier of the toplevel. Called from protocol implementations. */
-static void toplevel_set_identifier (struct Toplevel *self, const char *identifier)
+static void repair_report (void)
 {
-	if ( mode == WATCH || debug_log )
-		fprintf(stdout, "toplevel %ld: set identifier: %s\n",
-				self->id, identifier);
+	if ( repaired_strings > 0 )
+		fprintf(stderr, "Invalid UTF-8: repaired %zu strings.\n", repaired_strings);
+}
 
-	if ( self->identifier != NULL )
+/**
+ * Set the string to a copy of value, truncated to at most max_len bytes (0
+ * meaning no limit). Values which do not fit the memory budget are truncated
+ * to what fits, but at least to what can be stored inline. Returns false on
+ * allocation failure.
+ */
+static bool string_set (struct String *str, const char *value, size_t max_len)
+{
+	string_free(str);
+
+	const size_t full_len = strlen(value);
+	size_t len = full_len;
+	if ( max_len > 0 )
+		len = utf8_truncate(value, len, max_len);
+	if ( len >= STRING_INLINE_SIZE && !memory_reserve(len + 1) )
 	{
-		fputs("ERROR: protocol-error: Compositor changed identifier of toplevel, "
-				"which is forbidden by the protocol. Continuing anyway...\n", stderr);
-		free(self->identifier);
+		const size_t available = memory_available();
+		if ( available > STRING_INLINE_SIZE )
+			len = utf8_truncate(value, len, available - 1);
+		else
+			len = utf8_truncate(value, len, STRING_INLINE_SIZE - 1);
+		if ( len >= STRING_INLINE_SIZE )
+			memory_reserve(len + 1);
 	}
-	self->identifier = strdup(identifier);
-	if ( self->identifier == NULL )
-		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+	if ( len < full_len )
+		truncated_strings++;
+
+	if ( len < STRING_INLINE_SIZE )
+	{
+		memcpy(str->inline_data, value, len);
+		str->inline_data[len] = '\0';
+	}
+	else
+	{
+		str->heap_data = malloc(len + 1);
+		if ( str->heap_data == NULL )
+		{
+			fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+			memory_release(len + 1);
+			return false;
+		}
+		memcpy(str->heap_data, value, len);
+		str->heap_data[len] = '\0';
+		str->on_heap = true;
+	}
+	str->len = (uint32_t)len;
+	str->set = true;
+	return true;
 }
 
-static void toplevel_set_fullscreen (struct Toplevel *self, bool fullscreen)
+/**
+ * Return whether the string is set to value, truncated to at most max_len
+ * bytes (0 meaning no limit) the same way string_set() truncates it.
+ */
+static bool string_equals (const struct String *str, const char *value, size_t max_len)
 {
-	if (debug_log)
-		fprintf(stdout, "[toplevel %ld: set fullscreen: %d]\n",
-				self->id, fullscreen);
-	self->fullscreen = fullscreen;
+	if (!str->set)
+		return false;
+	size_t len = strlen(value);
+	if ( max_len > 0 )
+		len = utf8_truncate(value, len, max_len);
+	return str->len == len && memcmp(string_get(str), value, len) == 0;
 }
 
-static void toplevel_set_activated (struct Toplevel *self, bool activated)
+/** FNV-1a of len bytes, with the seed mixed into the offset basis. */
+static uint64_t hash_bytes (const char *data, size_t len, uint64_t seed)
 {
-	if (debug_log)
-		fprintf(stdout, "[toplevel %ld: set activated: %d]\n",
-				self->id, activated);
-	self->activated = activated;
+	uint64_t hash = 0xcbf29ce484222325 ^ seed;
+	for (size_t i = 0; i < len; i++)
+		hash = ( hash ^ (unsigned char)data[i] ) * 0x100000001b3;
+	return hash;
 }
 
-static void toplevel_set_maximized (struct Toplevel *self, bool maximized)
+static uint64_t hash_string_seeded (const char *str, uint64_t seed)
 {
-	if (debug_log)
-		fprintf(stdout, "[toplevel %ld: set maximized: %d]\n",
-				self->id, maximized);
-	self->maximized = maximized;
+	return hash_bytes(str, str != NULL ? strlen(str) : 0, seed);
 }
 
-static void toplevel_set_minimized (struct Toplevel *self, bool minimized)
+static uint64_t hash_string (const char *str)
 {
-	if (debug_log)
-		fprintf(stdout, "[toplevel %ld: set minimized: %d]\n",
-				self->id, minimized);
-	self->minimized = minimized;
+	return hash_string_seeded(str, 0);
 }
 
-static void toplevel_done (struct Toplevel *self)
+/***********************
+ *                     *
+ *    Normalization    *
+ *                     *
+ ***********************/
+/* --normalize reads rules which map titles and app-ids to a normalized form
+ * with far fewer distinct values, for grouping and labelling. Titles are
+ * rewritten by regular expressions, replacing volatile parts like counters
+ * with something stable. App-ids are canonicalized through a table of
+ * aliases. Rules are applied once when a string is set and the result is kept
+ * next to it.
+ *
+ * Every line of the rules file holds three tab separated values:
+ *
+ *   title   <TAB> regular expression <TAB> replacement
+ *   app-id  <TAB> alias              <TAB> canonical app-id
+ *
+ * Title rules are POSIX extended regular expressions, applied in order to
+ * every match, like "s/regex/replacement/g" of sed. "\0" to "\9" in the
+ * replacement insert the match and its subexpressions, "\\" a backslash.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * The aliases are a static set, so they are looked up in a perfect hash table
+ * built with hash and displace: Aliases are distributed over buckets by one
+ * hash. Then, largest bucket first, a seed is searched for which a second hash
+ * moves all aliases of the bucket into free slots. A lookup hashes twice and
+ * compares a single string.
+ */
+#define TITLE_RULE_MAX_MATCHES 10
+
+struct Title_rule
 {
-	if (debug_log)
-		fprintf(stderr, "[toplevel %ld: done]", self->id);
+	regex_t regex;
+	char *replacement;
+};
 
-	if (self->listed)
-		return;
-	self->listed = true;
+struct Alias
+{
+	char *alias;
+	char *canonical;
+};
 
-	wl_list_insert(&toplevels, &self->link);
-}
+/** Set if rules have been loaded with --normalize. */
+bool normalize = false;
 
-/*****************************************************
- *                                                   *
- *    ext-foreign-toplevel-list-v1 implementation    *
- *                                                   *
- *****************************************************/
-static void ext_foreign_handle_handle_identifier (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
-		const char *identifier)
+struct Title_rule *title_rules = NULL;
+size_t title_rules_len = 0;
+
+struct Alias *aliases = NULL;
+size_t aliases_len = 0;
+
+/** Seed of the slot hash of every bucket. */
+uint32_t *alias_seeds = NULL;
+size_t alias_buckets = 0;
+
+/** Index into aliases for every slot, UINT32_MAX if free. */
+uint32_t *alias_slots = NULL;
+size_t alias_slots_len = 0;
+
+static size_t alias_bucket (const char *alias)
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_set_identifier(toplevel, identifier);
+	return (size_t)(hash_string(alias) % alias_buckets);
 }
 
-static void ext_foreign_handle_handle_title (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
-		const char *title)
+static size_t alias_slot (const char *alias, uint32_t seed)
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_set_title(toplevel, title);
+	uint64_t hash = hash_string_seeded(alias, seed);
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9;
+	hash ^= hash >> 32;
+	return (size_t)(hash % alias_slots_len);
 }
 
-static void ext_foreign_handle_handle_app_id (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
-		const char *app_id)
+/** Return the canonical app-id for the alias, NULL if it is none. */
+static const char *alias_lookup (const char *app_id)
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_set_app_id(toplevel, app_id);
+	if ( aliases_len == 0 || app_id == NULL )
+		return NULL;
+	const uint32_t index = alias_slots[alias_slot(app_id, alias_seeds[alias_bucket(app_id)])];
+	if ( index != UINT32_MAX && strcmp(aliases[index].alias, app_id) == 0 )
+		return aliases[index].canonical;
+	return NULL;
 }
 
-static void ext_foreign_handle_handle_done (void *data, struct ext_foreign_toplevel_handle_v1 *handle)
+struct Alias_bucket
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_done(toplevel);
+	uint32_t bucket;
+	uint32_t len;
+};
+
+static int compare_alias_buckets (const void *a, const void *b)
+{
+	const struct Alias_bucket *x = (const struct Alias_bucket *)a;
+	const struct Alias_bucket *y = (const struct Alias_bucket *)b;
+	return (x->len < y->len) - (x->len > y->len);
 }
 
-static void ext_foreign_handle_handle_closed (void *data, struct ext_foreign_toplevel_handle_v1 *handle)
+/**
+ * Try to move all aliases of a bucket into free slots with the given seed.
+ * Either all or none are placed.
+ */
+static bool alias_place (const uint32_t *members, uint32_t len, uint32_t seed)
 {
-	/* We only care when watching for events. */
-	if ( mode == WATCH )
+	for (uint32_t i = 0; i < len; i++)
 	{
-		struct Toplevel *toplevel = (struct Toplevel *)data;
-		toplevel_destroy(toplevel);
+		const size_t slot = alias_slot(aliases[members[i]].alias, seed);
+		if ( alias_slots[slot] != UINT32_MAX )
+		{
+			for (uint32_t j = 0; j < i; j++)
+				alias_slots[alias_slot(aliases[members[j]].alias, seed)] = UINT32_MAX;
+			return false;
+		}
+		alias_slots[slot] = members[i];
 	}
+	return true;
 }
 
-static const struct ext_foreign_toplevel_handle_v1_listener ext_handle_listener = {
-	.app_id       = ext_foreign_handle_handle_app_id,
-	.closed       = ext_foreign_handle_handle_closed,
-	.done         = ext_foreign_handle_handle_done,
-	.identifier   = ext_foreign_handle_handle_identifier,
-	.title        = ext_foreign_handle_handle_title,
-};
-
-static void ext_toplevel_list_handle_toplevel (void *data,
-		struct ext_foreign_toplevel_list_v1 *list,
-		struct ext_foreign_toplevel_handle_v1 *handle)
+/** Build the perfect hash table of the aliases. Prints error messages accordingly. */
+static bool aliases_build (void)
 {
-	if ( used_protocol != EXT_FOREIGN_TOPLEVEL )
+	alias_buckets = aliases_len / 4 + 1;
+	alias_slots_len = aliases_len + aliases_len / 4 + 1;
+	alias_seeds = calloc(alias_buckets, sizeof(uint32_t));
+	alias_slots = malloc(alias_slots_len * sizeof(uint32_t));
+	size_t *starts = calloc(alias_buckets + 1, sizeof(size_t));
+	uint32_t *members = calloc(aliases_len + 1, sizeof(uint32_t));
+	struct Alias_bucket *order = calloc(alias_buckets, sizeof(struct Alias_bucket));
+	bool ok = false;
+	if ( alias_seeds == NULL || alias_slots == NULL || starts == NULL || members == NULL || order == NULL )
 	{
-		assert(used_protocol != NONE);
-		ext_foreign_toplevel_handle_v1_destroy(handle);
-		return;
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		goto out;
 	}
+	memset(alias_slots, 0xff, alias_slots_len * sizeof(uint32_t));
 
-	struct Toplevel *toplevel = toplevel_new();
-	if ( toplevel == NULL )
-		return;
-	toplevel->ext_handle = handle;
-	ext_foreign_toplevel_handle_v1_add_listener(handle, &ext_handle_listener, toplevel);
-}
+	/* Group the aliases by bucket. */
+	for (size_t i = 0; i < aliases_len; i++)
+		starts[alias_bucket(aliases[i].alias) + 1]++;
+	for (size_t i = 0; i < alias_buckets; i++)
+	{
+		order[i] = (struct Alias_bucket){ .bucket = (uint32_t)i, .len = (uint32_t)starts[i+1] };
+		starts[i+1] += starts[i];
+	}
+	for (size_t i = 0; i < aliases_len; i++)
+		members[starts[alias_bucket(aliases[i].alias)]++] = (uint32_t)i;
+	for (size_t i = alias_buckets; i > 0; i--)
+		starts[i] = starts[i-1];
+	starts[0] = 0;
+	qsort(order, alias_buckets, sizeof(struct Alias_bucket), compare_alias_buckets);
+
+	for (size_t i = 0; i < alias_buckets && order[i].len > 0; i++)
+	{
+		const uint32_t *bucket = &members[starts[order[i].bucket]];
+		const uint32_t len = order[i].len;
 
-static const struct ext_foreign_toplevel_list_v1_listener ext_toplevel_list_listener = {
-	.toplevel = ext_toplevel_list_handle_toplevel,
-	.finished = noop,
-};
+		/* Equal aliases share a bucket and would never fit. */
+		for (uint32_t j = 0; j < len; j++)
+			for (uint32_t k = j + 1; k < len; k++)
+				if ( strcmp(aliases[bucket[j]].alias, aliases[bucket[k]].alias) == 0 )
+				{
+					fprintf(stderr, "ERROR: Duplicate app-id alias '%s'.\n", aliases[bucket[j]].alias);
+					goto out;
+				}
 
-/************************************************************
- *                                                          *
- *    zwlr-foreign-toplevel-management-v1 implementation    *
- *                                                          *
- ************************************************************/
-static void zwlr_foreign_handle_handle_title (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
-		const char *title)
-{
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_set_title(toplevel, title);
+		uint32_t seed = 1;
+		while (!alias_place(bucket, len, seed))
+		{
+			if ( seed++ == UINT16_MAX )
+			{
+				fputs("ERROR: Can not build the app-id alias table.\n", stderr);
+				goto out;
+			}
+		}
+		alias_seeds[order[i].bucket] = seed;
+	}
+	ok = true;
+
+out:
+	free(starts);
+	free(members);
+	free(order);
+	return ok;
 }
 
-static void zwlr_foreign_handle_handle_app_id (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
-		const char *app_id)
+/** Write the replacement of a title rule for a match in str. */
+static void title_rule_write_replacement (const struct Title_rule *rule, const char *str,
+		const regmatch_t *match, FILE *restrict f)
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_set_app_id(toplevel, app_id);
+	for (const char *r = rule->replacement; *r != '\0'; r++)
+	{
+		if ( *r == '\\' && r[1] >= '0' && r[1] <= '9' )
+		{
+			const regmatch_t *sub = &match[r[1] - '0'];
+			if ( sub->rm_so >= 0 )
+				fwrite(str + sub->rm_so, 1, (size_t)(sub->rm_eo - sub->rm_so), f);
+			r++;
+		}
+		else if ( *r == '\\' && r[1] == '\\' )
+		{
+			fputc('\\', f);
+			r++;
+		}
+		else
+			fputc(*r, f);
+	}
 }
 
-static void zwlr_foreign_handle_handle_state (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
-		struct wl_array *states)
+/**
+ * Replace every match of the rule in str. Returns the result, which the
+ * caller has to free, or NULL if nothing matched or on error.
+ */
+static char *title_rule_apply (const struct Title_rule *rule, const char *str)
 {
-	struct Toplevel *toplevel = (struct Toplevel *)data;
+	regmatch_t match[TITLE_RULE_MAX_MATCHES];
+	if ( regexec(&rule->regex, str, TITLE_RULE_MAX_MATCHES, match, 0) != 0 )
+		return NULL;
 
-	bool fullscreen = false;
-	bool activated = false;
-	bool minimized = false;
-	bool maximized = false;
+	char *buffer = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buffer, &len);
+	if ( f == NULL )
+		return NULL;
+	int eflags = 0;
+	do
+	{
+		fwrite(str, 1, (size_t)match[0].rm_so, f);
+		title_rule_write_replacement(rule, str, match, f);
+		str += match[0].rm_eo;
+		if ( match[0].rm_so == match[0].rm_eo )
+		{
+			/* Empty match, keep the next character to make progress. */
+			if ( *str == '\0' )
+				break;
+			size_t n = 1;
+			while ( ((unsigned char)str[n] & 0xC0) == 0x80 )
+				n++;
+			fwrite(str, 1, n, f);
+			str += n;
+		}
+		eflags = REG_NOTBOL;
+	} while ( regexec(&rule->regex, str, TITLE_RULE_MAX_MATCHES, match, eflags) == 0 );
+	fputs(str, f);
 
-	uint32_t *state;
-	wl_array_for_each(state, states) switch (*state)
+	if ( fclose(f) != 0 )
 	{
-		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED: maximized = true; break;
-		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED: minimized = true; break;
-		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED: activated = true; break;
-		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN: fullscreen = true; break;
+		free(buffer);
+		return NULL;
 	}
-
-	toplevel_set_fullscreen(toplevel, fullscreen);
-	toplevel_set_activated(toplevel, activated);
-	toplevel_set_minimized(toplevel, minimized);
-	toplevel_set_maximized(toplevel, maximized);
-}
-
-static void zwlr_foreign_handle_handle_done (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
-{
-	struct Toplevel *toplevel = (struct Toplevel *)data;
-	toplevel_done(toplevel);
+	return buffer;
 }
 
-static void zwlr_foreign_handle_handle_closed (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
+/**
+ * Apply all title rules in order. Returns the normalized title, which the
+ * caller has to free, or NULL if it is identical to the title.
+ */
+static char *normalize_title (const char *title)
 {
-	/* We only care when watching for events. */
-	if ( mode == WATCH )
+	char *normalized = NULL;
+	for (size_t i = 0; i < title_rules_len; i++)
 	{
-		struct Toplevel *toplevel = (struct Toplevel *)data;
-		toplevel_destroy(toplevel);
+		char *next = title_rule_apply(&title_rules[i], normalized != NULL ? normalized : title);
+		if ( next == NULL )
+			continue;
+		free(normalized);
+		normalized = next;
+	}
+	if ( normalized != NULL && strcmp(normalized, title) == 0 )
+	{
+		free(normalized);
+		normalized = NULL;
 	}
+	return normalized;
 }
 
-static const struct zwlr_foreign_toplevel_handle_v1_listener zwlr_handle_listener = {
-	.app_id       = zwlr_foreign_handle_handle_app_id,
-	.done         = zwlr_foreign_handle_handle_done,
-	.closed       = zwlr_foreign_handle_handle_closed,
-	.output_enter = noop,
-	.output_leave = noop,
-	.parent       = noop,
-	.state        = zwlr_foreign_handle_handle_state,
-	.title        = zwlr_foreign_handle_handle_title,
-};
-
-static void zwlr_toplevel_manager_handle_toplevel (void *data,
-		struct zwlr_foreign_toplevel_manager_v1 *manager,
-		struct zwlr_foreign_toplevel_handle_v1 *handle)
+static bool normalize_add_title_rule (const char *pattern, const char *replacement,
+		const char *path, size_t line)
 {
-	if ( used_protocol != ZWLR_FOREIGN_TOPLEVEL )
+	void *tmp = realloc(title_rules, ( title_rules_len + 1 ) * sizeof(struct Title_rule));
+	if ( tmp == NULL )
 	{
-		assert(used_protocol != NONE);
-		zwlr_foreign_toplevel_handle_v1_destroy(handle);
-		return;
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return false;
 	}
+	title_rules = tmp;
 
-	struct Toplevel *toplevel = toplevel_new();
-	if ( toplevel == NULL )
-		return;
-	toplevel->zwlr_handle = handle;
-	zwlr_foreign_toplevel_handle_v1_add_listener(handle, &zwlr_handle_listener, toplevel);
+	struct Title_rule *rule = &title_rules[title_rules_len];
+	const int err = regcomp(&rule->regex, pattern, REG_EXTENDED);
+	if ( err != 0 )
+	{
+		char message[256];
+		regerror(err, &rule->regex, message, sizeof(message));
+		fprintf(stderr, "ERROR: %s:%zu: Invalid regular expression: %s\n", path, line, message);
+		return false;
+	}
+	for (const char *r = replacement; *r != '\0'; r++)
+	{
+		if ( *r != '\\' )
+			continue;
+		r++;
+		if ( *r >= '0' && *r <= '9' && (size_t)(*r - '0') > rule->regex.re_nsub )
+		{
+			fprintf(stderr, "ERROR: %s:%zu: No subexpression \\%c.\n", path, line, *r);
+			regfree(&rule->regex);
+			return false;
+		}
+		if ( *r == '\0' )
+			break;
+	}
+	rule->replacement = strdup(replacement);
+	if ( rule->replacement == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		regfree(&rule->regex);
+		return false;
+	}
+	title_rules_len++;
+	return true;
 }
 
-static const struct zwlr_foreign_toplevel_manager_v1_listener zwlr_toplevel_manager_listener = {
-	.toplevel = zwlr_toplevel_manager_handle_toplevel,
-	.finished = noop,
-};
-
-/************************
- *                      *
- *    Command output    *
- *                      *
- ************************/
-static bool string_needs_quotes (char *str)
+static bool normalize_add_alias (const char *alias, const char *canonical)
 {
-	for (; *str != '\0'; str++)
-		if ( isspace(*str) || *str == '"' || *str == '\'' || !isascii(*str) )
-			return true;
-	return false;
+	void *tmp = realloc(aliases, ( aliases_len + 1 ) * sizeof(struct Alias));
+	if ( tmp == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return false;
+	}
+	aliases = tmp;
+	aliases[aliases_len].alias = strdup(alias);
+	aliases[aliases_len].canonical = strdup(canonical);
+	if ( aliases[aliases_len].alias == NULL || aliases[aliases_len].canonical == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		free(aliases[aliases_len].alias);
+		free(aliases[aliases_len].canonical);
+		return false;
+	}
+	aliases_len++;
+	return true;
 }
 
-static void quoted_fputs (size_t *len, char *str, FILE *restrict f)
+/** Load the rules file of --normalize. Prints error messages accordingly. */
+static bool normalize_load (const char *path)
 {
-	if ( str == NULL )
+	FILE *f = fopen(path, "r");
+	if ( f == NULL )
 	{
-		if ( len != NULL )
-			*len = 0;
-		return;
+		fprintf(stderr, "ERROR: Can not open rules '%s': %s\n", path, strerror(errno));
+		return false;
 	}
 
-	size_t l = 2; // Two bytes for the two mandatory quotes.
-
-	fputc('"', f);
-	for (; *str != '\0'; str++)
+	bool ok = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t line_number = 0;
+	ssize_t n;
+	while ( ok && (n = getline(&line, &line_size, f)) > 0 )
 	{
-		if ( *str == '"' )
-		{
-			l += 2;
-			fputs("\\\"", f);
-		}
-		else if ( *str == '\n' )
-		{
-			l += 2;
-			fputs("\\n", f);
-		}
-		else if ( *str == '\t' )
+		line_number++;
+		if ( line[n-1] == '\n' )
+			line[n-1] = '\0';
+		if ( line[0] == '#' || line[0] == '\0' )
+			continue;
+
+		char *pattern = strchr(line, '\t');
+		char *replacement = pattern != NULL ? strchr(pattern + 1, '\t') : NULL;
+		if ( replacement == NULL || strchr(replacement + 1, '\t') != NULL )
 		{
-			l += 2;
-			fputs("\\t", f);
+			fprintf(stderr, "ERROR: %s:%zu: Expected three tab separated values.\n", path, line_number);
+			ok = false;
+			break;
 		}
+		*pattern++ = '\0';
+		*replacement++ = '\0';
+
+		if ( strcmp(line, "title") == 0 )
+			ok = normalize_add_title_rule(pattern, replacement, path, line_number);
+		else if ( strcmp(line, "app-id") == 0 )
+			ok = normalize_add_alias(pattern, replacement);
 		else
 		{
-			l += 1;
-			fputc(*str, f);
+			fprintf(stderr, "ERROR: %s:%zu: Unknown rule '%s', expected 'title' or 'app-id'.\n",
+					path, line_number, line);
+			ok = false;
 		}
 	}
-	fputc('"', f);
+	free(line);
+	fclose(f);
 
-	if ( len != NULL )
-		*len = l;
-}
-
-static void write_padding (size_t used_len, size_t padding, FILE *restrict f)
-{
-	if ( padding > used_len )
-		for (size_t i = padding - used_len; i > 0; i--)
-			fputc(' ', f);
+	normalize = ok && aliases_build();
+	return normalize;
 }
 
-static void write_padded (size_t padding, char *str, FILE *restrict f)
+static void normalize_finish (void)
 {
-	size_t len = 0;
-	if ( str == NULL )
+	for (size_t i = 0; i < title_rules_len; i++)
 	{
-		fputs("<NULL>", f);
-		len = strlen("<NULL>");
+		regfree(&title_rules[i].regex);
+		free(title_rules[i].replacement);
 	}
-	else
+	free(title_rules);
+	for (size_t i = 0; i < aliases_len; i++)
 	{
-		len = strlen(str);
-		fputs(str, f);
+		free(aliases[i].alias);
+		free(aliases[i].canonical);
 	}
-	write_padding(len, padding, f);
+	free(aliases);
+	free(alias_seeds);
+	free(alias_slots);
+	title_rules_len = aliases_len = 0;
+	normalize = false;
 }
 
-static void write_padded_maybe_quoted (size_t padding, char *str, FILE *restrict f)
+/******************
+ *                *
+ *    Toplevel    *
+ *                *
+ ******************/
+enum Toplevel_flags
 {
-	size_t len = 0;
-	if ( str == NULL )
-	{
-		fputs("<NULL>", f);
-		len = strlen("<NULL>");
-	}
-	else  if (string_needs_quotes(str))
-		quoted_fputs(&len, str, f);
-	else
-	{
-		len = strlen(str);
-		fputs(str, f);
-	}
-	write_padding(len, padding, f);
-}
+	TOPLEVEL_FULLSCREEN = 1 << 0,
+	TOPLEVEL_ACTIVATED  = 1 << 1,
+	TOPLEVEL_MAXIMIZED  = 1 << 2,
+	TOPLEVEL_MINIMIZED  = 1 << 3,
+	TOPLEVEL_STICKY     = 1 << 6,
 
-static void write_maybe_quoted (char *str, FILE *restrict f)
-{
-	if ( str == NULL )
-		fputs("<NULL>", f);
-	else  if (string_needs_quotes(str))
-		quoted_fputs(NULL, str, f);
-	else
-		fputs(str, f);
-}
+	/**
+	 * Set if this toplevel has already been added to the list, so it is not
+	 * listed twice if toplevel_handle_done is called more than once.
+	 */
+	TOPLEVEL_LISTED     = 1 << 4,
+
+	/** Set if this slot of the slab holds a toplevel. */
+	TOPLEVEL_IN_USE     = 1 << 5,
 
-/** Always quote strings, except if they are NULL. */
-static void write_json (char *str, FILE *restrict f)
+	/** Set while a change of the activated state waits for focus_flush(). */
+	TOPLEVEL_FOCUS_PENDING = 1 << 7,
+};
+
+enum Toplevel_changes
 {
-	if ( str == NULL )
-		fputs("null", f);
-	else
-		quoted_fputs(NULL, str, f);
-}
+	CHANGED_TITLE     = 1 << 0,
+	CHANGED_APP_ID    = 1 << 1,
+	CHANGED_STATE     = 1 << 2,
 
-/** Never quote strings, print "<NULL>" on NULL. */
-static void write_custom (char *str, FILE *restrict f)
+	/**
+	 * The activated state changed. Reported like the other states, unless
+	 * the change is part of a focus event.
+	 */
+	CHANGED_ACTIVATED = 1 << 3,
+};
+
+enum Toplevel_event
 {
-	if ( str == NULL )
-		fputs("<NULL>", f);
-	else
-		fputs(str, f);
-}
+	EVENT_CREATED,
+	EVENT_CHANGED,
+	EVENT_CLOSED,
+
+	/** Another toplevel has been activated, see focus_flush(). */
+	EVENT_FOCUS,
+};
+
+struct Search_entry;
 
-static void write_custom_optional (bool supported, char *str, FILE *restrict f)
+/** Forms of app-id and title rewritten by the rules of --normalize. */
+struct Normalized
 {
-	if (supported)
-		write_custom(str, f);
-	else
-		fputs("unsupported", f);
-}
+	struct String app_id;
+	struct String title;
+};
 
-static void write_custom_optional_bool (bool supported, bool b, FILE *restrict f)
+/** A point in time in microseconds, 0 if it never happened. */
+struct Timestamp
 {
-	if (supported)
-		fputs(b ? "true" : "false", f);
-	else
-		fputs("unsupported", f);
-}
+	/** CLOCK_MONOTONIC, for measuring how long ago it was. */
+	uint64_t monotonic;
 
-/** Return the amount of bytes printed when printing the given string. */
-static size_t real_strlen (const char *str)
+	/** Since the epoch, for output. */
+	uint64_t wall;
+};
+
+struct Toplevel
 {
-	size_t i = 0;
-	bool has_space = false;
-	for(; *str != '\0'; str++)
+	/** Internal id, used in WATCH mode. */
+	size_t id;
+
+	/** Only one protocol is used at a time, see used_protocol. */
+	union
 	{
-		switch (*str)
-		{
-			case '"':
-			case '\\':
-			case '\n':
-			case '\t':
-				i += 2;
-				break;
+		struct zwlr_foreign_toplevel_handle_v1 *zwlr_handle;
+		struct ext_foreign_toplevel_handle_v1 *ext_handle;
+	};
 
-			default:
-				if (isspace(*str))
-					has_space = true;
-				i++;
-				break;
-		}
-	}
-	if (has_space)
-		i += 2;
-	return i;
+	/** Extension object of ext_handle, if cosmic_toplevel_info is bound. */
+	struct zcosmic_toplevel_handle_v1 *cosmic_handle;
+
+	/** Search index bookkeeping, only allocated if a query was given. */
+	struct Search_entry *search;
+
+	/**
+	 * Only allocated once a rule of --normalize changed the app-id or
+	 * title. Unset strings are identical to the string itself, see
+	 * toplevel_normalized_title().
+	 */
+	struct Normalized *normalized;
+
+	uint8_t flags;
+
+	/** Toplevel_changes since the last done event. */
+	uint8_t changes;
+
+	/** Column of the toplevel in the --history counts, 0 if not counted. */
+	uint8_t history_column;
+
+	/**
+	 * Value of activation_counter when the toplevel was last activated,
+	 * used to sort by most recent use.
+	 */
+	uint32_t activation;
+
+	/**
+	 * When the toplevel was created, last changed and last activated. A
+	 * toplevel changes when the server finished a batch of changes to it,
+	 * including the one which created it.
+	 */
+	struct Timestamp created_at;
+	struct Timestamp changed_at;
+	struct Timestamp activated_at;
+
+	/** Output scratch data: Index of the group of the toplevel. */
+	uint32_t group;
+
+	struct String app_id;
+	struct String title;
+
+	/**
+	 * Optional data. Whether these are supported depends on the bound
+	 * protocol(s). See update_capabilities() and related globals.
+	 */
+	struct String identifier;
+};
+
+/**
+ * All toplevels are stored in a single array, so iterating over them does not
+ * chase pointers. A toplevel keeps its index for its entire life time, so the
+ * index is what is handed to the protocol listeners. Freed slots are reused.
+ * Pointers into the slab are only valid until the next toplevel_new().
+ */
+struct Toplevel *toplevels = NULL;
+uint32_t toplevels_capacity = 0;
+
+/** Number of slots ever used. Slots past this are uninitialized. */
+uint32_t toplevels_len = 0;
+
+/** Head of the list of free slots, chained through Toplevel.id. */
+const uint32_t no_free_slot = UINT32_MAX;
+uint32_t free_slot = UINT32_MAX;
+
+static struct Toplevel *toplevel_get (uint32_t index)
+{
+	assert(index < toplevels_len);
+	assert(toplevels[index].flags & TOPLEVEL_IN_USE);
+	return &toplevels[index];
+}
+
+static uint32_t toplevel_index (const struct Toplevel *toplevel)
+{
+	return (uint32_t)(toplevel - toplevels);
 }
 
+/** Strings of a toplevel whose rendering is cached, see string_render(). */
+enum Rendered_string
+{
+	RENDERED_TITLE,
+	RENDERED_APP_ID,
+	RENDERED_IDENTIFIER,
+};
+#define RENDERED_STRINGS 3
+
+/** A string as written by the current output format. */
+struct Rendering
+{
+	/** NULL if the rendering is identical to the string itself. */
+	char *data;
+	uint32_t len;
+	bool valid;
+};
+
 /**
- * Checks whether a custom output format is valid. Prints error messages
- * accordingly.
+ * Cached renderings, indexed by slot like the slab. Only allocated once a
+ * string is rendered, which only happens in WATCH mode.
  */
-static bool out_check_custom_format (const char *fmt)
+struct Rendering (*renderings)[RENDERED_STRINGS] = NULL;
+uint32_t renderings_capacity = 0;
+
+/** Drop the cached rendering after the string changed. */
+static void rendering_drop (const struct Toplevel *toplevel, enum Rendered_string which)
 {
-	assert(fmt != NULL);
-	const size_t len = strlen(fmt);
-	if ( len == 1 || len == 0 )
-	{
-		fputs("ERROR: Invalid custom format: Requires at least delimiter and one field.\n", stderr);
-		return false;
-	}
-	if (!isascii(*fmt))
+	const uint32_t index = toplevel_index(toplevel);
+	if ( index >= renderings_capacity )
+		return;
+	struct Rendering *rendering = &renderings[index][which];
+	if ( rendering->data != NULL )
 	{
-		fputs("ERROR: Invalid custom format: Delimiter must be an ASCII character.\n", stderr);
-		return false;
+		free(rendering->data);
+		memory_release(rendering->len);
 	}
-	fmt++;
-	for (; *fmt != '\0'; fmt++)
+	*rendering = (struct Rendering){ 0 };
+}
+
+static void renderings_free (void)
+{
+	for (uint32_t i = 0; i < renderings_capacity; i++)
+		for (size_t j = 0; j < RENDERED_STRINGS; j++)
+			rendering_drop(&toplevels[i], (enum Rendered_string)j);
+	free(renderings);
+	memory_release(renderings_capacity * sizeof(renderings[0]));
+	renderings = NULL;
+	renderings_capacity = 0;
+}
+
+/**
+ * Whether toplevel events are logged. In WATCH mode with an alternative output
+ * format, snapshots are written instead.
+ */
+static bool log_events (void)
+{
+	return debug_log || ( mode == WATCH && output_format == NORMAL && !event_templates
+			&& !trace && !ping_only );
+}
+
+/** Turn the user data of a listener back into a toplevel. */
+static struct Toplevel *toplevel_from_data (void *data)
+{
+	return toplevel_get((uint32_t)(uintptr_t)data);
+}
+
+static void *toplevel_to_data (const struct Toplevel *toplevel)
+{
+	return (void *)(uintptr_t)toplevel_index(toplevel);
+}
+
+/** Microseconds since the epoch, the time stamps of recorded events. */
+static uint64_t wall_clock_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t monotonic_us (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static struct Timestamp timestamp_now (void)
+{
+	return (struct Timestamp){ .monotonic = monotonic_us(), .wall = wall_clock_us() };
+}
+
+/**
+ * CLOCK_MONOTONIC time of the oldest change still listed with
+ * --changed-within. Computed once per output, so filtering is a single
+ * comparison per toplevel.
+ */
+static uint64_t changed_cutoff (void)
+{
+	if ( changed_within == 0 )
+		return 0;
+	const uint64_t now = monotonic_us();
+	return now > changed_within ? now - changed_within : 0;
+}
+
+/** The normalized app-id, which is the app-id itself if no rule changed it. */
+static const struct String *toplevel_normalized_app_id (const struct Toplevel *toplevel)
+{
+	if ( toplevel->normalized != NULL && toplevel->normalized->app_id.set )
+		return &toplevel->normalized->app_id;
+	return &toplevel->app_id;
+}
+
+/** The normalized title, which is the title itself if no rule changed it. */
+static const struct String *toplevel_normalized_title (const struct Toplevel *toplevel)
+{
+	if ( toplevel->normalized != NULL && toplevel->normalized->title.set )
+		return &toplevel->normalized->title;
+	return &toplevel->title;
+}
+
+static void toplevel_free_normalized (struct Toplevel *self)
+{
+	if ( self->normalized == NULL )
+		return;
+	string_free(&self->normalized->app_id);
+	string_free(&self->normalized->title);
+	free(self->normalized);
+	self->normalized = NULL;
+	memory_release(sizeof(struct Normalized));
+}
+
+/**
+ * Set the normalized title or app-id of the toplevel to value, truncated to at
+ * most max_len bytes, or unset it if value is NULL. The normalized strings are
+ * allocated for the first value and freed again once both are unset. Without
+ * memory for them, the strings are simply not normalized.
+ */
+static void toplevel_set_normalized (struct Toplevel *self, bool title, const char *value,
+		size_t max_len)
+{
+	if ( self->normalized == NULL )
 	{
-		switch (*fmt)
+		if ( value == NULL || !memory_reserve(sizeof(struct Normalized)) )
+			return;
+		self->normalized = calloc(1, sizeof(struct Normalized));
+		if ( self->normalized == NULL )
 		{
-			case 't': // Title.
-			case 'a': // App-Id.
-			case 'i': // Identifier.
-			case 'A': // Activated.
-			case 'f': // Fullscreen.
-			case 'm': // Minimized.
-			case 'M': // Maximized.
-				continue;
-
-			default:
-				fprintf(stderr, "ERROR: Invalid custom format: Unknown field name: '%c'.\n", *fmt);
-				return false;
+			fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+			memory_release(sizeof(struct Normalized));
+			return;
 		}
 	}
 
-	return true;
+	struct String *str = title ? &self->normalized->title : &self->normalized->app_id;
+	string_free(str);
+	if ( value != NULL )
+		string_set(str, value, max_len);
+	if ( !self->normalized->app_id.set && !self->normalized->title.set )
+		toplevel_free_normalized(self);
 }
 
-static void out_write_toplevel (struct Toplevel *toplevel)
+static bool toplevel_has (const struct Toplevel *toplevel, enum Toplevel_flags flag)
 {
-	static bool json_prev = false;
-	switch (output_format)
-	{
-		case NORMAL:
-			if (toplevel->activated)
-				fputs("A", stdout);
-			else
-				fputs(" ", stdout);
-			if (toplevel->maximized)
-				fputs("M", stdout);
-			else if (toplevel->minimized)
-				fputs("m", stdout);
-			else if (toplevel->fullscreen)
-				fputs("F", stdout);
-			else
-				fputs(" ", stdout);
-			fputs(" ", stdout);
-			write_padded_maybe_quoted(longest_app_id, toplevel->app_id, stdout);
-			fputs("   ", stdout);
-			write_maybe_quoted(toplevel->title, stdout);
-			fputc('\n', stdout);
-			break;
+	return (toplevel->flags & flag) != 0;
+}
 
-		case JSON:
-			if (json_prev)
-				fputs(",\n", stdout);
-			else
-				json_prev = true;
-			fputs("        {\n", stdout);
+static void toplevel_set_flag (struct Toplevel *toplevel, enum Toplevel_flags flag, bool value)
+{
+	if (value)
+		toplevel->flags = (uint8_t)(toplevel->flags | flag);
+	else
+		toplevel->flags = (uint8_t)(toplevel->flags & ~flag);
+}
 
-			if (support_activated)
-				fprintf(stdout, "            \"activated\": %s,\n", BOOL_TO_STR(toplevel->activated));
-			if (support_fullscreen)
-				fprintf(stdout, "            \"fullscreen\": %s,\n", BOOL_TO_STR(toplevel->fullscreen));
-			if (support_minimized)
-				fprintf(stdout, "            \"minimized\": %s,\n", BOOL_TO_STR(toplevel->minimized));
-			if (support_maximized)
-				fprintf(stdout, "            \"maximized\": %s,\n", BOOL_TO_STR(toplevel->maximized));
-			if (support_identifier)
-				fprintf(stdout, "            \"identifier\": %s,\n", toplevel->identifier);
+/** Set a state flag, remembering whether it changed. */
+static void toplevel_set_state (struct Toplevel *toplevel, enum Toplevel_flags flag, bool value)
+{
+	if ( toplevel_has(toplevel, flag) != value )
+		toplevel->changes = (uint8_t)(toplevel->changes | CHANGED_STATE);
+	toplevel_set_flag(toplevel, flag, value);
+}
 
-			/* Whoever designed JSON made the incredibly weird
-			 * mistake of enforcing that there is no comma on the
-			 * last item. Luckily, there are two fields we know
-			 * will always be printed. So by putting them last,
-			 * we can easiely implement that. :)
-			 */
-			fputs("            \"title\": ", stdout);
-			write_json(toplevel->title, stdout);
-			fputs(",\n            \"app-id\": ", stdout);
-			write_json(toplevel->app_id, stdout);
-			fputs("\n        }", stdout);
-			break;
+/**
+ * Index of the toplevel which most recently gained the activated state. A
+ * focus switch arrives as two independent state changes, so the handoff is
+ * only resolved once the whole dispatch batch is handled, see focus_flush().
+ */
+const uint32_t no_focus_candidate = UINT32_MAX;
+uint32_t focus_candidate = UINT32_MAX;
 
-		case CUSTOM:
-			assert(custom_output_format != NULL);
-			assert(strlen(custom_output_format) > 1);
-			bool need_delim = false;
-			char *fmt = custom_output_format + 1;
-			for (; *fmt != '\0'; fmt++)
+/**
+ * The focused toplevel as of the last focus event, and its index in the slab.
+ * Not known once it lost the activated state without another toplevel gaining
+ * it, or has been closed.
+ */
+struct
+{
+	bool known;
+	size_t current;
+	uint32_t index;
+	bool has_previous;
+	size_t previous;
+} focus = { 0 };
+
+static void search_index_update (struct Toplevel *toplevel);
+static void search_index_remove (struct Toplevel *toplevel);
+static void emit_event (struct Toplevel *toplevel, enum Toplevel_event event);
+
+/**
+ * Take a slot from the slab and initialize a new Toplevel in it. Returns
+ * pointer to the Toplevel.
+ */
+static struct Toplevel *toplevel_new (void)
+{
+	uint32_t index;
+	if ( free_slot != no_free_slot )
+	{
+		index = free_slot;
+		free_slot = (uint32_t)toplevels[index].id;
+	}
+	else
+	{
+		if ( toplevels_len == toplevels_capacity )
+		{
+			/* Within the memory budget, grow by as much as possible. */
+			uint32_t capacity = toplevels_capacity == 0 ? 64 : toplevels_capacity * 2;
+			const size_t available = memory_available() / sizeof(struct Toplevel);
+			if ( capacity - toplevels_capacity > available )
+				capacity = toplevels_capacity + (uint32_t)available;
+			if ( capacity == toplevels_capacity )
 			{
-				if (need_delim)
-					fputc(custom_output_format[0], stdout);
-				else
-					need_delim = true;
-				switch (*fmt)
-				{
-					case 't': write_custom(toplevel->title, stdout); break;
-					case 'a': write_custom(toplevel->app_id, stdout); break;
-					case 'i': write_custom_optional(support_identifier, toplevel->identifier, stdout); break;
-					case 'A': write_custom_optional_bool(support_activated, toplevel->activated, stdout); break;
-					case 'f': write_custom_optional_bool(support_fullscreen, toplevel->fullscreen, stdout); break;
-					case 'm': write_custom_optional_bool(support_minimized, toplevel->minimized, stdout); break;
-					case 'M': write_custom_optional_bool(support_maximized, toplevel->maximized, stdout); break;
-					default: assert(false); break;
-				}
+				if ( ignored_toplevels++ == 0 )
+					fputs("ERROR: Memory limit reached, ignoring new toplevels.\n", stderr);
+				return NULL;
 			}
-			fputs("\n", stdout);
-			break;
+			struct Toplevel *new = realloc(toplevels, capacity * sizeof(struct Toplevel));
+			if ( new == NULL )
+			{
+				fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+				return NULL;
+			}
+			memory_reserve((capacity - toplevels_capacity) * sizeof(struct Toplevel));
+			toplevels = new;
+			toplevels_capacity = capacity;
+		}
+		index = toplevels_len++;
 	}
+
+	static size_t id_counter = 0;
+
+	struct Toplevel *new = &toplevels[index];
+	memset(new, 0, sizeof(struct Toplevel));
+	new->id = id_counter++;
+	new->flags = TOPLEVEL_IN_USE;
+	new->created_at = timestamp_now();
+
+	if (log_events())
+		fprintf(stdout, "toplevel %ld: created\n", new->id);
+
+	return new;
 }
 
-static void out_start (void)
+/** Destroys a toplevel and returns its slot to the slab. */
+static void toplevel_destroy (struct Toplevel *self)
 {
-	switch (output_format)
+	if (log_events())
+		fprintf(stdout, "toplevel %ld: destroyed\n", self->id);
+	if (toplevel_has(self, TOPLEVEL_LISTED))
+		emit_event(self, EVENT_CLOSED);
+	if ( focus.known && focus.current == self->id )
+		focus.known = false;
+
+	switch (used_protocol)
 	{
-		case NORMAL:
-			fputs("   ", stdout);
-			write_padded(longest_app_id, "app-id:", stdout);
-			fputs("   ", stdout);
-			fputs("title:", stdout);
-			fputc('\n', stdout);
-			return;
+		case ZWLR_FOREIGN_TOPLEVEL:
+			if ( self->zwlr_handle != NULL )
+				zwlr_foreign_toplevel_handle_v1_destroy(self->zwlr_handle);
+			break;
 
-		case JSON:
-			fprintf(stdout,
-					"{\n"
-					"    \"supported-data\": {\n"
-					"        \"title\": true,\n"
-					"        \"app-id\": true,\n"
-					"        \"identifier\": %s,\n"
-					"        \"fullscreen\": %s,\n"
-					"        \"activated\": %s,\n"
-					"        \"minimized\": %s,\n"
-					"        \"maximized\": %s\n"
-					"    },\n"
-					"    \"toplevels\": [\n",
-					BOOL_TO_STR(support_identifier),
-					BOOL_TO_STR(support_fullscreen),
-					BOOL_TO_STR(support_activated),
-					BOOL_TO_STR(support_minimized),
-					BOOL_TO_STR(support_maximized));
+		case EXT_FOREIGN_TOPLEVEL:
+			if ( self->cosmic_handle != NULL )
+				zcosmic_toplevel_handle_v1_destroy(self->cosmic_handle);
+			if ( self->ext_handle != NULL )
+				ext_foreign_toplevel_handle_v1_destroy(self->ext_handle);
 			break;
 
-		case CUSTOM:
+		case NONE:
 			break;
 	}
+	if ( search_query != NULL )
+		search_index_remove(self);
+	string_free(&self->title);
+	string_free(&self->app_id);
+	string_free(&self->identifier);
+	rendering_drop(self, RENDERED_TITLE);
+	rendering_drop(self, RENDERED_APP_ID);
+	rendering_drop(self, RENDERED_IDENTIFIER);
+	toplevel_free_normalized(self);
+
+	if (toplevel_has(self, TOPLEVEL_LISTED))
+		snapshot_outdated = true;
+	self->flags = 0;
+	self->id = free_slot;
+	free_slot = toplevel_index(self);
 }
 
-static void out_finish (void)
+/** Set the title of the toplevel. Called from protocol implementations. */
+static void toplevel_set_title (struct Toplevel *self, const char *title)
 {
-	switch (output_format)
-	{
-		case NORMAL:
-			return;
+	char *repaired = utf8_repair(title);
+	if ( repaired != NULL )
+		title = repaired;
 
-		case JSON:
-			fputs("\n    ]\n}\n", stdout);
-			break;
+	if (log_events())
+		fprintf(stdout, "toplevel %ld: set title: '%s' -> '%s'\n",
+				self->id, string_get(&self->title), title);
 
-		case CUSTOM:
-			break;
+	if (!string_equals(&self->title, title, max_title_bytes))
+		self->changes = (uint8_t)(self->changes | CHANGED_TITLE);
+	rendering_drop(self, RENDERED_TITLE);
+	if ( string_set(&self->title, title, max_title_bytes) )
+	{
+		if (normalize)
+		{
+			char *normalized = normalize_title(string_get(&self->title));
+			toplevel_set_normalized(self, true, normalized, max_title_bytes);
+			free(normalized);
+		}
+		if ( search_query != NULL )
+			search_index_update(self);
 	}
+	free(repaired);
 }
 
-/********************************
- *                              *
- *    main and Wayland logic    *
- *                              *
- ********************************/
-static void registry_handle_global (void *data, struct wl_registry *registry,
-		uint32_t name, const char *interface, uint32_t version)
+/** Set the app-id of the toplevel. Called from protocol implementations. */
+static size_t real_strlen (const char *str);
+static void toplevel_set_app_id (struct Toplevel *self, const char *app_id)
 {
-	if ( strcmp(interface, zwlr_foreign_toplevel_manager_v1_interface.name) == 0 )
+	char *repaired = utf8_repair(app_id);
+	if ( repaired != NULL )
+		app_id = repaired;
+
+	if (log_events())
+		fprintf(stdout, "toplevel %ld: set app-id: '%s' -> '%s'\n",
+				self->id, string_get(&self->app_id), app_id);
+
+	if (!string_equals(&self->app_id, app_id, 0))
+		self->changes = (uint8_t)(self->changes | CHANGED_APP_ID);
+	rendering_drop(self, RENDERED_APP_ID);
+	if (!string_set(&self->app_id, app_id, 0))
 	{
-		if ( version < 3 )
-			return;
-		if (debug_log)
-			fputs("[Binding zwlr-foreign-toplevel-manager-v1.]\n", stderr);
-		zwlr_toplevel_manager = wl_registry_bind(wl_registry, name,
-			&zwlr_foreign_toplevel_manager_v1_interface, 3);
-		zwlr_foreign_toplevel_manager_v1_add_listener(zwlr_toplevel_manager,
-				&zwlr_toplevel_manager_listener, NULL);
+		free(repaired);
+		return;
 	}
-	else if ( strcmp(interface, ext_foreign_toplevel_list_v1_interface.name) == 0 )
+	if (normalize)
 	{
-		if (debug_log)
-			fputs("[Binding ext-foreign-toplevel-list-v1.]\n", stderr);
-		ext_toplevel_list = wl_registry_bind(wl_registry, name,
-			&ext_foreign_toplevel_list_v1_interface, 1);
-		ext_foreign_toplevel_list_v1_add_listener(ext_toplevel_list,
-				&ext_toplevel_list_listener, NULL);
+		toplevel_set_normalized(self, false, alias_lookup(app_id), 0);
 	}
-}
 
-static const struct wl_registry_listener registry_listener = {
-	.global        = registry_handle_global,
-	.global_remove = noop,
-};
+	if ( search_query != NULL )
+		search_index_update(self);
 
-static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other_data);
-static const struct wl_callback_listener sync_callback_listener = {
-	.done = sync_handle_done,
-};
+	/* Used when printing output in the default human readable format. */
+	const size_t len = real_strlen(app_id);
+	if ( len > longest_app_id && max_app_id_padding > len )
+		longest_app_id = len;
+	free(repaired);
+}
 
-static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other_data)
+/** Set the identifier of the toplevel. Called from protocol implementations. */
+static void toplevel_set_identifier (struct Toplevel *self, const char *identifier)
+{
+	char *repaired = utf8_repair(identifier);
+	if ( repaired != NULL )
+		identifier = repaired;
+
+	if (log_events())
+		fprintf(stdout, "toplevel %ld: set identifier: %s\n",
+				self->id, identifier);
+
+	if (self->identifier.set)
+		fputs("ERROR: protocol-error: Compositor changed identifier of toplevel, "
+				"which is forbidden by the protocol. Continuing anyway...\n", stderr);
+	rendering_drop(self, RENDERED_IDENTIFIER);
+	string_set(&self->identifier, identifier, 0);
+	free(repaired);
+}
+
+static void toplevel_set_fullscreen (struct Toplevel *self, bool fullscreen)
 {
-	static int sync = 0;
 	if (debug_log)
-		fprintf(stderr, "[Sync callback: %d]\n", sync);
+		fprintf(stdout, "[toplevel %ld: set fullscreen: %d]\n",
+				self->id, fullscreen);
+	toplevel_set_state(self, TOPLEVEL_FULLSCREEN, fullscreen);
+}
 
-	wl_callback_destroy(wl_callback);
-	sync_callback = NULL;
+static void toplevel_set_activated (struct Toplevel *self, bool activated)
+{
+	if (debug_log)
+		fprintf(stdout, "[toplevel %ld: set activated: %d]\n",
+				self->id, activated);
 
-	if ( sync == 0 )
+	static uint32_t activation_counter = 0;
+	if ( activated && !toplevel_has(self, TOPLEVEL_ACTIVATED) )
 	{
-		/* First sync: The registry finished advertising globals.
-		 * Now we can check whether we have everything we need.
-		 */
-		if ( zwlr_toplevel_manager != NULL )
-			used_protocol = ZWLR_FOREIGN_TOPLEVEL;
-		if ( ext_toplevel_list != NULL )
-			used_protocol = EXT_FOREIGN_TOPLEVEL;
-		if ( used_protocol == NONE )
+		self->activation = ++activation_counter;
+		self->activated_at = timestamp_now();
+		focus_candidate = toplevel_index(self);
+	}
+	if ( toplevel_has(self, TOPLEVEL_ACTIVATED) != activated )
+		self->changes = (uint8_t)(self->changes | CHANGED_ACTIVATED);
+	toplevel_set_flag(self, TOPLEVEL_ACTIVATED, activated);
+}
+
+static void toplevel_set_maximized (struct Toplevel *self, bool maximized)
+{
+	if (debug_log)
+		fprintf(stdout, "[toplevel %ld: set maximized: %d]\n",
+				self->id, maximized);
+	toplevel_set_state(self, TOPLEVEL_MAXIMIZED, maximized);
+}
+
+static void toplevel_set_minimized (struct Toplevel *self, bool minimized)
+{
+	if (debug_log)
+		fprintf(stdout, "[toplevel %ld: set minimized: %d]\n",
+				self->id, minimized);
+	toplevel_set_state(self, TOPLEVEL_MINIMIZED, minimized);
+}
+
+static void toplevel_set_sticky (struct Toplevel *self, bool sticky)
+{
+	if (debug_log)
+		fprintf(stdout, "[toplevel %ld: set sticky: %d]\n",
+				self->id, sticky);
+	toplevel_set_state(self, TOPLEVEL_STICKY, sticky);
+}
+
+/** Emit the changed event, if anything changed since the last one. */
+static void toplevel_emit_changes (struct Toplevel *self)
+{
+	if ( self->changes != 0 )
+		emit_event(self, EVENT_CHANGED);
+	self->changes = 0;
+	toplevel_set_flag(self, TOPLEVEL_FOCUS_PENDING, false);
+}
+
+/**
+ * Whether a change of the activated state of the toplevel may be part of the
+ * next focus event, as it is the focus candidate or the focused toplevel.
+ */
+static bool toplevel_focus_pending (const struct Toplevel *self)
+{
+	const uint32_t index = toplevel_index(self);
+	return index == focus_candidate || ( focus.known && index == focus.index );
+}
+
+static void toplevel_done (struct Toplevel *self)
+{
+	if (debug_log)
+		fprintf(stderr, "[toplevel %ld: done]", self->id);
+
+	if ( !toplevel_has(self, TOPLEVEL_LISTED) || self->changes != 0 )
+		self->changed_at = timestamp_now();
+	if (toplevel_has(self, TOPLEVEL_LISTED))
+	{
+		/* Leave changes of only the activated state to focus_flush(). */
+		if ( self->changes == CHANGED_ACTIVATED && toplevel_focus_pending(self) )
+			toplevel_set_flag(self, TOPLEVEL_FOCUS_PENDING, true);
+		else
+			toplevel_emit_changes(self);
+	}
+	else
+	{
+		toplevel_set_flag(self, TOPLEVEL_LISTED, true);
+		emit_event(self, EVENT_CREATED);
+		self->changes = 0;
+	}
+	snapshot_outdated = true;
+}
+
+/**********************
+ *                    *
+ *    Search index    *
+ *                    *
+ **********************/
+/* Toplevels are found by the trigrams (runs of three case-folded codepoints)
+ * of their title and app-id. The index maps every trigram to the toplevels
+ * containing it and is updated whenever one of those strings changes, so a
+ * query only has to look at the entries for its own trigrams instead of
+ * scanning all toplevels.
+ */
+struct Posting
+{
+	uint64_t trigram;
+	uint32_t *toplevels;
+	size_t len;
+	size_t capacity;
+};
+
+/**
+ * Per-toplevel bookkeeping. The folded strings are case-folded copies of
+ * title and app-id. trigrams holds the sorted keys of all postings listing
+ * the toplevel and positions where in those postings it is stored, so it can
+ * be removed again in constant time.
+ */
+struct Search_entry
+{
+	char *folded_title;
+	char *folded_app_id;
+	uint64_t *trigrams;
+	size_t *positions;
+	size_t trigrams_len;
+
+	/** Bytes of the entry and its arrays charged to the memory budget. */
+	size_t bytes;
+
+	/** Scratch data of the current query. */
+	size_t score;
+	size_t generation;
+};
+
+/** Open addressing hash table, capacity is always a power of two. */
+struct Posting *search_index = NULL;
+size_t search_index_capacity = 0;
+size_t search_index_used = 0;
+
+/** Incremented for every query, used to reset per-toplevel scratch data. */
+size_t search_generation = 0;
+
+static size_t utf8_encode (char *buf, uint32_t cp)
+{
+	if ( cp < 0x80 )
+	{
+		buf[0] = (char)cp;
+		return 1;
+	}
+	if ( cp < 0x800 )
+	{
+		buf[0] = (char)(0xC0 | (cp >> 6));
+		buf[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	}
+	if ( cp < 0x10000 )
+	{
+		buf[0] = (char)(0xE0 | (cp >> 12));
+		buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		buf[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+	buf[0] = (char)(0xF0 | (cp >> 18));
+	buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+	buf[3] = (char)(0x80 | (cp & 0x3F));
+	return 4;
+}
+
+/**
+ * Simple case folding for the most common alphabets (Latin, Greek and
+ * Cyrillic). None of these mappings change the encoded length of a codepoint.
+ */
+static uint32_t fold_codepoint (uint32_t cp)
+{
+	if ( cp >= 'A' && cp <= 'Z' )
+		return cp + 32;
+	if ( cp < 0xC0 )
+		return cp;
+	if ( cp <= 0xDE && cp != 0xD7 ) /* Latin-1 Supplement. */
+		return cp + 32;
+	if ( cp >= 0x100 && cp <= 0x137 ) /* Latin Extended-A. */
+		return cp | 1;
+	if ( cp >= 0x139 && cp <= 0x148 )
+		return (cp & 1) ? cp + 1 : cp;
+	if ( cp >= 0x14A && cp <= 0x177 )
+		return cp | 1;
+	if ( cp == 0x178 )
+		return 0xFF;
+	if ( cp >= 0x179 && cp <= 0x17E )
+		return (cp & 1) ? cp + 1 : cp;
+	if ( cp >= 0x391 && cp <= 0x3AB && cp != 0x3A2 ) /* Greek. */
+		return cp + 32;
+	if ( cp >= 0x400 && cp <= 0x40F ) /* Cyrillic. */
+		return cp + 80;
+	if ( cp >= 0x410 && cp <= 0x42F )
+		return cp + 32;
+	return cp;
+}
+
+/** Return a case-folded copy of the string. Invalid UTF-8 is copied as-is. */
+static char *fold_string (const char *str)
+{
+	char *folded = malloc(strlen(str) + 1);
+	if ( folded == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+
+	const unsigned char *s = (const unsigned char *)str;
+	const size_t len = strlen(str);
+	char *out = folded;
+	for (size_t i = 0; i < len;)
+	{
+		bool valid;
+		const size_t n = utf8_sequence(s + i, len - i, &valid);
+		if (valid)
+			out += utf8_encode(out, fold_codepoint(utf8_codepoint(s + i, n)));
+		else
 		{
-			const char *err_message =
-				"ERROR: Wayland server supports none of the protocol extensions required for getting toplevel information:\n"
-				"    -> zwlr-foreign-toplevel-management-unstable-v1, version 3 or higher\n"
-				"    -> ext-foreign-toplevel-list-v1, version 1 or higher\n"
-				"\n";
-			fputs(err_message, stderr);
-			ret = EXIT_FAILURE;
-			loop = false;
+			memcpy(out, s + i, n);
+			out += n;
+		}
+		i += n;
+	}
+	*out = '\0';
+	return folded;
+}
+
+static int compare_trigrams (const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Append the trigrams of the already folded string to the array. Does not
+ * deduplicate. Returns false on allocation failure.
+ */
+static bool collect_trigrams (const char *folded, uint64_t **trigrams, size_t *len)
+{
+	if ( folded == NULL )
+		return true;
+
+	/* A string has at most one trigram per byte. */
+	const size_t folded_len = strlen(folded);
+	uint64_t *new = realloc(*trigrams, (*len + folded_len + 1) * sizeof(uint64_t));
+	if ( new == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return false;
+	}
+	*trigrams = new;
+
+	/* Invalid sequences, which only queries may contain, count as U+FFFD
+	 * like in repaired strings.
+	 */
+	const unsigned char *s = (const unsigned char *)folded;
+	uint64_t window = 0;
+	size_t seen = 0;
+	for (size_t i = 0; i < folded_len;)
+	{
+		bool valid;
+		const size_t n = utf8_sequence(s + i, folded_len - i, &valid);
+		const uint64_t cp = valid ? utf8_codepoint(s + i, n) : 0xFFFD;
+		i += n;
+		window = ((window << 21) | cp) & ((UINT64_C(1) << 63) - 1);
+		if ( ++seen >= 3 )
+			(*trigrams)[(*len)++] = window;
+	}
+	return true;
+}
+
+/** Sort and deduplicate an array of trigrams, returns the new length. */
+static size_t unique_trigrams (uint64_t *trigrams, size_t len)
+{
+	if ( len == 0 )
+		return 0;
+	qsort(trigrams, len, sizeof(uint64_t), compare_trigrams);
+	size_t n = 1;
+	for (size_t i = 1; i < len; i++)
+		if ( trigrams[i] != trigrams[n-1] )
+			trigrams[n++] = trigrams[i];
+	return n;
+}
+
+static size_t hash_trigram (uint64_t trigram)
+{
+	trigram ^= trigram >> 33;
+	trigram *= UINT64_C(0xff51afd7ed558ccd);
+	trigram ^= trigram >> 33;
+	return (size_t)trigram;
+}
+
+/**
+ * Find the posting list of the trigram. If create is true, a missing entry
+ * is added. Returns NULL if the trigram is not in the index or the index can
+ * not be grown. Trigrams are never zero, so zero marks an empty slot.
+ */
+static struct Posting *search_index_lookup (uint64_t trigram, bool create)
+{
+	if ( create && (search_index_used + 1) * 2 > search_index_capacity )
+	{
+		const size_t capacity = search_index_capacity == 0 ? 1024 : search_index_capacity * 2;
+		if (!memory_reserve(capacity * sizeof(struct Posting)))
+			return NULL;
+		struct Posting *index = calloc(capacity, sizeof(struct Posting));
+		if ( index == NULL )
+		{
+			fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+			memory_release(capacity * sizeof(struct Posting));
+			return NULL;
+		}
+		for (size_t i = 0; i < search_index_capacity; i++)
+		{
+			if ( search_index[i].trigram == 0 )
+				continue;
+			size_t slot = hash_trigram(search_index[i].trigram) & (capacity - 1);
+			while ( index[slot].trigram != 0 )
+				slot = (slot + 1) & (capacity - 1);
+			index[slot] = search_index[i];
+		}
+		free(search_index);
+		memory_release(search_index_capacity * sizeof(struct Posting));
+		search_index = index;
+		search_index_capacity = capacity;
+	}
+
+	if ( search_index_capacity == 0 )
+		return NULL;
+
+	size_t slot = hash_trigram(trigram) & (search_index_capacity - 1);
+	for (;; slot = (slot + 1) & (search_index_capacity - 1))
+	{
+		struct Posting *posting = &search_index[slot];
+		if ( posting->trigram == trigram )
+			return posting;
+		if ( posting->trigram != 0 )
+			continue;
+		if (!create)
+			return NULL;
+		posting->trigram = trigram;
+		search_index_used++;
+		return posting;
+	}
+}
+
+/**
+ * Delete the now empty posting list. Following entries of the same probe
+ * sequence are shifted back into the hole, so lookups need no tombstones.
+ */
+static void search_index_delete (struct Posting *posting)
+{
+	free(posting->toplevels);
+	memory_release(posting->capacity * sizeof(uint32_t));
+	const size_t mask = search_index_capacity - 1;
+	size_t hole = (size_t)(posting - search_index);
+	for (size_t slot = (hole + 1) & mask; search_index[slot].trigram != 0; slot = (slot + 1) & mask)
+	{
+		/* An entry may only move back if the hole is not before its home slot. */
+		const size_t home = hash_trigram(search_index[slot].trigram) & mask;
+		if ( ((slot - home) & mask) >= ((slot - hole) & mask) )
+		{
+			search_index[hole] = search_index[slot];
+			hole = slot;
+		}
+	}
+	search_index[hole] = (struct Posting){ 0 };
+	search_index_used--;
+}
+
+/** Returns the position of the trigram in the sorted trigrams of the entry. */
+static size_t find_trigram (const struct Search_entry *entry, uint64_t trigram)
+{
+	const uint64_t *found = bsearch(&trigram, entry->trigrams, entry->trigrams_len,
+			sizeof(uint64_t), compare_trigrams);
+	assert(found != NULL);
+	return (size_t)(found - entry->trigrams);
+}
+
+/** Remove all index entries pointing to the toplevel. */
+static void search_index_remove (struct Toplevel *toplevel)
+{
+	struct Search_entry *entry = toplevel->search;
+	if ( entry == NULL )
+		return;
+
+	const uint32_t index = toplevel_index(toplevel);
+	for (size_t i = 0; i < entry->trigrams_len; i++)
+	{
+		struct Posting *posting = search_index_lookup(entry->trigrams[i], false);
+		assert(posting != NULL);
+
+		/* Move the last entry into the freed slot. */
+		const size_t position = entry->positions[i];
+		const uint32_t last = posting->toplevels[--posting->len];
+		if ( posting->len == 0 )
+		{
+			search_index_delete(posting);
+			continue;
+		}
+		if ( last == index )
+			continue;
+		posting->toplevels[position] = last;
+		struct Search_entry *last_entry = toplevel_get(last)->search;
+		last_entry->positions[find_trigram(last_entry, entry->trigrams[i])] = position;
+	}
+
+	free(entry->trigrams);
+	free(entry->positions);
+	free(entry->folded_title);
+	free(entry->folded_app_id);
+	memory_release(entry->bytes);
+	free(entry);
+	toplevel->search = NULL;
+}
+
+/** (Re-)index the toplevel after its title or app-id changed. */
+static void search_index_update (struct Toplevel *toplevel)
+{
+	search_index_remove(toplevel);
+
+	struct Search_entry *entry = calloc(1, sizeof(struct Search_entry));
+	if ( entry == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		return;
+	}
+	toplevel->search = entry;
+
+	if (toplevel->title.set)
+		entry->folded_title = fold_string(string_get(&toplevel->title));
+	if (toplevel->app_id.set)
+		entry->folded_app_id = fold_string(string_get(&toplevel->app_id));
+
+	uint64_t *trigrams = NULL;
+	size_t len = 0;
+	if ( !collect_trigrams(entry->folded_title, &trigrams, &len)
+			|| !collect_trigrams(entry->folded_app_id, &trigrams, &len) )
+	{
+		free(trigrams);
+		return;
+	}
+	len = unique_trigrams(trigrams, len);
+
+	/* Folding keeps the length of the strings. The array of trigrams is not
+	 * shrunk, but only its used part is counted.
+	 */
+	const size_t bytes = sizeof(struct Search_entry)
+		+ ( toplevel->title.set ? toplevel->title.len + 1 : 0 )
+		+ ( toplevel->app_id.set ? toplevel->app_id.len + 1 : 0 )
+		+ len * sizeof(uint64_t) + ( len + 1 ) * sizeof(size_t);
+	if (!memory_reserve(bytes))
+	{
+		free(trigrams);
+		free(entry->folded_title);
+		free(entry->folded_app_id);
+		free(entry);
+		toplevel->search = NULL;
+		unindexed_toplevels++;
+		return;
+	}
+	entry->bytes = bytes;
+
+	entry->positions = calloc(len + 1, sizeof(size_t));
+	if ( entry->positions == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		free(trigrams);
+		return;
+	}
+	entry->trigrams = trigrams;
+
+	/* Only count entries actually added, so removal stays consistent. */
+	const uint32_t index = toplevel_index(toplevel);
+	for (; entry->trigrams_len < len; entry->trigrams_len++)
+	{
+		struct Posting *posting = search_index_lookup(trigrams[entry->trigrams_len], true);
+		if ( posting == NULL )
 			return;
+		if ( posting->len == posting->capacity )
+		{
+			const size_t capacity = posting->capacity == 0 ? 4 : posting->capacity * 2;
+			const size_t added = ( capacity - posting->capacity ) * sizeof(uint32_t);
+			if (!memory_reserve(added))
+				return;
+			uint32_t *new = realloc(posting->toplevels, capacity * sizeof(uint32_t));
+			if ( new == NULL )
+			{
+				fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+				memory_release(added);
+				return;
+			}
+			posting->toplevels = new;
+			posting->capacity = capacity;
+		}
+		entry->positions[entry->trigrams_len] = posting->len;
+		posting->toplevels[posting->len++] = index;
+	}
+}
+
+static void search_index_free (void)
+{
+	for (size_t i = 0; i < search_index_capacity; i++)
+	{
+		free(search_index[i].toplevels);
+		memory_release(search_index[i].capacity * sizeof(uint32_t));
+	}
+	free(search_index);
+	memory_release(search_index_capacity * sizeof(struct Posting));
+	search_index = NULL;
+	search_index_capacity = 0;
+	search_index_used = 0;
+}
+
+static bool has_prefix (const char *str, const char *prefix)
+{
+	return str != NULL && strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+static bool has_substring (const char *str, const char *substring)
+{
+	return str != NULL && strstr(str, substring) != NULL;
+}
+
+static int compare_search_results (const void *a, const void *b)
+{
+	const struct Toplevel *x = *(struct Toplevel *const *)a;
+	const struct Toplevel *y = *(struct Toplevel *const *)b;
+	if ( x->search->score != y->search->score )
+		return x->search->score > y->search->score ? -1 : 1;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * Search all listed toplevels. Returns an array of the matching toplevels,
+ * best match first, which must be freed by the caller. A toplevel matches if
+ * it contains at least half of the trigrams of the query. Exact substring
+ * and prefix matches rank higher. Queries too short to contain a trigram
+ * fall back to a plain substring search.
+ */
+static struct Toplevel **search (const char *query, size_t *len)
+{
+	*len = 0;
+	char *folded = fold_string(query);
+	if ( folded == NULL )
+		return NULL;
+
+	uint64_t *trigrams = NULL;
+	size_t trigrams_len = 0;
+	struct Toplevel **results = NULL;
+	size_t capacity = 0;
+	if (!collect_trigrams(folded, &trigrams, &trigrams_len))
+		goto out;
+	trigrams_len = unique_trigrams(trigrams, trigrams_len);
+
+	search_generation++;
+	if ( trigrams_len == 0 )
+	{
+		capacity = toplevels_len;
+		results = calloc(capacity + 1, sizeof(struct Toplevel *));
+		if ( results == NULL )
+		{
+			fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+			goto out;
+		}
+		for (uint32_t i = 0; i < toplevels_len; i++)
+		{
+			struct Toplevel *t = &toplevels[i];
+			if ( !toplevel_has(t, TOPLEVEL_LISTED) || t->search == NULL )
+				continue;
+			if ( !has_substring(t->search->folded_app_id, folded)
+					&& !has_substring(t->search->folded_title, folded) )
+				continue;
+			t->search->score = 0;
+			results[(*len)++] = t;
+		}
+	}
+	else for (size_t i = 0; i < trigrams_len; i++)
+	{
+		struct Posting *posting = search_index_lookup(trigrams[i], false);
+		if ( posting == NULL )
+			continue;
+		for (size_t j = 0; j < posting->len; j++)
+		{
+			struct Toplevel *t = toplevel_get(posting->toplevels[j]);
+			if (!toplevel_has(t, TOPLEVEL_LISTED))
+				continue;
+			if ( t->search->generation == search_generation )
+			{
+				t->search->score++;
+				continue;
+			}
+			if ( *len == capacity )
+			{
+				capacity = capacity == 0 ? 64 : capacity * 2;
+				struct Toplevel **new = realloc(results, capacity * sizeof(struct Toplevel *));
+				if ( new == NULL )
+				{
+					fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+					free(results);
+					results = NULL;
+					*len = 0;
+					goto out;
+				}
+				results = new;
+			}
+			t->search->generation = search_generation;
+			t->search->score = 1;
+			results[(*len)++] = t;
+		}
+	}
+
+	/* Turn the trigram hit counts into scores and drop weak matches. */
+	const uint64_t cutoff = changed_cutoff();
+	size_t matches = 0;
+	for (size_t i = 0; i < *len; i++)
+	{
+		struct Search_entry *entry = results[i]->search;
+		if ( results[i]->changed_at.monotonic < cutoff )
+			continue;
+		if ( trigrams_len > 0 )
+		{
+			if ( entry->score * 2 < trigrams_len )
+				continue;
+			entry->score = entry->score * 100 / trigrams_len;
+		}
+		if ( has_substring(entry->folded_app_id, folded) || has_substring(entry->folded_title, folded) )
+			entry->score += 100;
+		if ( has_prefix(entry->folded_app_id, folded) || has_prefix(entry->folded_title, folded) )
+			entry->score += 50;
+		results[matches++] = results[i];
+	}
+	*len = matches;
+	if ( matches > 1 )
+		qsort(results, matches, sizeof(struct Toplevel *), compare_search_results);
+
+out:
+	free(trigrams);
+	free(folded);
+	return results;
+}
+
+static void watch_write_search_results (const char *query)
+{
+	size_t len;
+	struct Toplevel **results = search(query, &len);
+	fprintf(stdout, "search '%s': %ld matches\n", query, len);
+	for (size_t i = 0; i < len; i++)
+		fprintf(stdout, "search '%s': toplevel %ld: score %ld: '%s' '%s'\n",
+				query, results[i]->id, results[i]->search->score,
+				string_get(&results[i]->app_id), string_get(&results[i]->title));
+	fflush(stdout);
+	free(results);
+}
+
+/*****************
+ *               *
+ *    Sorting    *
+ *               *
+ *****************/
+/* Instead of comparing toplevels field by field, every toplevel gets a single
+ * byte string as sort key, built once before sorting, which compares correctly
+ * with memcmp(). Strings are case-folded. Reversed fields simply have all
+ * their bytes inverted. The first eight bytes of each key are also kept in the
+ * record itself, which decides most comparisons without touching the keys.
+ */
+struct Sort_record
+{
+	uint64_t prefix;
+	size_t key_offset;
+	size_t key_len;
+	size_t group_key_len;
+	struct Toplevel *toplevel;
+};
+
+struct Sort_keys
+{
+	unsigned char *data;
+	size_t len;
+	size_t capacity;
+};
+
+static bool sort_keys_reserve (struct Sort_keys *keys, size_t len)
+{
+	if ( keys->len + len <= keys->capacity )
+		return true;
+	size_t capacity = keys->capacity == 0 ? 4096 : keys->capacity * 2;
+	while ( capacity < keys->len + len )
+		capacity *= 2;
+	unsigned char *data = realloc(keys->data, capacity);
+	if ( data == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return false;
+	}
+	keys->data = data;
+	keys->capacity = capacity;
+	return true;
+}
+
+static bool sort_keys_append (struct Sort_keys *keys, const void *data, size_t len, bool reverse)
+{
+	if (!sort_keys_reserve(keys, len))
+		return false;
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < len; i++)
+		keys->data[keys->len++] = reverse ? (unsigned char)~bytes[i] : bytes[i];
+	return true;
+}
+
+static bool sort_keys_append_u32 (struct Sort_keys *keys, uint32_t value, bool reverse)
+{
+	const unsigned char bytes[4] = {
+		(unsigned char)(value >> 24), (unsigned char)(value >> 16),
+		(unsigned char)(value >> 8), (unsigned char)value,
+	};
+	return sort_keys_append(keys, bytes, sizeof(bytes), reverse);
+}
+
+/**
+ * Unset strings sort before all others. The terminating zero byte makes
+ * shorter strings sort before longer ones starting with them.
+ */
+static bool sort_keys_append_string (struct Sort_keys *keys, const struct String *str, bool reverse)
+{
+	const unsigned char set = str->set ? 1 : 0;
+	if (!sort_keys_append(keys, &set, 1, reverse))
+		return false;
+	if (!str->set)
+		return true;
+
+	char *folded = fold_string(string_get(str));
+	if ( folded == NULL )
+		return false;
+	const bool ok = sort_keys_append(keys, folded, strlen(folded) + 1, reverse);
+	free(folded);
+	return ok;
+}
+
+/** Activated toplevels first, then fullscreen, maximized and minimized last. */
+static unsigned char state_sort_key (const struct Toplevel *toplevel)
+{
+	return (unsigned char)((!toplevel_has(toplevel, TOPLEVEL_ACTIVATED) << 3)
+		| (toplevel_has(toplevel, TOPLEVEL_MINIMIZED) << 2)
+		| (!toplevel_has(toplevel, TOPLEVEL_FULLSCREEN) << 1)
+		| !toplevel_has(toplevel, TOPLEVEL_MAXIMIZED));
+}
+
+static bool sort_keys_append_field (struct Sort_keys *keys, const struct Toplevel *toplevel,
+		struct Sort_field field)
+{
+	switch (field.key)
+	{
+		case SORT_APP_ID:
+			return sort_keys_append_string(keys, &toplevel->app_id, field.reverse);
+
+		case SORT_TITLE:
+			return sort_keys_append_string(keys, &toplevel->title, field.reverse);
+
+		case SORT_ID:
+			return sort_keys_append_u32(keys, (uint32_t)toplevel->id, field.reverse);
+
+		case SORT_STATE:;
+			const unsigned char state = state_sort_key(toplevel);
+			return sort_keys_append(keys, &state, 1, field.reverse);
+
+		case SORT_MRU: /* Most recently activated first. */
+			return sort_keys_append_u32(keys, UINT32_MAX - toplevel->activation, field.reverse);
+	}
+	assert(false);
+	return false;
+}
+
+/** The string toplevels are grouped by. */
+static const struct String *group_key (const struct Toplevel *toplevel)
+{
+	switch (group_by)
+	{
+		case GROUP_APP_ID:
+			return &toplevel->app_id;
+
+		case GROUP_NORMALIZED_APP_ID:
+			return toplevel_normalized_app_id(toplevel);
+
+		case GROUP_NORMALIZED_TITLE:
+			return toplevel_normalized_title(toplevel);
+
+		case GROUP_NONE:
+			break;
+	}
+	assert(false);
+	return NULL;
+}
+
+/** Key buffer of the running sort, qsort() has no way to pass it along. */
+const unsigned char *sort_key_data = NULL;
+
+static int compare_sort_records (const void *a, const void *b)
+{
+	const struct Sort_record *x = (const struct Sort_record *)a;
+	const struct Sort_record *y = (const struct Sort_record *)b;
+	if ( x->prefix != y->prefix )
+		return x->prefix < y->prefix ? -1 : 1;
+
+	/* Keys end with the unique position of the toplevel, so no key is a
+	 * prefix of another.
+	 */
+	const size_t len = x->key_len < y->key_len ? x->key_len : y->key_len;
+	return memcmp(sort_key_data + x->key_offset, sort_key_data + y->key_offset, len);
+}
+
+/**
+ * Sort the toplevels by the requested keys and assign their groups. Toplevels
+ * with equal keys keep their relative order. Returns false if the keys could
+ * not be allocated, leaving the order untouched.
+ */
+static bool sort_toplevels (struct Toplevel **list, size_t len)
+{
+	struct Sort_keys keys = { 0 };
+	struct Sort_record *records = calloc(len + 1, sizeof(struct Sort_record));
+	if ( records == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < len && ok; i++)
+	{
+		struct Sort_record *record = &records[i];
+		record->toplevel = list[i];
+		record->key_offset = keys.len;
+		if ( group_by != GROUP_NONE )
+		{
+			ok = sort_keys_append_string(&keys, group_key(list[i]), false);
+			record->group_key_len = keys.len - record->key_offset;
+		}
+		for (size_t j = 0; j < sort_fields_len && ok; j++)
+			ok = sort_keys_append_field(&keys, list[i], sort_fields[j]);
+		ok = ok && sort_keys_append_u32(&keys, (uint32_t)i, false);
+		record->key_len = keys.len - record->key_offset;
+	}
+	if (!ok)
+		goto out;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		struct Sort_record *record = &records[i];
+		for (size_t j = 0; j < sizeof(uint64_t); j++)
+		{
+			record->prefix <<= 8;
+			if ( j < record->key_len )
+				record->prefix |= keys.data[record->key_offset + j];
+		}
+	}
+
+	sort_key_data = keys.data;
+	qsort(records, len, sizeof(struct Sort_record), compare_sort_records);
+	sort_key_data = NULL;
+
+	uint32_t group = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		const struct Sort_record *record = &records[i];
+		if ( i > 0 )
+		{
+			const struct Sort_record *previous = &records[i-1];
+			if ( record->group_key_len != previous->group_key_len
+					|| memcmp(keys.data + record->key_offset,
+						keys.data + previous->key_offset,
+						record->group_key_len) != 0 )
+				group++;
+		}
+		record->toplevel->group = group;
+		list[i] = record->toplevel;
+	}
+
+out:
+	free(records);
+	free(keys.data);
+	return ok;
+}
+
+/** Parse the argument of --sort. Prints error messages accordingly. */
+static bool parse_sort_fields (const char *arg)
+{
+	static const struct
+	{
+		const char *name;
+		enum Sort_key key;
+	} names[] = {
+		{ "app-id", SORT_APP_ID },
+		{ "title",  SORT_TITLE  },
+		{ "id",     SORT_ID     },
+		{ "state",  SORT_STATE  },
+		{ "mru",    SORT_MRU    },
+	};
+
+	sort_fields_len = 0;
+	while ( *arg != '\0' )
+	{
+		struct Sort_field field = { .reverse = false };
+		if ( *arg == '-' )
+		{
+			field.reverse = true;
+			arg++;
+		}
+
+		const size_t len = strcspn(arg, ",");
+		size_t i = 0;
+		for (; i < sizeof(names) / sizeof(names[0]); i++)
+			if ( strlen(names[i].name) == len && strncmp(names[i].name, arg, len) == 0 )
+				break;
+		if ( i == sizeof(names) / sizeof(names[0]) )
+		{
+			fprintf(stderr, "ERROR: Invalid sort key: '%.*s'.\n", (int)len, arg);
+			return false;
+		}
+		if ( sort_fields_len == MAX_SORT_FIELDS )
+		{
+			fputs("ERROR: Too many sort keys.\n", stderr);
+			return false;
+		}
+		field.key = names[i].key;
+		sort_fields[sort_fields_len++] = field;
+
+		arg += len;
+		if ( *arg == ',' )
+			arg++;
+	}
+
+	if ( sort_fields_len == 0 )
+	{
+		fputs("ERROR: Sort requires at least one key.\n", stderr);
+		return false;
+	}
+	return true;
+}
+
+/*********************************************************
+ *                                                       *
+ *    cosmic-toplevel-info-unstable-v1 implementation    *
+ *                                                       *
+ *********************************************************/
+static void cosmic_handle_handle_state (void *data, struct zcosmic_toplevel_handle_v1 *handle,
+		struct wl_array *states)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+
+	bool fullscreen = false;
+	bool activated = false;
+	bool minimized = false;
+	bool maximized = false;
+	bool sticky = false;
+
+	uint32_t *state;
+	wl_array_for_each(state, states) switch (*state)
+	{
+		case ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED: maximized = true; break;
+		case ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED: minimized = true; break;
+		case ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED: activated = true; break;
+		case ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN: fullscreen = true; break;
+		case ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_STICKY: sticky = true; break;
+	}
+
+	toplevel_set_fullscreen(toplevel, fullscreen);
+	toplevel_set_activated(toplevel, activated);
+	toplevel_set_minimized(toplevel, minimized);
+	toplevel_set_maximized(toplevel, maximized);
+	toplevel_set_sticky(toplevel, sticky);
+}
+
+static void cosmic_handle_handle_done (void *data, struct zcosmic_toplevel_handle_v1 *handle)
+{
+	stats.events++;
+	/* The state of the toplevel is only complete once the ext handle is
+	 * done as well, so only refresh toplevels which already are listed.
+	 */
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	if (toplevel_has(toplevel, TOPLEVEL_LISTED))
+	{
+		toplevel_emit_changes(toplevel);
+		snapshot_outdated = true;
+	}
+}
+
+/* Title and app-id are deprecated in favour of the ext handle, which also
+ * tells us when the toplevel is closed. Only the states are used: workspaces
+ * are objects of the cosmic workspace protocol, which lswt does not bind, so
+ * they can not be named, and outputs are not shown for wlr toplevels either.
+ */
+static const struct zcosmic_toplevel_handle_v1_listener cosmic_handle_listener = {
+	.app_id          = count_event,
+	.closed          = count_event,
+	.done            = cosmic_handle_handle_done,
+	.geometry        = count_event,
+	.output_enter    = count_event,
+	.output_leave    = count_event,
+	.state           = cosmic_handle_handle_state,
+	.title           = count_event,
+	.workspace_enter = count_event,
+	.workspace_leave = count_event,
+};
+
+static void cosmic_toplevel_get_handle (struct Toplevel *toplevel)
+{
+	toplevel->cosmic_handle = zcosmic_toplevel_info_v1_get_cosmic_toplevel(
+			cosmic_toplevel_info, toplevel->ext_handle);
+	zcosmic_toplevel_handle_v1_add_listener(toplevel->cosmic_handle,
+			&cosmic_handle_listener, toplevel_to_data(toplevel));
+}
+
+static const struct zcosmic_toplevel_info_v1_listener cosmic_toplevel_info_listener = {
+	.done     = noop,
+	.finished = noop,
+	.toplevel = noop,
+};
+
+/*****************************************************
+ *                                                   *
+ *    ext-foreign-toplevel-list-v1 implementation    *
+ *                                                   *
+ *****************************************************/
+static void ext_foreign_handle_handle_identifier (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
+		const char *identifier)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_set_identifier(toplevel, identifier);
+}
+
+static void ext_foreign_handle_handle_title (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
+		const char *title)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_set_title(toplevel, title);
+}
+
+static void ext_foreign_handle_handle_app_id (void *data, struct ext_foreign_toplevel_handle_v1 *handle,
+		const char *app_id)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_set_app_id(toplevel, app_id);
+}
+
+static void ext_foreign_handle_handle_done (void *data, struct ext_foreign_toplevel_handle_v1 *handle)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_done(toplevel);
+}
+
+static void ext_foreign_handle_handle_closed (void *data, struct ext_foreign_toplevel_handle_v1 *handle)
+{
+	stats.events++;
+	/* We only care when watching for events. */
+	if ( mode == WATCH )
+	{
+		struct Toplevel *toplevel = toplevel_from_data(data);
+		toplevel_destroy(toplevel);
+	}
+}
+
+static const struct ext_foreign_toplevel_handle_v1_listener ext_handle_listener = {
+	.app_id       = ext_foreign_handle_handle_app_id,
+	.closed       = ext_foreign_handle_handle_closed,
+	.done         = ext_foreign_handle_handle_done,
+	.identifier   = ext_foreign_handle_handle_identifier,
+	.title        = ext_foreign_handle_handle_title,
+};
+
+static void ext_toplevel_list_handle_toplevel (void *data,
+		struct ext_foreign_toplevel_list_v1 *list,
+		struct ext_foreign_toplevel_handle_v1 *handle)
+{
+	stats.toplevels++;
+	struct Toplevel *toplevel = toplevel_new();
+	if ( toplevel == NULL )
+	{
+		ext_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->ext_handle = handle;
+	ext_foreign_toplevel_handle_v1_add_listener(handle, &ext_handle_listener, toplevel_to_data(toplevel));
+
+	if ( cosmic_toplevel_info != NULL )
+		cosmic_toplevel_get_handle(toplevel);
+}
+
+static const struct ext_foreign_toplevel_list_v1_listener ext_toplevel_list_listener = {
+	.toplevel = ext_toplevel_list_handle_toplevel,
+	.finished = noop,
+};
+
+/************************************************************
+ *                                                          *
+ *    zwlr-foreign-toplevel-management-v1 implementation    *
+ *                                                          *
+ ************************************************************/
+static void zwlr_foreign_handle_handle_title (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		const char *title)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_set_title(toplevel, title);
+}
+
+static void zwlr_foreign_handle_handle_app_id (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		const char *app_id)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_set_app_id(toplevel, app_id);
+}
+
+static void zwlr_foreign_handle_handle_state (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_array *states)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+
+	bool fullscreen = false;
+	bool activated = false;
+	bool minimized = false;
+	bool maximized = false;
+
+	uint32_t *state;
+	wl_array_for_each(state, states) switch (*state)
+	{
+		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED: maximized = true; break;
+		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED: minimized = true; break;
+		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED: activated = true; break;
+		case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN: fullscreen = true; break;
+	}
+
+	toplevel_set_fullscreen(toplevel, fullscreen);
+	toplevel_set_activated(toplevel, activated);
+	toplevel_set_minimized(toplevel, minimized);
+	toplevel_set_maximized(toplevel, maximized);
+}
+
+static void zwlr_foreign_handle_handle_done (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	stats.events++;
+	struct Toplevel *toplevel = toplevel_from_data(data);
+	toplevel_done(toplevel);
+}
+
+static void zwlr_foreign_handle_handle_closed (void *data, struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	stats.events++;
+	/* We only care when watching for events. */
+	if ( mode == WATCH )
+	{
+		struct Toplevel *toplevel = toplevel_from_data(data);
+		toplevel_destroy(toplevel);
+	}
+}
+
+static const struct zwlr_foreign_toplevel_handle_v1_listener zwlr_handle_listener = {
+	.app_id       = zwlr_foreign_handle_handle_app_id,
+	.done         = zwlr_foreign_handle_handle_done,
+	.closed       = zwlr_foreign_handle_handle_closed,
+	.output_enter = count_event,
+	.output_leave = count_event,
+	.parent       = count_event,
+	.state        = zwlr_foreign_handle_handle_state,
+	.title        = zwlr_foreign_handle_handle_title,
+};
+
+static void zwlr_toplevel_manager_handle_toplevel (void *data,
+		struct zwlr_foreign_toplevel_manager_v1 *manager,
+		struct zwlr_foreign_toplevel_handle_v1 *handle)
+{
+	stats.toplevels++;
+	struct Toplevel *toplevel = toplevel_new();
+	if ( toplevel == NULL )
+	{
+		zwlr_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->zwlr_handle = handle;
+	zwlr_foreign_toplevel_handle_v1_add_listener(handle, &zwlr_handle_listener, toplevel_to_data(toplevel));
+}
+
+static const struct zwlr_foreign_toplevel_manager_v1_listener zwlr_toplevel_manager_listener = {
+	.toplevel = zwlr_toplevel_manager_handle_toplevel,
+	.finished = noop,
+};
+
+/************************
+ *                      *
+ *    Command output    *
+ *                      *
+ ************************/
+static bool string_needs_quotes (const char *str)
+{
+	for (; *str != '\0'; str++)
+		if ( isspace(*str) || *str == '"' || *str == '\'' || !isascii(*str) )
+			return true;
+	return false;
+}
+
+static void quoted_fputs (size_t *len, const char *str, FILE *restrict f)
+{
+	if ( str == NULL )
+	{
+		if ( len != NULL )
+			*len = 0;
+		return;
+	}
+
+	size_t l = 2; // Two bytes for the two mandatory quotes.
+
+	fputc('"', f);
+	for (; *str != '\0'; str++)
+	{
+		if ( *str == '"' )
+		{
+			l += 2;
+			fputs("\\\"", f);
+		}
+		else if ( *str == '\n' )
+		{
+			l += 2;
+			fputs("\\n", f);
+		}
+		else if ( *str == '\t' )
+		{
+			l += 2;
+			fputs("\\t", f);
+		}
+		else
+		{
+			l += 1;
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+
+	if ( len != NULL )
+		*len = l;
+}
+
+static void write_padding (size_t used_len, size_t padding, FILE *restrict f)
+{
+	if ( padding > used_len )
+		for (size_t i = padding - used_len; i > 0; i--)
+			fputc(' ', f);
+}
+
+static void write_padded (size_t padding, const char *str, FILE *restrict f)
+{
+	size_t len = 0;
+	if ( str == NULL )
+	{
+		fputs("<NULL>", f);
+		len = strlen("<NULL>");
+	}
+	else
+	{
+		len = strlen(str);
+		fputs(str, f);
+	}
+	write_padding(len, padding, f);
+}
+
+static void write_padded_maybe_quoted (size_t padding, const char *str, FILE *restrict f)
+{
+	size_t len = 0;
+	if ( str == NULL )
+	{
+		fputs("<NULL>", f);
+		len = strlen("<NULL>");
+	}
+	else  if (string_needs_quotes(str))
+		quoted_fputs(&len, str, f);
+	else
+	{
+		len = strlen(str);
+		fputs(str, f);
+	}
+	write_padding(len, padding, f);
+}
+
+static void write_maybe_quoted (const char *str, FILE *restrict f)
+{
+	if ( str == NULL )
+		fputs("<NULL>", f);
+	else  if (string_needs_quotes(str))
+		quoted_fputs(NULL, str, f);
+	else
+		fputs(str, f);
+}
+
+/**
+ * Always quote strings, except if they are NULL. Backslash, the quote, all
+ * control characters and DEL are escaped, so the result is valid JSON for any
+ * title.
+ */
+static void write_json (const char *str, FILE *restrict f)
+{
+	if ( str == NULL )
+	{
+		fputs("null", f);
+		return;
+	}
+
+	fputc('"', f);
+	for (const unsigned char *s = (const unsigned char *)str; *s != '\0'; s++)
+	{
+		const unsigned char *run = s;
+		while ( *s >= 0x20 && *s != 0x7F && *s != '"' && *s != '\\' )
+			s++;
+		fwrite(run, 1, (size_t)(s - run), f);
+		switch (*s)
+		{
+			case '\0': fputc('"', f); return;
+			case '"':  fputs("\\\"", f); break;
+			case '\\': fputs("\\\\", f); break;
+			case '\b': fputs("\\b", f);  break;
+			case '\f': fputs("\\f", f);  break;
+			case '\n': fputs("\\n", f);  break;
+			case '\r': fputs("\\r", f);  break;
+			case '\t': fputs("\\t", f);  break;
+			default:   fprintf(f, "\\u%04x", *s); break;
+		}
+	}
+	fputc('"', f);
+}
+
+/** Never quote strings, print "<NULL>" on NULL. */
+static void write_custom (const char *str, FILE *restrict f)
+{
+	if ( str == NULL )
+		fputs("<NULL>", f);
+	else
+		fputs(str, f);
+}
+
+/**
+ * Escape backslash, tab, newline and carriage return, so values never contain
+ * the delimiters of the TSV format. Print "\N" on NULL.
+ */
+static void write_tsv_value (const char *s, FILE *restrict f)
+{
+	if ( s == NULL )
+	{
+		fputs("\\N", f);
+		return;
+	}
+
+	for (;;)
+	{
+		const size_t run = strcspn(s, "\\\t\n\r");
+		fwrite(s, 1, run, f);
+		s += run;
+		switch (*s)
+		{
+			case '\0': return;
+			case '\\': fputs("\\\\", f); break;
+			case '\t': fputs("\\t", f); break;
+			case '\n': fputs("\\n", f); break;
+			case '\r': fputs("\\r", f); break;
+		}
+		s++;
+	}
+}
+
+static void write_tsv (const struct String *str, FILE *restrict f)
+{
+	write_tsv_value(string_get(str), f);
+}
+
+/**
+ * Write the string as-is, without looking at its contents. Print nothing on
+ * NULL.
+ */
+static void write_raw (const struct String *str, FILE *restrict f)
+{
+	if (str->set)
+		fwrite(string_get(str), 1, str->len, f);
+}
+
+/**
+ * Write the string unescaped, except for unit separators, which are replaced
+ * by spaces so they are not mistaken for the field separator of the NUL
+ * separated format. NUL can not be part of a string.
+ */
+static void write_nul_separated (const struct String *str, FILE *restrict f)
+{
+	if (!str->set)
+		return;
+	const char *s = string_get(str);
+	const char *const end = s + str->len;
+	const char *separator;
+	while ( (separator = memchr(s, '\x1f', (size_t)(end - s))) != NULL )
+	{
+		fwrite(s, 1, (size_t)(separator - s), f);
+		fputc(' ', f);
+		s = separator + 1;
+	}
+	fwrite(s, 1, (size_t)(end - s), f);
+}
+
+static void write_custom_optional (bool supported, const char *str, FILE *restrict f)
+{
+	if (supported)
+		write_custom(str, f);
+	else
+		fputs("unsupported", f);
+}
+
+static void write_custom_optional_bool (bool supported, bool b, FILE *restrict f)
+{
+	if (supported)
+		fputs(b ? "true" : "false", f);
+	else
+		fputs("unsupported", f);
+}
+
+/**
+ * Write a time stamp as microseconds since the epoch, "<NULL>" if it never
+ * happened.
+ */
+static void write_custom_time (bool supported, const struct Timestamp *time, FILE *restrict f)
+{
+	if (!supported)
+		fputs("unsupported", f);
+	else if ( time->wall == 0 )
+		fputs("<NULL>", f);
+	else
+		fprintf(f, "%" PRIu64, time->wall);
+}
+
+/** Write the string as the current output format requires, uncached. */
+static void render_string (const struct String *str, FILE *restrict f)
+{
+	switch (output_format)
+	{
+		case NORMAL:        write_maybe_quoted(string_get(str), f); break;
+		case JSON:          write_json(string_get(str), f);         break;
+		case TSV:           write_tsv(str, f);                      break;
+		case CUSTOM:        write_raw(str, f);                      break;
+		case NUL_SEPARATED: write_nul_separated(str, f);            break;
+	}
+}
+
+static const struct String *rendered_string (const struct Toplevel *toplevel, enum Rendered_string which)
+{
+	switch (which)
+	{
+		case RENDERED_TITLE:      return &toplevel->title;
+		case RENDERED_APP_ID:     return &toplevel->app_id;
+		case RENDERED_IDENTIFIER: return &toplevel->identifier;
+	}
+	return NULL;
+}
+
+/**
+ * Cache the rendering of the string of the toplevel for the current output
+ * format, unless already cached. The cache is dropped when the string
+ * changes. Returns the rendering or NULL if the string could not be rendered.
+ */
+static const struct Rendering *string_render (const struct Toplevel *toplevel, enum Rendered_string which)
+{
+	const uint32_t index = toplevel_index(toplevel);
+	if ( index >= renderings_capacity )
+	{
+		const uint32_t capacity = toplevels_capacity;
+		const size_t added = (capacity - renderings_capacity) * sizeof(renderings[0]);
+		if (!memory_reserve(added))
+			return NULL;
+		struct Rendering (*new)[RENDERED_STRINGS] = realloc(renderings, capacity * sizeof(renderings[0]));
+		if ( new == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+			memory_release(added);
+			return NULL;
+		}
+		memset(new + renderings_capacity, 0, added);
+		renderings = new;
+		renderings_capacity = capacity;
+	}
+	struct Rendering *rendering = &renderings[index][which];
+	if (rendering->valid)
+		return rendering;
+
+	const struct String *str = rendered_string(toplevel, which);
+
+	char *buffer = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buffer, &len);
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: open_memstream(): %s\n", strerror(errno));
+		return NULL;
+	}
+	render_string(str, f);
+	if ( fclose(f) != 0 )
+	{
+		fprintf(stderr, "ERROR: fclose(): %s\n", strerror(errno));
+		free(buffer);
+		return NULL;
+	}
+
+	/* Most strings need no escaping, so do not keep a second copy. */
+	if ( str->set && len == str->len && memcmp(buffer, string_get(str), len) == 0 )
+	{
+		free(buffer);
+		buffer = NULL;
+	}
+	else if (!memory_reserve(len))
+	{
+		free(buffer);
+		return NULL;
+	}
+	rendering->data = buffer;
+	rendering->len = (uint32_t)len;
+	rendering->valid = true;
+	return rendering;
+}
+
+/**
+ * Render the strings of the toplevels which the current output format writes
+ * through the cache. Only worth it in WATCH mode, where the same strings are
+ * written for every snapshot; in LIST mode every string is written only once.
+ * Called before the output is formatted, possibly by several threads, which
+ * must neither grow the cache nor touch the memory budget.
+ */
+static void render_toplevels (struct Toplevel **list, size_t len)
+{
+	if ( mode == LIST || ( output_format != NORMAL && output_format != JSON && output_format != TSV ) )
+		return;
+	const bool identifier = output_format != NORMAL && support_identifier;
+	for (size_t i = 0; i < len; i++)
+	{
+		string_render(list[i], RENDERED_TITLE);
+		string_render(list[i], RENDERED_APP_ID);
+		if (identifier)
+			string_render(list[i], RENDERED_IDENTIFIER);
+	}
+}
+
+/**
+ * Write the cached rendering of the string, padded to the given width.
+ * Returns false if nothing was written, in which case the caller has to
+ * render the string.
+ */
+static bool write_cached (const struct Toplevel *toplevel, enum Rendered_string which,
+		size_t padding, FILE *restrict f)
+{
+	const uint32_t index = toplevel_index(toplevel);
+	if ( index >= renderings_capacity || !renderings[index][which].valid )
+		return false;
+	const struct Rendering *rendering = &renderings[index][which];
+	const char *data = rendering->data != NULL ? rendering->data : string_get(rendered_string(toplevel, which));
+	fwrite(data, 1, rendering->len, f);
+	write_padding(rendering->len, padding, f);
+	return true;
+}
+
+/** Return the amount of bytes printed when printing the given string. */
+static size_t real_strlen (const char *str)
+{
+	size_t i = 0;
+	bool has_space = false;
+	for(; *str != '\0'; str++)
+	{
+		switch (*str)
+		{
+			case '"':
+			case '\\':
+			case '\n':
+			case '\t':
+				i += 2;
+				break;
+
+			default:
+				if (isspace(*str))
+					has_space = true;
+				i++;
+				break;
+		}
+	}
+	if (has_space)
+		i += 2;
+	return i;
+}
+
+static bool out_custom_field_valid (char field)
+{
+	switch (field)
+	{
+		case 't': // Title.
+		case 'a': // App-Id.
+		case 'i': // Identifier.
+		case 'A': // Activated.
+		case 'f': // Fullscreen.
+		case 'm': // Minimized.
+		case 'M': // Maximized.
+		case 's': // Sticky.
+		case 'C': // Time created.
+		case 'U': // Time last changed (updated).
+		case 'L': // Time last activated.
+		case 'N': // Normalized app-id.
+		case 'T': // Normalized title.
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+/** Write a single field of the custom output format. */
+static void out_write_custom_field (char field, struct Toplevel *toplevel, FILE *restrict f)
+{
+	switch (field)
+	{
+		case 't': write_custom(string_get(&toplevel->title), f); break;
+		case 'a': write_custom(string_get(&toplevel->app_id), f); break;
+		case 'i': write_custom_optional(support_identifier, string_get(&toplevel->identifier), f); break;
+		case 'A': write_custom_optional_bool(support_activated, toplevel_has(toplevel, TOPLEVEL_ACTIVATED), f); break;
+		case 'f': write_custom_optional_bool(support_fullscreen, toplevel_has(toplevel, TOPLEVEL_FULLSCREEN), f); break;
+		case 'm': write_custom_optional_bool(support_minimized, toplevel_has(toplevel, TOPLEVEL_MINIMIZED), f); break;
+		case 'M': write_custom_optional_bool(support_maximized, toplevel_has(toplevel, TOPLEVEL_MAXIMIZED), f); break;
+		case 's': write_custom_optional_bool(support_sticky, toplevel_has(toplevel, TOPLEVEL_STICKY), f); break;
+		case 'C': write_custom_time(true, &toplevel->created_at, f); break;
+		case 'U': write_custom_time(true, &toplevel->changed_at, f); break;
+		case 'L': write_custom_time(support_activated, &toplevel->activated_at, f); break;
+		case 'N': write_custom(string_get(toplevel_normalized_app_id(toplevel)), f); break;
+		case 'T': write_custom(string_get(toplevel_normalized_title(toplevel)), f); break;
+		default: assert(false); break;
+	}
+}
+
+/**
+ * Checks whether a custom output format is valid. Prints error messages
+ * accordingly.
+ */
+static bool out_check_custom_format (const char *fmt)
+{
+	assert(fmt != NULL);
+	const size_t len = strlen(fmt);
+	if ( len == 1 || len == 0 )
+	{
+		fputs("ERROR: Invalid custom format: Requires at least delimiter and one field.\n", stderr);
+		return false;
+	}
+	if (!isascii(*fmt))
+	{
+		fputs("ERROR: Invalid custom format: Delimiter must be an ASCII character.\n", stderr);
+		return false;
+	}
+	fmt++;
+	for (; *fmt != '\0'; fmt++)
+	{
+		if (!out_custom_field_valid(*fmt))
+		{
+			fprintf(stderr, "ERROR: Invalid custom format: Unknown field name: '%c'.\n", *fmt);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Write a single toplevel in the current output format. previous is the
+ * toplevel written before it or NULL for the first one, as JSON needs to know
+ * where to put commas and groups are separated in the NORMAL format.
+ */
+static void out_write_toplevel (struct Toplevel *toplevel, struct Toplevel *previous, FILE *restrict f)
+{
+	switch (output_format)
+	{
+		case NORMAL:
+			if ( group_by != GROUP_NONE && previous != NULL && previous->group != toplevel->group )
+				fputc('\n', f);
+			if (toplevel_has(toplevel, TOPLEVEL_ACTIVATED))
+				fputs("A", f);
+			else
+				fputs(" ", f);
+			if (toplevel_has(toplevel, TOPLEVEL_MAXIMIZED))
+				fputs("M", f);
+			else if (toplevel_has(toplevel, TOPLEVEL_MINIMIZED))
+				fputs("m", f);
+			else if (toplevel_has(toplevel, TOPLEVEL_FULLSCREEN))
+				fputs("F", f);
+			else
+				fputs(" ", f);
+			if (support_sticky)
+				fputs(toplevel_has(toplevel, TOPLEVEL_STICKY) ? "S" : " ", f);
+			fputs(" ", f);
+			if (!write_cached(toplevel, RENDERED_APP_ID, longest_app_id, f))
+				write_padded_maybe_quoted(longest_app_id, string_get(&toplevel->app_id), f);
+			fputs("   ", f);
+			if (!write_cached(toplevel, RENDERED_TITLE, 0, f))
+				write_maybe_quoted(string_get(&toplevel->title), f);
+			fputc('\n', f);
+			break;
+
+		case JSON:
+			if ( previous != NULL )
+				fputs(",\n", f);
+			fputs("        {\n", f);
+
+			if (support_activated)
+				fprintf(f, "            \"activated\": %s,\n", BOOL_TO_STR(toplevel_has(toplevel, TOPLEVEL_ACTIVATED)));
+			if (support_fullscreen)
+				fprintf(f, "            \"fullscreen\": %s,\n", BOOL_TO_STR(toplevel_has(toplevel, TOPLEVEL_FULLSCREEN)));
+			if (support_minimized)
+				fprintf(f, "            \"minimized\": %s,\n", BOOL_TO_STR(toplevel_has(toplevel, TOPLEVEL_MINIMIZED)));
+			if (support_maximized)
+				fprintf(f, "            \"maximized\": %s,\n", BOOL_TO_STR(toplevel_has(toplevel, TOPLEVEL_MAXIMIZED)));
+			if (support_sticky)
+				fprintf(f, "            \"sticky\": %s,\n", BOOL_TO_STR(toplevel_has(toplevel, TOPLEVEL_STICKY)));
+			fprintf(f, "            \"created\": %" PRIu64 ",\n", toplevel->created_at.wall);
+			fprintf(f, "            \"changed\": %" PRIu64 ",\n", toplevel->changed_at.wall);
+			if ( support_activated && toplevel->activated_at.wall != 0 )
+				fprintf(f, "            \"last-activated\": %" PRIu64 ",\n", toplevel->activated_at.wall);
+			else if (support_activated)
+				fputs("            \"last-activated\": null,\n", f);
+			if (support_identifier)
+			{
+				fputs("            \"identifier\": ", f);
+				if (!write_cached(toplevel, RENDERED_IDENTIFIER, 0, f))
+					write_json(string_get(&toplevel->identifier), f);
+				fputs(",\n", f);
+			}
+
+			if (normalize)
+			{
+				fputs("            \"normalized-title\": ", f);
+				write_json(string_get(toplevel_normalized_title(toplevel)), f);
+				fputs(",\n            \"normalized-app-id\": ", f);
+				write_json(string_get(toplevel_normalized_app_id(toplevel)), f);
+				fputs(",\n", f);
+			}
+
+			/* Whoever designed JSON made the incredibly weird
+			 * mistake of enforcing that there is no comma on the
+			 * last item. Luckily, there are two fields we know
+			 * will always be printed. So by putting them last,
+			 * we can easiely implement that. :)
+			 */
+			fputs("            \"title\": ", f);
+			if (!write_cached(toplevel, RENDERED_TITLE, 0, f))
+				write_json(string_get(&toplevel->title), f);
+			fputs(",\n            \"app-id\": ", f);
+			if (!write_cached(toplevel, RENDERED_APP_ID, 0, f))
+				write_json(string_get(&toplevel->app_id), f);
+			fputs("\n        }", f);
+			break;
+
+		case CUSTOM:
+			assert(custom_output_format != NULL);
+			assert(strlen(custom_output_format) > 1);
+			bool need_delim = false;
+			char *fmt = custom_output_format + 1;
+			for (; *fmt != '\0'; fmt++)
+			{
+				if (need_delim)
+					fputc(custom_output_format[0], f);
+				else
+					need_delim = true;
+				out_write_custom_field(*fmt, toplevel, f);
+			}
+			fputs("\n", f);
+			break;
+
+		case TSV:
+		case NUL_SEPARATED:;
+			/* Same fields in both formats, but the NUL separated
+			 * one only replaces unit separators instead of escaping.
+			 */
+			const bool tsv = output_format == TSV;
+			const char delim = tsv ? '\t' : '\x1f';
+			void (*write_string)(const struct String *, FILE *restrict) = tsv ? write_tsv : write_nul_separated;
+			if ( !tsv || !write_cached(toplevel, RENDERED_TITLE, 0, f) )
+				write_string(&toplevel->title, f);
+			fputc(delim, f);
+			if ( !tsv || !write_cached(toplevel, RENDERED_APP_ID, 0, f) )
+				write_string(&toplevel->app_id, f);
+			fputc(delim, f);
+			write_custom_optional_bool(support_maximized, toplevel_has(toplevel, TOPLEVEL_MAXIMIZED), f);
+			fputc(delim, f);
+			write_custom_optional_bool(support_minimized, toplevel_has(toplevel, TOPLEVEL_MINIMIZED), f);
+			fputc(delim, f);
+			write_custom_optional_bool(support_activated, toplevel_has(toplevel, TOPLEVEL_ACTIVATED), f);
+			fputc(delim, f);
+			write_custom_optional_bool(support_fullscreen, toplevel_has(toplevel, TOPLEVEL_FULLSCREEN), f);
+			fputc(delim, f);
+			if (!support_identifier)
+				fputs("unsupported", f);
+			else if ( !tsv || !write_cached(toplevel, RENDERED_IDENTIFIER, 0, f) )
+				write_string(&toplevel->identifier, f);
+			fputc(delim, f);
+			write_custom_optional_bool(support_sticky, toplevel_has(toplevel, TOPLEVEL_STICKY), f);
+			fputc(tsv ? '\n' : '\0', f);
+			break;
+	}
+}
+
+/**
+ * Below this many toplevels, starting threads costs more than formatting the
+ * output serially.
+ */
+const size_t parallel_output_threshold = 4096;
+#define MAX_OUTPUT_THREADS 8
+
+struct Output_chunk
+{
+	pthread_t thread;
+	bool started;
+
+	/** All toplevels, of which this chunk formats len starting at start. */
+	struct Toplevel **toplevels;
+	size_t start;
+	size_t len;
+
+	char *buffer;
+	size_t buffer_len;
+	bool ok;
+};
+
+/** Format a chunk of toplevels into a memory buffer. Run in a worker thread. */
+static void *out_format_chunk (void *data)
+{
+	struct Output_chunk *chunk = (struct Output_chunk *)data;
+	FILE *f = open_memstream(&chunk->buffer, &chunk->buffer_len);
+	if ( f == NULL )
+		return NULL;
+	for (size_t i = chunk->start; i < chunk->start + chunk->len; i++)
+		out_write_toplevel(chunk->toplevels[i], i > 0 ? chunk->toplevels[i-1] : NULL, f);
+	chunk->ok = fclose(f) == 0;
+	return NULL;
+}
+
+/**
+ * Write the toplevels to stdout in the given order. Large lists are split
+ * into one contiguous chunk per worker thread, which are formatted in
+ * parallel and then written in order, so the output is identical to the
+ * serial path.
+ */
+static void out_write_toplevels (struct Toplevel **toplevels, size_t len)
+{
+	render_toplevels(toplevels, len);
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( threads > MAX_OUTPUT_THREADS )
+		threads = MAX_OUTPUT_THREADS;
+	if ( len < parallel_output_threshold || threads < 2 )
+	{
+		for (size_t i = 0; i < len; i++)
+			out_write_toplevel(toplevels[i], i > 0 ? toplevels[i-1] : NULL, stdout);
+		return;
+	}
+
+	struct Output_chunk chunks[MAX_OUTPUT_THREADS];
+	const size_t chunk_count = (size_t)threads;
+	const size_t chunk_len = (len + chunk_count - 1) / chunk_count;
+	memset(chunks, 0, sizeof(chunks));
+	for (size_t i = 0; i < chunk_count; i++)
+	{
+		const size_t start = i * chunk_len;
+		chunks[i].toplevels = toplevels;
+		chunks[i].start = start;
+		chunks[i].len = start >= len ? 0 : (len - start < chunk_len ? len - start : chunk_len);
+
+		/* The first chunk is formatted by this thread. */
+		if ( i == 0 )
+			continue;
+		const int err = pthread_create(&chunks[i].thread, NULL, out_format_chunk, &chunks[i]);
+		if ( err != 0 && debug_log )
+			fprintf(stderr, "[pthread_create(): %s]\n", strerror(err));
+		chunks[i].started = err == 0;
+	}
+
+	for (size_t i = 0; i < chunk_count; i++)
+	{
+		if (chunks[i].started)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			out_format_chunk(&chunks[i]);
+
+		if (chunks[i].ok)
+			fwrite(chunks[i].buffer, 1, chunks[i].buffer_len, stdout);
+		else
+		{
+			/* Could not buffer this chunk, so write it directly. */
+			for (size_t j = chunks[i].start; j < chunks[i].start + chunks[i].len; j++)
+				out_write_toplevel(toplevels[j], j > 0 ? toplevels[j-1] : NULL, stdout);
+		}
+		free(chunks[i].buffer);
+	}
+}
+
+static void out_start (void)
+{
+	switch (output_format)
+	{
+		case NORMAL:
+			fputs(support_sticky ? "    " : "   ", stdout);
+			write_padded(longest_app_id, "app-id:", stdout);
+			fputs("   ", stdout);
+			fputs("title:", stdout);
+			fputc('\n', stdout);
+			return;
+
+		case JSON:
+			fprintf(stdout,
+					"{\n"
+					"    \"supported-data\": {\n"
+					"        \"title\": true,\n"
+					"        \"app-id\": true,\n"
+					"        \"identifier\": %s,\n"
+					"        \"fullscreen\": %s,\n"
+					"        \"activated\": %s,\n"
+					"        \"minimized\": %s,\n"
+					"        \"maximized\": %s,\n"
+					"        \"sticky\": %s\n"
+					"    },\n"
+					"    \"toplevels\": [\n",
+					BOOL_TO_STR(support_identifier),
+					BOOL_TO_STR(support_fullscreen),
+					BOOL_TO_STR(support_activated),
+					BOOL_TO_STR(support_minimized),
+					BOOL_TO_STR(support_maximized),
+					BOOL_TO_STR(support_sticky));
+			break;
+
+		case CUSTOM:
+		case TSV:
+		case NUL_SEPARATED:
+			break;
+	}
+}
+
+static void out_finish (void)
+{
+	switch (output_format)
+	{
+		case NORMAL:
+			return;
+
+		case JSON:
+			fputs("\n    ]\n}\n", stdout);
+			break;
+
+		/* In WATCH mode, separate snapshots from each other. JSON
+		 * documents need no separator.
+		 */
+		case CUSTOM:
+		case TSV:
+			if ( mode == WATCH )
+				fputc('\n', stdout);
+			break;
+
+		case NUL_SEPARATED:
+			if ( mode == WATCH )
+				fputc('\0', stdout);
+			break;
+	}
+
+	if ( mode == WATCH )
+		fflush(stdout);
+}
+
+/*************************
+ *                       *
+ *    Event templates    *
+ *                       *
+ *************************/
+/* In WATCH mode, --on-created, --on-changed, --on-closed and --on-focus replace
+ * the event log with lines following a template. Templates are compiled once
+ * into a plan of literal text and fields, so emitting an event does not need to
+ * parse the template again.
+ */
+enum Emit_op_type
+{
+	EMIT_LITERAL,
+	EMIT_FIELD,
+};
+
+struct Emit_op
+{
+	enum Emit_op_type type;
+
+	/** For EMIT_FIELD, a custom format field or an event metadata letter. */
+	char field;
+
+	/** For EMIT_LITERAL, points into the template. */
+	const char *literal;
+	size_t len;
+};
+
+struct Emit_plan
+{
+	char *template;
+	struct Emit_op *ops;
+	size_t len;
+};
+
+/** Indexed by enum Toplevel_event. A plan without ops is not emitted. */
+struct Emit_plan emit_plans[4] = { 0 };
+
+static const char *event_name (enum Toplevel_event event)
+{
+	switch (event)
+	{
+		case EVENT_CREATED: return "created";
+		case EVENT_CHANGED: return "changed";
+		case EVENT_CLOSED:  return "closed";
+		case EVENT_FOCUS:   return "focus";
+	}
+	return NULL;
+}
+
+static bool emit_plan_append (struct Emit_plan *plan, struct Emit_op op)
+{
+	struct Emit_op *ops = realloc(plan->ops, (plan->len + 1) * sizeof(struct Emit_op));
+	if ( ops == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return false;
+	}
+	plan->ops = ops;
+	plan->ops[plan->len++] = op;
+	return true;
+}
+
+static void emit_plan_free (struct Emit_plan *plan)
+{
+	free(plan->template);
+	free(plan->ops);
+	*plan = (struct Emit_plan){ 0 };
+}
+
+/**
+ * Compile a template into the plan for the given event. Prints error messages
+ * accordingly.
+ *
+ * Templates consist of literal text and fields: %t, %a, %i, %A, %f, %m, %M
+ * and %s like in custom output formats, %I for the id of the toplevel, %e for
+ * the name of the event, %c for a comma separated list of what changed and %%
+ * for a literal percent sign. Focus templates also have %P for the id of the
+ * previously focused toplevel.
+ */
+static bool emit_plan_compile (enum Toplevel_event event, const char *template)
+{
+	struct Emit_plan *plan = &emit_plans[event];
+	emit_plan_free(plan);
+	plan->template = strdup(template);
+	if ( plan->template == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		return false;
+	}
+
+	const char *literal = plan->template;
+	for (const char *c = plan->template; *c != '\0'; c++)
+	{
+		if ( *c != '%' )
+			continue;
+
+		if ( c > literal && !emit_plan_append(plan, (struct Emit_op){
+					.type = EMIT_LITERAL, .literal = literal, .len = (size_t)(c - literal) }) )
+			return false;
+
+		c++;
+		if ( *c == '%' )
+		{
+			/* Start the next literal at the second percent sign. */
+			literal = c;
+			continue;
+		}
+		if ( *c != 'I' && *c != 'e' && *c != 'c' && !( *c == 'P' && event == EVENT_FOCUS )
+				&& !out_custom_field_valid(*c) )
+		{
+			if ( *c == '\0' )
+				fprintf(stderr, "ERROR: Invalid %s template: Trailing '%%'.\n", event_name(event));
+			else
+				fprintf(stderr, "ERROR: Invalid %s template: Unknown field name: '%c'.\n",
+						event_name(event), *c);
+			return false;
+		}
+		if (!emit_plan_append(plan, (struct Emit_op){ .type = EMIT_FIELD, .field = *c }))
+			return false;
+		literal = c + 1;
+	}
+	if ( *literal != '\0' && !emit_plan_append(plan, (struct Emit_op){
+				.type = EMIT_LITERAL, .literal = literal, .len = strlen(literal) }) )
+		return false;
+
+	/* An empty template still emits empty lines. */
+	if ( plan->ops == NULL && !emit_plan_append(plan, (struct Emit_op){
+				.type = EMIT_LITERAL, .literal = literal, .len = 0 }) )
+		return false;
+
+	event_templates = true;
+	return true;
+}
+
+static void write_changes (uint8_t changes, FILE *restrict f)
+{
+	const char *sep = "";
+	if ( changes & CHANGED_TITLE )
+	{
+		fputs("title", f);
+		sep = ",";
+	}
+	if ( changes & CHANGED_APP_ID )
+	{
+		fputs(sep, f);
+		fputs("app-id", f);
+		sep = ",";
+	}
+	if ( changes & ( CHANGED_STATE | CHANGED_ACTIVATED ) )
+	{
+		fputs(sep, f);
+		fputs("state", f);
+	}
+}
+
+static void record_event (struct Toplevel *toplevel, enum Toplevel_event event, uint64_t time);
+static void trace_event (uint64_t time, enum Toplevel_event event, size_t id, uint8_t flags,
+		const char *app_id, const char *title);
+static void history_count (struct Toplevel *toplevel, enum Toplevel_event event);
+static void transitions_focus (const struct Toplevel *toplevel);
+static void emit_event (struct Toplevel *toplevel, enum Toplevel_event event)
+{
+	if ( mode != WATCH )
+		return;
+	const uint64_t time = wall_clock_us();
+	record_event(toplevel, event, time);
+	trace_event(time, event, toplevel->id, toplevel->flags,
+			string_get(&toplevel->app_id), string_get(&toplevel->title));
+	history_count(toplevel, event);
+
+	const struct Emit_plan *plan = &emit_plans[event];
+	if ( plan->ops == NULL )
+		return;
+
+	for (size_t i = 0; i < plan->len; i++)
+	{
+		const struct Emit_op *op = &plan->ops[i];
+		if ( op->type == EMIT_LITERAL )
+		{
+			fwrite(op->literal, 1, op->len, stdout);
+			continue;
+		}
+		switch (op->field)
+		{
+			case 'I': fprintf(stdout, "%ld", toplevel->id);   break;
+			case 'e': fputs(event_name(event), stdout);         break;
+			case 'c': write_changes(toplevel->changes, stdout); break;
+			case 'P':
+				if (focus.has_previous)
+					fprintf(stdout, "%ld", focus.previous);
+				break;
+			default:  out_write_custom_field(op->field, toplevel, stdout); break;
+		}
+	}
+	fputc('\n', stdout);
+}
+
+/**
+ * Emit the changed event of a toplevel whose change of the activated state
+ * waited for focus_flush(), unless folded is set because that change is part of
+ * the focus event.
+ */
+static void focus_settle (struct Toplevel *toplevel, bool folded)
+{
+	if (!toplevel_has(toplevel, TOPLEVEL_FOCUS_PENDING))
+		return;
+	if (folded)
+	{
+		toplevel->changes = 0;
+		toplevel_set_flag(toplevel, TOPLEVEL_FOCUS_PENDING, false);
+	}
+	else
+		toplevel_emit_changes(toplevel);
+}
+
+/**
+ * Called in WATCH mode once all events of a dispatch batch are handled. If
+ * another toplevel has been activated in the batch, emit a single focus event
+ * carrying both the new and the previously focused toplevel, instead of
+ * leaving it to consumers to pair the activated and deactivated changes. Those
+ * two changes are folded into the focus event; all other changes of the
+ * activated state are emitted as changed events.
+ */
+static void focus_flush (void)
+{
+	struct Toplevel *previous = focus.known ? &toplevels[focus.index] : NULL;
+
+	/* The candidate may have lost the activated state or been closed again
+	 * within the same batch.
+	 */
+	struct Toplevel *candidate = NULL;
+	if ( focus_candidate != no_focus_candidate && focus_candidate < toplevels_len
+			&& toplevel_has(&toplevels[focus_candidate], TOPLEVEL_IN_USE) )
+		candidate = &toplevels[focus_candidate];
+	focus_candidate = no_focus_candidate;
+
+	if ( candidate != NULL && candidate != previous && toplevel_has(candidate, TOPLEVEL_LISTED)
+			&& toplevel_has(candidate, TOPLEVEL_ACTIVATED) )
+	{
+		focus.has_previous = focus.known;
+		focus.previous = focus.current;
+		focus.known = true;
+		focus.current = candidate->id;
+		focus.index = toplevel_index(candidate);
+
+		if (log_events())
+		{
+			if (focus.has_previous)
+				fprintf(stdout, "toplevel %ld: focused, previously toplevel %ld\n",
+						focus.current, focus.previous);
+			else
+				fprintf(stdout, "toplevel %ld: focused\n", focus.current);
+		}
+		emit_event(candidate, EVENT_FOCUS);
+		transitions_focus(candidate);
+
+		focus_settle(candidate, true);
+		if ( previous != NULL )
+			focus_settle(previous, true);
+		return;
+	}
+
+	if ( previous != NULL && !toplevel_has(previous, TOPLEVEL_ACTIVATED) )
+		focus.known = false;
+	if ( candidate != NULL )
+		focus_settle(candidate, false);
+	if ( previous != NULL && previous != candidate )
+		focus_settle(previous, false);
+}
+
+/*********************
+ *                   *
+ *    Change feed    *
+ *                   *
+ *********************/
+/* In WATCH mode, --feed keeps a bounded journal of sequenced change records
+ * and serves it on a unix socket. A consumer connects, sends the sequence
+ * number of the last record it has seen and receives the records it missed,
+ * followed by new ones as they happen. If the journal no longer reaches back
+ * that far, the consumer gets a full snapshot instead.
+ *
+ * Records are lines of tab separated values: sequence number, time in
+ * microseconds since the epoch, event, id, previous id (only set for focus
+ * events), state, app-id and title. Strings
+ * are escaped like in the TSV output format. A snapshot starts with a "reset"
+ * record, followed by a "present" record for every toplevel.
+ *
+ * Clients are never waited for. A client which does not read fast enough is
+ * served from the journal as its socket becomes writable and disconnected once
+ * it falls behind the oldest record, after which it can simply resume.
+ */
+#define FEED_MAX_CLIENTS 16
+#define FEED_MAX_RECORDS (1024 * 1024)
+
+struct Feed_record
+{
+	uint64_t seq;
+	char *line;
+	size_t len;
+};
+
+struct Feed_client
+{
+	/** -1 if this slot is unused. */
+	int fd;
+
+	/** Set once the resume request has been handled. */
+	bool streaming;
+
+	/** Received part of the resume request. */
+	char request[32];
+	size_t request_len;
+
+	/** Snapshot to send before continuing with the journal. */
+	char *snapshot;
+	size_t snapshot_len;
+
+	/** Sequence number of the next record to send. */
+	uint64_t cursor;
+
+	/** Bytes of the snapshot or current record which have already been sent. */
+	size_t offset;
+};
+
+const char *feed_path = NULL;
+int feed_socket = -1;
+struct Feed_client feed_clients[FEED_MAX_CLIENTS];
+
+/** Ring of the most recent records, indexed by sequence number. */
+struct Feed_record *journal = NULL;
+size_t journal_capacity = 4096;
+
+/** Sequence number of the next event record, shared with --ring. */
+uint64_t record_next_seq = 1;
+
+static uint64_t journal_oldest_seq (void)
+{
+	return record_next_seq > journal_capacity ? record_next_seq - journal_capacity : 1;
+}
+
+static void feed_write_record (uint64_t seq, uint64_t time, const char *event,
+		const struct Toplevel *toplevel, bool with_previous, FILE *restrict f)
+{
+	fprintf(f, "%" PRIu64 "\t%" PRIu64 "\t%s\t%ld\t", seq, time, event, toplevel->id);
+	if (with_previous)
+		fprintf(f, "%ld", focus.previous);
+	else
+		fputs("\\N", f);
+	fputc('\t', f);
+	fputc(toplevel_has(toplevel, TOPLEVEL_ACTIVATED)  ? 'A' : '-', f);
+	fputc(toplevel_has(toplevel, TOPLEVEL_FULLSCREEN) ? 'F' : '-', f);
+	fputc(toplevel_has(toplevel, TOPLEVEL_MAXIMIZED)  ? 'M' : '-', f);
+	fputc(toplevel_has(toplevel, TOPLEVEL_MINIMIZED)  ? 'm' : '-', f);
+	fputc(toplevel_has(toplevel, TOPLEVEL_STICKY)     ? 'S' : '-', f);
+	fputc('\t', f);
+	write_tsv(&toplevel->app_id, f);
+	fputc('\t', f);
+	write_tsv(&toplevel->title, f);
+	fputc('\n', f);
+}
+
+/** Write a reset record, followed by a present record for every toplevel. */
+static void write_records_snapshot (FILE *restrict f)
+{
+	const uint64_t seq = record_next_seq - 1;
+	const uint64_t time = wall_clock_us();
+	fprintf(f, "%" PRIu64 "\t%" PRIu64 "\treset\n", seq, time);
+	for (uint32_t i = 0; i < toplevels_len; i++)
+		if (toplevel_has(&toplevels[i], TOPLEVEL_LISTED))
+			feed_write_record(seq, time, "present", &toplevels[i], false, f);
+}
+
+static void feed_client_close (struct Feed_client *client)
+{
+	close(client->fd);
+	free(client->snapshot);
+	*client = (struct Feed_client){ .fd = -1 };
+}
+
+/**
+ * Send the rest of the buffer, starting at the offset of the client. Returns
+ * true if all of it has been sent.
+ */
+static bool feed_client_send (struct Feed_client *client, const char *buffer, size_t len)
+{
+	while ( client->offset < len )
+	{
+		const ssize_t n = send(client->fd, buffer + client->offset, len - client->offset,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+				feed_client_close(client);
+			return false;
+		}
+		client->offset += (size_t)n;
+	}
+	client->offset = 0;
+	return true;
+}
+
+/** Send as much of the snapshot and the pending records as the socket takes. */
+static void feed_client_flush (struct Feed_client *client)
+{
+	if ( client->snapshot != NULL )
+	{
+		if (!feed_client_send(client, client->snapshot, client->snapshot_len))
+			return;
+		free(client->snapshot);
+		client->snapshot = NULL;
+	}
+	while ( client->cursor < record_next_seq )
+	{
+		/* The client fell behind further than the journal reaches. */
+		if ( client->cursor < journal_oldest_seq() )
+		{
+			feed_client_close(client);
+			return;
+		}
+		const struct Feed_record *record = &journal[client->cursor % journal_capacity];
+		if ( record->seq != client->cursor )
+		{
+			feed_client_close(client);
+			return;
+		}
+		if (!feed_client_send(client, record->line, record->len))
+			return;
+		client->cursor++;
+	}
+}
+
+static bool feed_client_has_pending (const struct Feed_client *client)
+{
+	return client->streaming && ( client->snapshot != NULL || client->cursor < record_next_seq );
+}
+
+/** Handle the resume request of a client, containing the last seen sequence number. */
+static void feed_client_start (struct Feed_client *client, const char *request)
+{
+	char *end;
+	errno = 0;
+	const unsigned long long last = strtoull(request, &end, 10);
+	const bool valid = errno == 0 && end != request && *end == '\0';
+
+	client->streaming = true;
+	if ( valid && last < record_next_seq && last + 1 >= journal_oldest_seq() )
+	{
+		client->cursor = last + 1;
+		feed_client_flush(client);
+		return;
+	}
+
+	/* The gap has been evicted from the journal, or the client has never
+	 * seen a record, so start with a snapshot.
+	 */
+	client->cursor = record_next_seq;
+	FILE *f = open_memstream(&client->snapshot, &client->snapshot_len);
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: open_memstream(): %s\n", strerror(errno));
+		feed_client_close(client);
+		return;
+	}
+	write_records_snapshot(f);
+	if ( fclose(f) != 0 )
+	{
+		fprintf(stderr, "ERROR: fclose(): %s\n", strerror(errno));
+		feed_client_close(client);
+		return;
+	}
+	feed_client_flush(client);
+}
+
+static void feed_client_read (struct Feed_client *client)
+{
+	char buffer[sizeof(client->request)];
+	const ssize_t n = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if ( n < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+		return;
+	if ( n <= 0 )
+	{
+		feed_client_close(client);
+		return;
+	}
+
+	/* Once streaming, there is nothing more to say. */
+	if (client->streaming)
+		return;
+
+	for (ssize_t i = 0; i < n; i++)
+	{
+		if ( buffer[i] == '\n' )
+		{
+			client->request[client->request_len] = '\0';
+			feed_client_start(client, client->request);
+			return;
+		}
+		if ( client->request_len == sizeof(client->request) - 1 )
+		{
+			feed_client_close(client);
+			return;
+		}
+		client->request[client->request_len++] = buffer[i];
+	}
+}
+
+static void feed_accept (void)
+{
+	const int fd = accept(feed_socket, NULL, NULL);
+	if ( fd < 0 )
+		return;
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+	{
+		if ( feed_clients[i].fd < 0 )
+		{
+			feed_clients[i].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+/**
+ * Append a record to the journal, which takes ownership of the line, and
+ * broadcast it. Called from record_event().
+ */
+static void feed_append (uint64_t seq, char *line, size_t len)
+{
+	struct Feed_record *record = &journal[seq % journal_capacity];
+	free(record->line);
+	*record = (struct Feed_record){ .seq = seq, .line = line, .len = len };
+
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+		if ( feed_clients[i].fd >= 0 && feed_clients[i].streaming )
+			feed_client_flush(&feed_clients[i]);
+}
+
+/** Fill the pollfds of the listening socket and the clients. Unused ones are -1. */
+static void feed_prepare_poll (struct pollfd *fds)
+{
+	fds[0] = (struct pollfd){ .fd = feed_socket, .events = POLLIN };
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+	{
+		if ( feed_socket < 0 )
+		{
+			fds[i + 1] = (struct pollfd){ .fd = -1 };
+			continue;
+		}
+		const struct Feed_client *client = &feed_clients[i];
+		fds[i + 1] = (struct pollfd){
+			.fd = client->fd,
+			.events = (short)(POLLIN | ( feed_client_has_pending(client) ? POLLOUT : 0 )),
+		};
+	}
+}
+
+static void feed_handle_poll (const struct pollfd *fds)
+{
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+	{
+		struct Feed_client *client = &feed_clients[i];
+		const struct pollfd *fd = &fds[i + 1];
+		if ( fd->fd < 0 || fd->fd != client->fd || fd->revents == 0 )
+			continue;
+		if ( fd->revents & POLLOUT )
+			feed_client_flush(client);
+		if ( client->fd >= 0 && fd->revents & ( POLLIN | POLLHUP | POLLERR ) )
+			feed_client_read(client);
+	}
+
+	/* Accept last, new clients may get the file descriptor of a client closed above. */
+	if ( fds[0].fd >= 0 && fds[0].revents & POLLIN )
+		feed_accept();
+}
+
+/**
+ * Bind the feed socket, only accessible to the user. A socket left behind by a
+ * previous process which no longer accepts connections is replaced. Returns
+ * false with errno set on error.
+ */
+static bool feed_bind (int fd, const struct sockaddr_un *addr)
+{
+	const mode_t mask = umask(0077);
+	int ret = bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	if ( ret < 0 && errno == EADDRINUSE )
+	{
+		struct stat st;
+		const int probe = lstat(addr->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)
+			? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+		if ( probe >= 0 )
+		{
+			const bool stale = connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) < 0
+				&& errno == ECONNREFUSED;
+			close(probe);
+			if ( stale && unlink(addr->sun_path) == 0 )
+				ret = bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+			else
+				errno = EADDRINUSE;
+		}
+		else
+			errno = EADDRINUSE;
+	}
+	const int saved_errno = errno;
+	umask(mask);
+	errno = saved_errno;
+	return ret == 0;
+}
+
+/** Create the socket and the journal. Prints error messages accordingly. */
+static bool feed_init (void)
+{
+	for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+		feed_clients[i] = (struct Feed_client){ .fd = -1 };
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if ( strlen(feed_path) >= sizeof(addr.sun_path) )
+	{
+		fprintf(stderr, "ERROR: Feed socket path too long: %s\n", feed_path);
+		return false;
+	}
+	strcpy(addr.sun_path, feed_path);
+
+	journal = calloc(journal_capacity, sizeof(struct Feed_record));
+	if ( journal == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		return false;
+	}
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "ERROR: socket(): %s\n", strerror(errno));
+		return false;
+	}
+	if ( !feed_bind(fd, &addr) )
+	{
+		fprintf(stderr, "ERROR: Can not bind feed socket '%s': %s\n", feed_path, strerror(errno));
+		close(fd);
+		return false;
+	}
+	if ( listen(fd, FEED_MAX_CLIENTS) < 0 )
+	{
+		fprintf(stderr, "ERROR: listen(): %s\n", strerror(errno));
+		close(fd);
+		unlink(feed_path);
+		return false;
+	}
+	feed_socket = fd;
+	return true;
+}
+
+static void feed_finish (void)
+{
+	if ( feed_socket >= 0 )
+	{
+		for (size_t i = 0; i < FEED_MAX_CLIENTS; i++)
+			if ( feed_clients[i].fd >= 0 )
+				feed_client_close(&feed_clients[i]);
+		close(feed_socket);
+		unlink(feed_path);
+		feed_socket = -1;
+	}
+	if ( journal != NULL )
+	{
+		for (size_t i = 0; i < journal_capacity; i++)
+			free(journal[i].line);
+		free(journal);
+		journal = NULL;
+	}
+}
+
+/**
+ * A record of a --feed recording, see record_parse(). The strings point into
+ * the line and are still escaped.
+ */
+struct Record
+{
+	uint64_t time;
+
+	/** Set for resets, which have no other fields. */
+	bool reset;
+
+	/** Set for the present records of a snapshot, their event is EVENT_CHANGED. */
+	bool present;
+
+	enum Toplevel_event event;
+	uint64_t id;
+	bool has_previous;
+	uint64_t previous;
+	uint8_t flags;
+	const char *app_id;
+	size_t app_id_len;
+	const char *title;
+	size_t title_len;
+};
+
+enum Record_status
+{
+	RECORD_VALID,
+
+	/** A well-formed record of an event this version does not know. */
+	RECORD_UNKNOWN,
+
+	RECORD_MALFORMED,
+};
+
+/** Parse a decimal field of a record. Returns false if it is none. */
+static bool record_number (const char *str, size_t len, uint64_t *number)
+{
+	/* Up to 19 digits always fit. */
+	if ( len == 0 || len > 19 )
+		return false;
+	uint64_t value = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if ( str[i] < '0' || str[i] > '9' )
+			return false;
+		value = value * 10 + (uint64_t)( str[i] - '0' );
+	}
+	*number = value;
+	return true;
+}
+
+static bool record_field_is (const char *field, size_t len, const char *str)
+{
+	return len == strlen(str) && memcmp(field, str, len) == 0;
+}
+
+/**
+ * Parse a record of len bytes, without the newline, as written by
+ * feed_write_record(). A record is malformed unless it is a reset with a
+ * numeric time, or has all eight fields with numeric time and id and a numeric
+ * or unset previous id. All readers of recordings skip malformed records and
+ * count them.
+ */
+static enum Record_status record_parse (const char *line, size_t len, struct Record *record)
+{
+	/* seq, time, event, id, previous id, state, app-id, title */
+	const char *fields[8];
+	size_t lens[8];
+	size_t fields_len = 0;
+	const char *const end = line + len;
+	for (const char *field = line;;)
+	{
+		const char *tab = fields_len < 7 ? memchr(field, '\t', (size_t)(end - field)) : NULL;
+		fields[fields_len] = field;
+		lens[fields_len++] = (size_t)(( tab != NULL ? tab : end ) - field);
+		if ( tab == NULL )
+			break;
+		field = tab + 1;
+	}
+
+	*record = (struct Record){ 0 };
+	if ( fields_len < 3 || !record_number(fields[1], lens[1], &record->time) )
+		return RECORD_MALFORMED;
+	if ( record_field_is(fields[2], lens[2], "reset") )
+	{
+		record->reset = true;
+		return RECORD_VALID;
+	}
+	if ( fields_len != 8 || !record_number(fields[3], lens[3], &record->id) )
+		return RECORD_MALFORMED;
+	record->has_previous = !record_field_is(fields[4], lens[4], "\\N");
+	if ( record->has_previous && !record_number(fields[4], lens[4], &record->previous) )
+		return RECORD_MALFORMED;
+
+	if ( record_field_is(fields[2], lens[2], "created") )
+		record->event = EVENT_CREATED;
+	else if ( record_field_is(fields[2], lens[2], "changed") )
+		record->event = EVENT_CHANGED;
+	else if ( record_field_is(fields[2], lens[2], "present") )
+	{
+		record->event = EVENT_CHANGED;
+		record->present = true;
+	}
+	else if ( record_field_is(fields[2], lens[2], "closed") )
+		record->event = EVENT_CLOSED;
+	else if ( record_field_is(fields[2], lens[2], "focus") )
+		record->event = EVENT_FOCUS;
+	else
+		return RECORD_UNKNOWN;
+
+	for (size_t i = 0; i < lens[5]; i++)
+	{
+		switch (fields[5][i])
+		{
+			case 'A': record->flags = (uint8_t)(record->flags | TOPLEVEL_ACTIVATED);  break;
+			case 'F': record->flags = (uint8_t)(record->flags | TOPLEVEL_FULLSCREEN); break;
+			case 'M': record->flags = (uint8_t)(record->flags | TOPLEVEL_MAXIMIZED);  break;
+			case 'm': record->flags = (uint8_t)(record->flags | TOPLEVEL_MINIMIZED);  break;
+			case 'S': record->flags = (uint8_t)(record->flags | TOPLEVEL_STICKY);     break;
+		}
+	}
+	record->app_id = fields[6];
+	record->app_id_len = lens[6];
+	record->title = fields[7];
+	record->title_len = lens[7];
+	return RECORD_VALID;
+}
+
+/**************
+ *            *
+ *    Ring    *
+ *            *
+ **************/
+/* --ring publishes the event records into a ring buffer in shared memory, so
+ * any number of local processes can follow them with a single copy instead of
+ * one write per consumer. The layout and a reader library are in lswt-ring.h
+ * and lswt-ring.c. The producer never waits for readers, readers detect
+ * themselves whether they have been overtaken.
+ */
+const char *ring_name = NULL;
+size_t ring_capacity = 1024 * 1024;
+struct lswt_ring_header *ring = NULL;
+unsigned char *ring_data = NULL;
+unsigned char *ring_snapshot = NULL;
+size_t ring_size = 0;
+
+/** Set when a record has been published since the last snapshot. */
+bool ring_snapshot_outdated = false;
+
+/** Copy bytes to a ring position, wrapping around the end. */
+static void ring_copy_in (uint64_t position, const void *src, size_t len)
+{
+	const size_t offset = (size_t)(position % ring_capacity);
+	const size_t first = len < ring_capacity - offset ? len : ring_capacity - offset;
+	memcpy(ring_data + offset, src, first);
+	memcpy(ring_data, (const unsigned char *)src + first, len - first);
+}
+
+static void ring_publish (const char *line, size_t len)
+{
+	if ( ring == NULL )
+		return;
+	if ( len > ring_capacity - sizeof(uint32_t) )
+	{
+		fputs("ERROR: Record does not fit into the ring, skipping it.\n", stderr);
+		return;
+	}
+
+	/* Only lswt writes, so the positions need no read-modify-write. Announce
+	 * the bytes about to be overwritten before touching them, see
+	 * lswt_ring_read().
+	 */
+	const uint64_t position = atomic_load_explicit(&ring->published, memory_order_relaxed);
+	const uint64_t end = position + sizeof(uint32_t) + len;
+	atomic_store_explicit(&ring->reserved, end, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	const uint32_t record_len = (uint32_t)len;
+	ring_copy_in(position, &record_len, sizeof(record_len));
+	ring_copy_in(position + sizeof(record_len), line, len);
+
+	atomic_store_explicit(&ring->published, end, memory_order_release);
+	atomic_fetch_add_explicit(&ring->notify, 1, memory_order_seq_cst);
+#ifdef __linux__
+	if ( atomic_load_explicit(&ring->waiters, memory_order_seq_cst) > 0 )
+		syscall(SYS_futex, &ring->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+	ring_snapshot_outdated = true;
+}
+
+/**
+ * Update the snapshot area. Called once all events of a dispatch batch are
+ * handled, so readers recovering from an overrun see a consistent state.
+ */
+static void ring_update_snapshot (void)
+{
+	if ( ring == NULL || !ring_snapshot_outdated )
+		return;
+	ring_snapshot_outdated = false;
+
+	char *snapshot = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&snapshot, &len);
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: open_memstream(): %s\n", strerror(errno));
+		return;
+	}
+	write_records_snapshot(f);
+	if ( fclose(f) != 0 )
+	{
+		fprintf(stderr, "ERROR: fclose(): %s\n", strerror(errno));
+		free(snapshot);
+		return;
+	}
+
+	/* Seqlock: Readers retry if the sequence was odd or changed. */
+	const uint64_t seq = atomic_load_explicit(&ring->snapshot_seq, memory_order_relaxed);
+	atomic_store_explicit(&ring->snapshot_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	if ( len <= ring_capacity )
+	{
+		memcpy(ring_snapshot, snapshot, len);
+		atomic_store_explicit(&ring->snapshot_len, len, memory_order_relaxed);
+	}
+	else
+		atomic_store_explicit(&ring->snapshot_len, UINT64_MAX, memory_order_relaxed);
+	atomic_store_explicit(&ring->snapshot_position,
+			atomic_load_explicit(&ring->published, memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(&ring->snapshot_seq, seq + 2, memory_order_release);
+	free(snapshot);
+}
+
+/** Create the shared memory object. Prints error messages accordingly. */
+static bool ring_init (void)
+{
+	const size_t header_size = ( sizeof(struct lswt_ring_header) + 63 ) & ~(size_t)63;
+	if ( ring_capacity < 1024 || ring_capacity > UINT32_MAX )
+	{
+		fputs("ERROR: The ring size must be between 1K and 4G.\n", stderr);
+		return false;
+	}
+
+	const int fd = shm_open(ring_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "ERROR: Can not create ring '%s': %s\n", ring_name, strerror(errno));
+		return false;
+	}
+	ring_size = header_size + 2 * ring_capacity;
+	if ( ftruncate(fd, (off_t)ring_size) < 0 )
+	{
+		fprintf(stderr, "ERROR: ftruncate(): %s\n", strerror(errno));
+		close(fd);
+		shm_unlink(ring_name);
+		return false;
+	}
+	void *map = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED )
+	{
+		fprintf(stderr, "ERROR: mmap(): %s\n", strerror(errno));
+		shm_unlink(ring_name);
+		return false;
+	}
+
+	/* The object is zero filled. The magic goes last, readers check it. */
+	ring = map;
+	ring_data = (unsigned char *)map + header_size;
+	ring_snapshot = ring_data + ring_capacity;
+	ring->version = LSWT_RING_VERSION;
+	ring->header_size = (uint32_t)header_size;
+	ring->capacity = ring_capacity;
+	atomic_thread_fence(memory_order_release);
+	ring->magic = LSWT_RING_MAGIC;
+	return true;
+}
+
+static void ring_finish (void)
+{
+	if ( ring == NULL )
+		return;
+	munmap(ring, ring_size);
+	shm_unlink(ring_name);
+	ring = NULL;
+}
+
+/**
+ * Format the record of an event once and hand it to the --feed journal and
+ * the --ring. Called from emit_event().
+ */
+static void record_event (struct Toplevel *toplevel, enum Toplevel_event event, uint64_t time)
+{
+	if ( feed_socket < 0 && ring == NULL )
+		return;
+
+	char *line = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&line, &len);
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: open_memstream(): %s\n", strerror(errno));
+		return;
+	}
+	feed_write_record(record_next_seq, time, event_name(event), toplevel,
+			event == EVENT_FOCUS && focus.has_previous, f);
+	if ( fclose(f) != 0 )
+	{
+		fprintf(stderr, "ERROR: fclose(): %s\n", strerror(errno));
+		free(line);
+		return;
+	}
+
+	/* Advance first, so a client still waiting for the record whose journal
+	 * slot is reused is closed, and caught up clients get the new one.
+	 */
+	const uint64_t seq = record_next_seq++;
+	ring_publish(line, len);
+	if ( feed_socket >= 0 )
+		feed_append(seq, line, len);
+	else
+		free(line);
+}
+
+/***************
+ *             *
+ *    Trace    *
+ *             *
+ ***************/
+/* --trace turns toplevel events into the Chrome trace event format, which can
+ * be loaded into Perfetto or chrome://tracing. Every app-id is a process and
+ * every toplevel a thread in it. The activated, fullscreen and minimized
+ * states become duration events, creating, closing and changing the title of
+ * a toplevel instant events.
+ *
+ * Events are written as they happen, either from WATCH mode or from a feed
+ * recording given with --replay. A span is only written once it ends, so per
+ * toplevel just the start times of its open spans are kept, and only as long
+ * as the toplevel is open.
+ */
+struct Trace_track
+{
+	size_t id;
+	uint32_t pid;
+	uint8_t flags;
+	uint64_t title_hash;
+
+	/**
+	 * Set by a reset in a --replay recording, until a record following it
+	 * shows the toplevel is still open.
+	 */
+	bool stale;
+
+	/** Start times of the open spans, indexed like trace_spans. */
+	uint64_t span_start[3];
+};
+
+static const struct
+{
+	enum Toplevel_flags flag;
+	const char *name;
+} trace_spans[] = {
+	{ TOPLEVEL_ACTIVATED,  "activated"  },
+	{ TOPLEVEL_FULLSCREEN, "fullscreen" },
+	{ TOPLEVEL_MINIMIZED,  "minimized"  },
+};
+
+const char *replay_path = NULL;
+
+/** Set once the opening bracket has been written. */
+bool trace_started = false;
+bool trace_first_event = true;
+uint64_t trace_last_time = 0;
+
+/* Open toplevels. There are rarely more than a few dozen, so they are simply
+ * searched linearly.
+ */
+struct Trace_track *trace_tracks = NULL;
+size_t trace_tracks_len = 0;
+size_t trace_tracks_capacity = 0;
+
+/**
+ * App-ids with open toplevels. An app-id is dropped with its last toplevel
+ * and gets a new pid if it comes back, as the name of a pid applies to the
+ * whole trace.
+ */
+struct Trace_app
+{
+	char *app_id;
+	uint32_t pid;
+	size_t tracks;
+};
+struct Trace_app *trace_apps = NULL;
+uint32_t trace_apps_len = 0;
+uint32_t trace_next_pid = 0;
+
+/** Start a trace event object, leaving it open for more fields. */
+static void trace_begin_event (const char *name, const char *phase, uint64_t time,
+		uint32_t pid, size_t id)
+{
+	fputs(trace_first_event ? "" : ",\n", stdout);
+	trace_first_event = false;
+	fprintf(stdout, "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%" PRIu64 ",\"pid\":%" PRIu32 ",\"tid\":%ld",
+			name, phase, time, pid, id);
+}
+
+static void trace_write_name (const char *kind, uint32_t pid, size_t id, const char *name)
+{
+	trace_begin_event(kind, "M", trace_last_time, pid, id);
+	fputs(",\"args\":{\"name\":", stdout);
+	write_json(name, stdout);
+	fputs("}}", stdout);
+}
+
+/**
+ * Returns the pid of the app-id for a new toplevel of it, or UINT32_MAX on
+ * error.
+ */
+static uint32_t trace_app_open (const char *app_id)
+{
+	if ( app_id == NULL )
+		app_id = "";
+	for (uint32_t i = 0; i < trace_apps_len; i++)
+	{
+		if ( strcmp(trace_apps[i].app_id, app_id) == 0 )
+		{
+			trace_apps[i].tracks++;
+			return trace_apps[i].pid;
+		}
+	}
+
+	struct Trace_app *apps = realloc(trace_apps, (trace_apps_len + 1) * sizeof(struct Trace_app));
+	if ( apps == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return UINT32_MAX;
+	}
+	trace_apps = apps;
+	struct Trace_app *app = &trace_apps[trace_apps_len];
+	*app = (struct Trace_app){ .app_id = strdup(app_id), .pid = trace_next_pid, .tracks = 1 };
+	if ( app->app_id == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		return UINT32_MAX;
+	}
+	trace_write_name("process_name", app->pid, 0, app_id);
+	trace_apps_len++;
+	return trace_next_pid++;
+}
+
+/** Drop the app-id of the pid once its last toplevel is closed. */
+static void trace_app_close (uint32_t pid)
+{
+	for (uint32_t i = 0; i < trace_apps_len; i++)
+	{
+		if ( trace_apps[i].pid != pid )
+			continue;
+		if ( --trace_apps[i].tracks == 0 )
+		{
+			free(trace_apps[i].app_id);
+			trace_apps[i] = trace_apps[--trace_apps_len];
+		}
+		return;
+	}
+}
+
+static struct Trace_track *trace_track_get (size_t id)
+{
+	for (size_t i = 0; i < trace_tracks_len; i++)
+		if ( trace_tracks[i].id == id )
+			return &trace_tracks[i];
+	return NULL;
+}
+
+static struct Trace_track *trace_track_new (size_t id, const char *app_id, const char *title)
+{
+	if ( trace_tracks_len == trace_tracks_capacity )
+	{
+		const size_t capacity = trace_tracks_capacity == 0 ? 16 : trace_tracks_capacity * 2;
+		struct Trace_track *tracks = realloc(trace_tracks, capacity * sizeof(struct Trace_track));
+		if ( tracks == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+			return NULL;
+		}
+		trace_tracks = tracks;
+		trace_tracks_capacity = capacity;
+	}
+	const uint32_t pid = trace_app_open(app_id);
+	if ( pid == UINT32_MAX )
+		return NULL;
+	struct Trace_track *track = &trace_tracks[trace_tracks_len++];
+	*track = (struct Trace_track){ .id = id, .pid = pid, .title_hash = hash_string(title) };
+	trace_write_name("thread_name", pid, id, title);
+	return track;
+}
+
+static void trace_instant (const char *name, uint64_t time, const struct Trace_track *track,
+		const char *title)
+{
+	trace_begin_event(name, "i", time, track->pid, track->id);
+	fputs(",\"s\":\"t\",\"args\":{\"title\":", stdout);
+	write_json(title, stdout);
+	fputs("}}", stdout);
+}
+
+/** Open and close spans according to the new state flags. */
+static void trace_update_spans (struct Trace_track *track, uint8_t flags, uint64_t time)
+{
+	for (size_t i = 0; i < sizeof(trace_spans) / sizeof(trace_spans[0]); i++)
+	{
+		const bool was = ( track->flags & trace_spans[i].flag ) != 0;
+		const bool is = ( flags & trace_spans[i].flag ) != 0;
+		if ( !was && is )
+			track->span_start[i] = time;
+		else if ( was && !is )
+		{
+			const uint64_t start = track->span_start[i];
+			trace_begin_event(trace_spans[i].name, "X", start, track->pid, track->id);
+			fprintf(stdout, ",\"dur\":%" PRIu64 "}", time > start ? time - start : 0);
+		}
+	}
+	track->flags = flags;
+}
+
+/**
+ * Handle a toplevel event at the given wall clock time in microseconds. Only
+ * the state flags of flags are used.
+ */
+static void trace_event (uint64_t time, enum Toplevel_event event, size_t id, uint8_t flags,
+		const char *app_id, const char *title)
+{
+	if (!trace_started)
+		return;
+	if ( time > trace_last_time )
+		trace_last_time = time;
+
+	struct Trace_track *track = trace_track_get(id);
+	if ( track == NULL )
+	{
+		if ( event == EVENT_CLOSED )
+			return;
+		track = trace_track_new(id, app_id, title);
+		if ( track == NULL )
+			return;
+		trace_instant("created", time, track, title);
+	}
+	track->stale = false;
+
+	switch (event)
+	{
+		case EVENT_CREATED:
+		case EVENT_CHANGED:
+		{
+			const uint64_t title_hash = hash_string(title);
+			if ( title_hash != track->title_hash )
+			{
+				track->title_hash = title_hash;
+				trace_instant("title", time, track, title);
+			}
+			trace_update_spans(track, flags, time);
+			break;
+		}
+
+		case EVENT_CLOSED:
+			trace_update_spans(track, 0, time);
+			trace_instant("closed", time, track, title);
+			trace_app_close(track->pid);
+			*track = trace_tracks[--trace_tracks_len];
+			break;
+
+		case EVENT_FOCUS:
+		{
+			/* The focus event carries the activation of the toplevel and
+			 * the deactivation of the previously focused one.
+			 */
+			trace_update_spans(track, flags, time);
+			struct Trace_track *previous = focus.has_previous ? trace_track_get(focus.previous) : NULL;
+			if ( previous != NULL && previous != track )
+				trace_update_spans(previous, (uint8_t)(previous->flags & ~TOPLEVEL_ACTIVATED), time);
+			break;
+		}
+	}
+	fflush(stdout);
+}
+
+static void trace_start (void)
+{
+	fputs("[\n", stdout);
+	trace_started = true;
+}
+
+/** End all open spans and the trace. */
+static void trace_finish (void)
+{
+	if (!trace_started)
+		return;
+	if ( replay_path == NULL )
+		trace_last_time = wall_clock_us();
+	for (size_t i = 0; i < trace_tracks_len; i++)
+		trace_update_spans(&trace_tracks[i], 0, trace_last_time);
+	fputs("\n]\n", stdout);
+	fflush(stdout);
+	trace_started = false;
+
+	free(trace_tracks);
+	trace_tracks = NULL;
+	trace_tracks_len = 0;
+	trace_tracks_capacity = 0;
+	for (uint32_t i = 0; i < trace_apps_len; i++)
+		free(trace_apps[i].app_id);
+	free(trace_apps);
+	trace_apps = NULL;
+	trace_apps_len = 0;
+	trace_next_pid = 0;
+}
+
+/** Undo the escaping of write_tsv() in place. Returns NULL for unset strings. */
+static char *unescape_tsv (char *str)
+{
+	if ( strcmp(str, "\\N") == 0 )
+		return NULL;
+	char *out = str;
+	for (const char *in = str; *in != '\0'; in++)
+	{
+		if ( *in == '\\' && in[1] != '\0' )
+		{
+			in++;
+			switch (*in)
+			{
+				case 't': *out++ = '\t'; break;
+				case 'n': *out++ = '\n'; break;
+				case 'r': *out++ = '\r'; break;
+				default:  *out++ = *in;  break;
+			}
+		}
+		else
+			*out++ = *in;
+	}
+	*out = '\0';
+	return str;
+}
+
+/**
+ * A reset in a --feed recording is followed by present records for all open
+ * toplevels. Close all others at the time of the reset once those have been
+ * read. Their last title is not known, so the closed events carry none.
+ */
+static void trace_close_stale (uint64_t time)
+{
+	for (size_t i = 0; i < trace_tracks_len;)
+	{
+		/* Closing the track moves the last one into its place. */
+		if (trace_tracks[i].stale)
+			trace_event(time, EVENT_CLOSED, trace_tracks[i].id, 0, NULL, NULL);
+		else
+			i++;
+	}
+}
+
+/**
+ * Feed the records of a --feed recording to trace_event(). Malformed records
+ * are skipped. Prints error messages accordingly.
+ */
+static bool trace_replay (const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: Can not open recording '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t malformed = 0;
+
+	/* Set from a reset until the first record which is not a present one. */
+	bool snapshot = false;
+	uint64_t reset_time = 0;
+
+	ssize_t n;
+	while ( (n = getline(&line, &line_size, f)) > 0 )
+	{
+		if ( line[n-1] == '\n' )
+			line[--n] = '\0';
+		if ( n == 0 )
+			continue;
+
+		struct Record record;
+		const enum Record_status status = record_parse(line, (size_t)n, &record);
+		if ( status == RECORD_MALFORMED )
+			malformed++;
+		if ( status != RECORD_VALID )
+			continue;
+
+		if (record.reset)
+		{
+			for (size_t i = 0; i < trace_tracks_len; i++)
+				trace_tracks[i].stale = true;
+			snapshot = true;
+			reset_time = record.time;
+			continue;
+		}
+		if ( snapshot && !record.present )
+		{
+			trace_close_stale(reset_time);
+			snapshot = false;
+		}
+		if ( record.event == EVENT_FOCUS )
+		{
+			focus.has_previous = record.has_previous;
+			focus.previous = (size_t)record.previous;
+		}
+
+		/* The app-id is followed by a tab, the title ends the line. */
+		char *app_id = line + ( record.app_id - line );
+		app_id[record.app_id_len] = '\0';
+		char *title = line + ( record.title - line );
+		trace_event(record.time, record.event, (size_t)record.id, record.flags,
+				unescape_tsv(app_id), unescape_tsv(title));
+	}
+	if ( ok && ferror(f) )
+	{
+		fprintf(stderr, "ERROR: Can not read recording '%s': %s\n", path, strerror(errno));
+		ok = false;
+	}
+	if (snapshot)
+		trace_close_stale(reset_time);
+	if ( malformed > 0 )
+		fprintf(stderr, "Skipped %zu malformed records of '%s'.\n", malformed, path);
+	free(line);
+	if ( f != stdin )
+		fclose(f);
+	return ok;
+}
+
+/*****************
+ *               *
+ *    History    *
+ *               *
+ *****************/
+/* --history keeps long-term trends of the number of open toplevels, in total
+ * and per app-id, in a round-robin database: a file of fixed size, mapped into
+ * memory. Every 10 seconds, WATCH mode adds a sample to each tier. A tier is a
+ * ring of rows, each consolidating all samples of its step into their average,
+ * so updates are O(1) and the file never grows.
+ *
+ * The first HISTORY_APPS app-ids get their own column, which is remembered in
+ * the file. All others are counted in a shared column.
+ */
+#define HISTORY_MAGIC "LSWTRRD1"
+#define HISTORY_SAMPLE_STEP 10
+#define HISTORY_APPS 32
+#define HISTORY_APP_ID_SIZE 64
+#define HISTORY_TIERS 3
+
+/* Column 0 holds the total, 1 to HISTORY_APPS the app-ids, the last one all
+ * other app-ids.
+ */
+#define HISTORY_COLUMNS (HISTORY_APPS + 2)
+#define HISTORY_OTHER (HISTORY_APPS + 1)
+
+struct History_row
+{
+	/** Time of the row divided by the step of the tier. */
+	uint64_t slot;
+	uint32_t samples;
+	float values[HISTORY_COLUMNS];
+};
+
+struct History_tier
+{
+	uint32_t step;
+	uint32_t rows;
+};
+
+/* 10 seconds for an hour, minutes for two days and hours for a year. */
+static const struct History_tier history_tiers[HISTORY_TIERS] = {
+	{ HISTORY_SAMPLE_STEP, 360  },
+	{ 60,                  2880 },
+	{ 3600,                8760 },
+};
+
+struct History_file
+{
+	char magic[8];
+	uint32_t columns;
+	struct History_tier tiers[HISTORY_TIERS];
+	char apps[HISTORY_APPS][HISTORY_APP_ID_SIZE];
+
+	/* Followed by the rows of every tier. */
+	struct History_row rows[];
+};
+
+const char *history_path = NULL;
+const char *history_query = NULL;
+struct History_file *history = NULL;
+size_t history_size = 0;
+
+/** Current number of open toplevels per column, maintained by history_count(). */
+uint32_t history_counts[HISTORY_COLUMNS] = { 0 };
+uint64_t history_next_sample = 0;
+
+static size_t history_file_size (void)
+{
+	size_t rows = 0;
+	for (size_t i = 0; i < HISTORY_TIERS; i++)
+		rows += history_tiers[i].rows;
+	return sizeof(struct History_file) + rows * sizeof(struct History_row);
+}
+
+static struct History_row *history_tier_rows (size_t tier)
+{
+	struct History_row *rows = history->rows;
+	for (size_t i = 0; i < tier; i++)
+		rows += history_tiers[i].rows;
+	return rows;
+}
+
+/**
+ * Map the history file, creating it if it does not exist. Prints error messages
+ * accordingly.
+ */
+static bool history_open (bool create)
+{
+	const int fd = open(history_path, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "ERROR: Can not open history '%s': %s\n", history_path, strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	if ( fstat(fd, &st) < 0 )
+	{
+		fprintf(stderr, "ERROR: fstat(): %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	const size_t size = history_file_size();
+	const bool new = create && st.st_size == 0;
+	if ( new && ftruncate(fd, (off_t)size) < 0 )
+	{
+		fprintf(stderr, "ERROR: ftruncate(): %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	else if ( !new && (size_t)st.st_size != size )
+	{
+		fprintf(stderr, "ERROR: '%s' is not a history file of this version of lswt.\n", history_path);
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED )
+	{
+		fprintf(stderr, "ERROR: mmap(): %s\n", strerror(errno));
+		return false;
+	}
+	history = map;
+	history_size = size;
+
+	/* The file has been zero filled, so all rows are empty. */
+	if (new)
+	{
+		memcpy(history->magic, HISTORY_MAGIC, sizeof(history->magic));
+		history->columns = HISTORY_COLUMNS;
+		memcpy(history->tiers, history_tiers, sizeof(history_tiers));
+	}
+	else if ( memcmp(history->magic, HISTORY_MAGIC, sizeof(history->magic)) != 0
+			|| history->columns != HISTORY_COLUMNS
+			|| memcmp(history->tiers, history_tiers, sizeof(history_tiers)) != 0 )
+	{
+		fprintf(stderr, "ERROR: '%s' is not a history file of this version of lswt.\n", history_path);
+		munmap(history, history_size);
+		history = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void history_close (void)
+{
+	if ( history == NULL )
+		return;
+	msync(history, history_size, MS_SYNC);
+	munmap(history, history_size);
+	history = NULL;
+}
+
+/** Returns the column of the app-id, assigning a free one if possible. */
+static uint8_t history_column (const char *app_id)
+{
+	if ( app_id == NULL || strlen(app_id) >= HISTORY_APP_ID_SIZE )
+		return HISTORY_OTHER;
+	for (size_t i = 0; i < HISTORY_APPS; i++)
+	{
+		if ( history->apps[i][0] == '\0' )
+		{
+			strcpy(history->apps[i], app_id);
+			return (uint8_t)(i + 1);
+		}
+		if ( strcmp(history->apps[i], app_id) == 0 )
+			return (uint8_t)(i + 1);
+	}
+	return HISTORY_OTHER;
+}
+
+/** Keep the counts up to date. Called from emit_event(). */
+static void history_count (struct Toplevel *toplevel, enum Toplevel_event event)
+{
+	if ( history == NULL )
+		return;
+
+	const bool counted = toplevel->history_column != 0;
+	const bool count = event != EVENT_CLOSED;
+	if ( counted && ( !count || toplevel->changes & CHANGED_APP_ID ) )
+	{
+		history_counts[0]--;
+		history_counts[toplevel->history_column]--;
+		toplevel->history_column = 0;
+	}
+	if ( count && toplevel->history_column == 0 )
+	{
+		toplevel->history_column = history_column(string_get(&toplevel->app_id));
+		history_counts[0]++;
+		history_counts[toplevel->history_column]++;
+	}
+}
+
+/** Add the current counts as sample to the row of every tier. */
+static void history_sample (uint64_t now)
+{
+	for (size_t i = 0; i < HISTORY_TIERS; i++)
+	{
+		const uint64_t slot = now / history_tiers[i].step;
+		struct History_row *row = &history_tier_rows(i)[slot % history_tiers[i].rows];
+		if ( row->slot != slot )
+			*row = (struct History_row){ .slot = slot };
+		row->samples++;
+		for (size_t c = 0; c < HISTORY_COLUMNS; c++)
+			row->values[c] += ( (float)history_counts[c] - row->values[c] ) / (float)row->samples;
+	}
+}
+
+/** Returns the poll() timeout until the next sample is due. */
+static int history_timeout (void)
+{
+	if ( history == NULL || !toplevels_known )
+		return -1;
+	const uint64_t now = wall_clock_us() / 1000;
+	const uint64_t next = history_next_sample * 1000;
+	return next > now ? (int)(next - now) : 0;
+}
+
+/** Called by the main loop of WATCH mode after every wake up. */
+static void history_tick (void)
+{
+	if ( history == NULL || !toplevels_known )
+		return;
+	const uint64_t now = wall_clock_us() / 1000000;
+	if ( now < history_next_sample )
+		return;
+	history_sample(now);
+	history_next_sample = ( now / HISTORY_SAMPLE_STEP + 1 ) * HISTORY_SAMPLE_STEP;
+}
+
+/**
+ * Parse an amount of seconds, optionally with an s, m, h or d suffix. Returns
+ * false if it is invalid or does not fit.
+ */
+static bool parse_duration (const char *str, uint64_t *seconds)
+{
+	if (!isdigit((unsigned char)*str))
+		return false;
+	char *end;
+	errno = 0;
+	const unsigned long long value = strtoull(str, &end, 10);
+	if ( errno == ERANGE )
+		return false;
+	uint64_t multiplier = 1;
+	switch (*end)
+	{
+		case '\0':                        break;
+		case 's':                         end++; break;
+		case 'm': multiplier = 60;        end++; break;
+		case 'h': multiplier = 3600;      end++; break;
+		case 'd': multiplier = 86400;     end++; break;
+		default:                          return false;
+	}
+	if ( *end != '\0' || value > UINT64_MAX / multiplier )
+		return false;
+	*seconds = (uint64_t)value * multiplier;
+	return true;
+}
+
+/**
+ * Parse a point in time: Seconds since the epoch, or if prefixed by '-' the
+ * amount of time before now, optionally with an s, m, h or d suffix.
+ */
+static bool parse_time (const char *str, uint64_t now, uint64_t *time)
+{
+	if ( *str == '-' )
+	{
+		uint64_t value;
+		if (!parse_duration(str + 1, &value))
+			return false;
+		*time = value < now ? now - value : 0;
+		return true;
+	}
+	if (!isdigit((unsigned char)*str))
+		return false;
+	char *end;
+	errno = 0;
+	*time = strtoull(str, &end, 10);
+	return errno != ERANGE && *end == '\0';
+}
+
+/**
+ * Print the history in the range given as "from[,to]" as tab separated values,
+ * from the finest tier still reaching back to the start. Prints error messages
+ * accordingly.
+ */
+static bool history_print (const char *range)
+{
+	const uint64_t now = wall_clock_us() / 1000000;
+	uint64_t from, to = now;
+	char *from_str = strdup(range);
+	if ( from_str == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		return false;
+	}
+	char *to_str = strchr(from_str, ',');
+	if ( to_str != NULL )
+		*to_str++ = '\0';
+	const bool valid = parse_time(from_str, now, &from)
+		&& ( to_str == NULL || parse_time(to_str, now, &to) ) && from <= to;
+	free(from_str);
+	if (!valid)
+	{
+		fprintf(stderr, "ERROR: Invalid time range: %s\n", range);
+		return false;
+	}
+
+	size_t tier = HISTORY_TIERS - 1;
+	for (size_t i = 0; i < HISTORY_TIERS; i++)
+	{
+		const uint64_t retention = (uint64_t)history_tiers[i].step * history_tiers[i].rows;
+		if ( now < retention || from >= now - retention )
+		{
+			tier = i;
+			break;
+		}
+	}
+
+	fputs("time\ttotal", stdout);
+	for (size_t i = 0; i < HISTORY_APPS && history->apps[i][0] != '\0'; i++)
+		fprintf(stdout, "\t%s", history->apps[i]);
+	fputs("\tother\n", stdout);
+
+	const struct History_tier *t = &history_tiers[tier];
+	const struct History_row *rows = history_tier_rows(tier);
+	for (uint64_t slot = from / t->step; slot <= to / t->step; slot++)
+	{
+		const struct History_row *row = &rows[slot % t->rows];
+		if ( row->slot != slot || row->samples == 0 )
+			continue;
+		fprintf(stdout, "%" PRIu64 "\t%.2f", slot * t->step, (double)row->values[0]);
+		for (size_t i = 0; i < HISTORY_APPS && history->apps[i][0] != '\0'; i++)
+			fprintf(stdout, "\t%.2f", (double)row->values[i + 1]);
+		fprintf(stdout, "\t%.2f\n", (double)row->values[HISTORY_OTHER]);
+	}
+	return true;
+}
+
+/**************
+ *            *
+ *    Ping    *
+ *            *
+ **************/
+/* --ping measures the round-trip time of wl_display_sync() in regular
+ * intervals, over the same connection as everything else. The server answers
+ * a sync only after handling all earlier requests, so its latency is a good
+ * proxy for how responsive it is. Round-trips above the stall threshold are
+ * reported immediately, and also while the answer is still outstanding.
+ *
+ * The round-trip times are kept in a histogram with logarithmic buckets, each
+ * split into linear sub-buckets, like HDR histograms: Values are recorded in
+ * microseconds with a relative error of at most 1 / PING_SUB_BUCKETS, in
+ * constant memory.
+ */
+#define PING_SUB_BITS 5
+#define PING_SUB_BUCKETS (1 << PING_SUB_BITS)
+#define PING_BUCKETS 40
+
+/** Upper bound of --ping and --ping-stall, keeping timeouts within an int. */
+#define PING_MAX_MS (60 * 60 * 1000)
+
+/** Interval between pings in milliseconds, 0 if not pinging. */
+unsigned long ping_interval = 0;
+unsigned long ping_stall = 50;
+unsigned long ping_count = 0;
+
+struct wl_callback *ping_callback = NULL;
+uint64_t ping_sent = 0;
+uint64_t ping_next = 0;
+bool ping_stall_reported = false;
+
+struct
+{
+	uint64_t counts[PING_BUCKETS * PING_SUB_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t stalls;
+} ping_histogram = { .min = UINT64_MAX };
+
+/**
+ * Values below PING_SUB_BUCKETS get a bucket each. Above, the bucket is
+ * chosen by the position of the highest bit and the sub-bucket by the
+ * PING_SUB_BITS bits below it.
+ */
+static size_t ping_bucket (uint64_t value)
+{
+	if ( value < PING_SUB_BUCKETS )
+		return (size_t)value;
+	const unsigned int magnitude = 63 - (unsigned int)__builtin_clzll(value);
+	const unsigned int shift = magnitude - PING_SUB_BITS;
+	const size_t bucket = (size_t)( shift + 1 ) * PING_SUB_BUCKETS
+		+ (size_t)( ( value >> shift ) & ( PING_SUB_BUCKETS - 1 ) );
+	const size_t last = PING_BUCKETS * PING_SUB_BUCKETS - 1;
+	return bucket < last ? bucket : last;
+}
+
+/** The lowest value of a bucket. */
+static uint64_t ping_bucket_value (size_t bucket)
+{
+	if ( bucket < PING_SUB_BUCKETS )
+		return bucket;
+	const unsigned int shift = (unsigned int)( bucket / PING_SUB_BUCKETS ) - 1;
+	return ( (uint64_t)PING_SUB_BUCKETS + bucket % PING_SUB_BUCKETS ) << shift;
+}
+
+static void ping_record (uint64_t rtt)
+{
+	ping_histogram.counts[ping_bucket(rtt)]++;
+	ping_histogram.total++;
+	ping_histogram.sum += rtt;
+	if ( rtt < ping_histogram.min )
+		ping_histogram.min = rtt;
+	if ( rtt > ping_histogram.max )
+		ping_histogram.max = rtt;
+}
+
+/** Returns the lowest value of the bucket containing the percentile. */
+static uint64_t ping_percentile (double percentile)
+{
+	const uint64_t rank = (uint64_t)( percentile / 100.0 * (double)ping_histogram.total );
+	uint64_t seen = 0;
+	for (size_t i = 0; i < PING_BUCKETS * PING_SUB_BUCKETS; i++)
+	{
+		seen += ping_histogram.counts[i];
+		if ( seen > rank )
+			return ping_bucket_value(i);
+	}
+	return ping_histogram.max;
+}
+
+static void ping_callback_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other_data)
+{
+	const uint64_t rtt = monotonic_us() - ping_sent;
+	wl_callback_destroy(ping_callback);
+	ping_callback = NULL;
+
+	ping_record(rtt);
+	if ( rtt >= ping_stall * 1000 )
+	{
+		if (!ping_stall_reported)
+			ping_histogram.stalls++;
+		fprintf(stderr, "Stall: Sync round-trip took %.1f ms.\n", (double)rtt / 1000.0);
+	}
+	if ( ping_count > 0 && ping_histogram.total >= ping_count )
+		loop = false;
+}
+
+static const struct wl_callback_listener ping_callback_listener = {
+	.done = ping_callback_handle_done,
+};
+
+/** Returns the poll() timeout until the next ping or stall check is due. */
+static int ping_timeout (void)
+{
+	if ( ping_interval == 0 || !toplevels_known )
+		return -1;
+	const uint64_t now = monotonic_us();
+	uint64_t due = ping_next;
+	if ( ping_callback != NULL )
+		due = ping_stall_reported ? UINT64_MAX : ping_sent + ping_stall * 1000;
+	if ( due == UINT64_MAX )
+		return -1;
+	return due > now ? (int)( ( due - now + 999 ) / 1000 ) : 0;
+}
+
+/** Called by the main loop of WATCH mode after every wake up. */
+static void ping_tick (void)
+{
+	/* Start once the initial round-trips are done. */
+	if ( ping_interval == 0 || !toplevels_known )
+		return;
+
+	const uint64_t now = monotonic_us();
+	if ( ping_callback != NULL )
+	{
+		if ( !ping_stall_reported && now - ping_sent >= ping_stall * 1000 )
+		{
+			ping_stall_reported = true;
+			ping_histogram.stalls++;
+			fprintf(stderr, "Stall: No answer to sync for %.1f ms.\n",
+					(double)( now - ping_sent ) / 1000.0);
+		}
+		return;
+	}
+	if ( now < ping_next )
+		return;
+
+	ping_stall_reported = false;
+	ping_sent = now;
+	ping_next = now + ping_interval * 1000;
+	ping_callback = wl_display_sync(wl_display);
+	wl_callback_add_listener(ping_callback, &ping_callback_listener, NULL);
+	wl_display_flush(wl_display);
+}
+
+/** Print the round-trip statistics. With --watch they go to stderr. */
+static void ping_report (void)
+{
+	if ( ping_interval == 0 )
+		return;
+	FILE *f = ping_only ? stdout : stderr;
+	if ( ping_histogram.total == 0 )
+	{
+		fputs("No sync round-trips measured.\n", f);
+		return;
+	}
+
+	fprintf(f, "round-trips: %" PRIu64 ", stalls (>= %lu ms): %" PRIu64 "\n",
+			ping_histogram.total, ping_stall, ping_histogram.stalls);
+	fprintf(f, "min: %.3f ms, mean: %.3f ms, max: %.3f ms\n",
+			(double)ping_histogram.min / 1000.0,
+			(double)ping_histogram.sum / (double)ping_histogram.total / 1000.0,
+			(double)ping_histogram.max / 1000.0);
+	static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		fprintf(f, "p%g: %.3f ms\n", percentiles[i], (double)ping_percentile(percentiles[i]) / 1000.0);
+
+	fputs("histogram (ms, count):\n", f);
+	for (size_t i = 0; i < PING_BUCKETS * PING_SUB_BUCKETS; i++)
+		if ( ping_histogram.counts[i] > 0 )
+			fprintf(f, "  %10.3f %" PRIu64 "\n", (double)ping_bucket_value(i) / 1000.0,
+					ping_histogram.counts[i]);
+}
+
+/** Parse a positive decimal number. */
+static bool parse_number (const char *str, unsigned long *number)
+{
+	if (!isdigit((unsigned char)*str))
+		return false;
+	char *end;
+	errno = 0;
+	*number = strtoul(str, &end, 10);
+	return errno == 0 && *end == '\0' && *number > 0;
+}
+
+/***************************
+ *                         *
+ *    Focus transitions    *
+ *                         *
+ ***************************/
+/* --transitions counts how often the focus moved from one app-id to another,
+ * for predicting the next window. App-ids are interned, the counts live in a
+ * sparse hash table keyed by the pair of app-id indices, so every focus
+ * handoff is a single O(1) update.
+ *
+ * Counts decay exponentially with the half life of --transitions-half-life.
+ * Instead of decaying every count all the time, new transitions are added
+ * with a weight growing at the inverse rate, relative to transitions_epoch.
+ * The decayed count is the stored weight divided by the current weight. Once
+ * the weights become too large, all counts are rescaled to a new epoch.
+ *
+ * The table is loaded from and saved to a compact binary file. SIGUSR1 and
+ * exiting write it as JSON next to it as well.
+ */
+#define TRANSITIONS_MAGIC "LSWTFTM1"
+
+struct Transition
+{
+	/** Index of the app-id focused before and after, UINT32_MAX if unused. */
+	uint32_t from;
+	uint32_t to;
+	double weight;
+};
+
+const char *transitions_path = NULL;
+double transitions_half_life = 7 * 24 * 3600;
+
+/** Wall clock time in seconds at which transitions have weight 1. */
+double transitions_epoch = 0;
+
+struct Transition *transitions = NULL;
+size_t transitions_len = 0;
+size_t transitions_capacity = 0;
+
+char **transition_apps = NULL;
+uint32_t transition_apps_len = 0;
+
+/** Hash table of interned app-ids, holding indices into transition_apps. */
+uint32_t *transition_app_table = NULL;
+size_t transition_app_table_capacity = 0;
+
+/** App-id index of the focused toplevel, UINT32_MAX if none. */
+uint32_t transition_current = UINT32_MAX;
+
+volatile sig_atomic_t transitions_dump_requested = 0;
+
+static uint64_t transition_hash (uint32_t from, uint32_t to)
+{
+	uint64_t key = ( (uint64_t)from << 32 ) | to;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccd;
+	key ^= key >> 33;
+	return key;
+}
+
+static bool transition_app_table_grow (void)
+{
+	const size_t capacity = transition_app_table_capacity == 0 ? 64 : transition_app_table_capacity * 2;
+	uint32_t *table = malloc(capacity * sizeof(uint32_t));
+	if ( table == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return false;
+	}
+	memset(table, 0xff, capacity * sizeof(uint32_t));
+	for (uint32_t i = 0; i < transition_apps_len; i++)
+	{
+		size_t slot = hash_string(transition_apps[i]) & ( capacity - 1 );
+		while ( table[slot] != UINT32_MAX )
+			slot = ( slot + 1 ) & ( capacity - 1 );
+		table[slot] = i;
+	}
+	free(transition_app_table);
+	transition_app_table = table;
+	transition_app_table_capacity = capacity;
+	return true;
+}
+
+/** Returns the index of the app-id, interning it if needed. UINT32_MAX on error. */
+static uint32_t transition_app (const char *app_id)
+{
+	if ( app_id == NULL )
+		app_id = "";
+	if ( ( transition_apps_len + 1 ) * 10 > transition_app_table_capacity * 7
+			&& !transition_app_table_grow() )
+		return UINT32_MAX;
+
+	const size_t mask = transition_app_table_capacity - 1;
+	size_t slot = hash_string(app_id) & mask;
+	for (; transition_app_table[slot] != UINT32_MAX; slot = ( slot + 1 ) & mask)
+		if ( strcmp(transition_apps[transition_app_table[slot]], app_id) == 0 )
+			return transition_app_table[slot];
+
+	char **apps = realloc(transition_apps, ( transition_apps_len + 1 ) * sizeof(char *));
+	if ( apps == NULL )
+	{
+		fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+		return UINT32_MAX;
+	}
+	transition_apps = apps;
+	transition_apps[transition_apps_len] = strdup(app_id);
+	if ( transition_apps[transition_apps_len] == NULL )
+	{
+		fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+		return UINT32_MAX;
+	}
+	transition_app_table[slot] = transition_apps_len;
+	return transition_apps_len++;
+}
+
+static struct Transition *transition_lookup (uint32_t from, uint32_t to, bool create);
+
+static bool transitions_grow (void)
+{
+	const size_t capacity = transitions_capacity == 0 ? 256 : transitions_capacity * 2;
+	struct Transition *old = transitions;
+	const size_t old_capacity = transitions_capacity;
+	transitions = malloc(capacity * sizeof(struct Transition));
+	if ( transitions == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		transitions = old;
+		return false;
+	}
+	for (size_t i = 0; i < capacity; i++)
+		transitions[i] = (struct Transition){ .from = UINT32_MAX, .to = UINT32_MAX };
+	transitions_capacity = capacity;
+	transitions_len = 0;
+	for (size_t i = 0; i < old_capacity; i++)
+		if ( old[i].from != UINT32_MAX )
+			transition_lookup(old[i].from, old[i].to, true)->weight = old[i].weight;
+	free(old);
+	return true;
+}
+
+/** Find the entry of a transition, optionally creating it. */
+static struct Transition *transition_lookup (uint32_t from, uint32_t to, bool create)
+{
+	if ( create && ( transitions_len + 1 ) * 10 > transitions_capacity * 7 && !transitions_grow() )
+		return NULL;
+	if ( transitions_capacity == 0 )
+		return NULL;
+
+	const size_t mask = transitions_capacity - 1;
+	for (size_t slot = transition_hash(from, to) & mask;; slot = ( slot + 1 ) & mask)
+	{
+		struct Transition *transition = &transitions[slot];
+		if ( transition->from == from && transition->to == to )
+			return transition;
+		if ( transition->from == UINT32_MAX )
+		{
+			if (!create)
+				return NULL;
+			*transition = (struct Transition){ .from = from, .to = to, .weight = 0 };
+			transitions_len++;
+			return transition;
+		}
+	}
+}
+
+static double wall_clock_s (void)
+{
+	return (double)wall_clock_us() / 1e6;
+}
+
+/** Weight of a transition happening now, relative to transitions_epoch. */
+static double transition_weight (double now)
+{
+	return exp2(( now - transitions_epoch ) / transitions_half_life);
+}
+
+/** Move the epoch, rescaling all weights. */
+static void transitions_rebase (double epoch)
+{
+	const double scale = exp2(( transitions_epoch - epoch ) / transitions_half_life);
+	for (size_t i = 0; i < transitions_capacity; i++)
+		transitions[i].weight *= scale;
+	transitions_epoch = epoch;
+}
+
+static void transitions_add (uint32_t from, uint32_t to, double count, double now)
+{
+	double weight = transition_weight(now);
+	if ( weight > 1e100 )
+	{
+		transitions_rebase(now);
+		weight = 1;
+	}
+	struct Transition *transition = transition_lookup(from, to, true);
+	if ( transition != NULL )
+		transition->weight += count * weight;
+}
+
+/** Record a focus handoff. Called from focus_flush(). */
+static void transitions_focus (const struct Toplevel *toplevel)
+{
+	if ( transitions_path == NULL )
+		return;
+	const uint32_t app = transition_app(string_get(&toplevel->app_id));
+	if ( app == UINT32_MAX )
+		return;
+	if ( transition_current != UINT32_MAX )
+		transitions_add(transition_current, app, 1, wall_clock_s());
+	transition_current = app;
+}
+
+static int compare_transitions (const void *a, const void *b)
+{
+	const struct Transition *transition_a = a;
+	const struct Transition *transition_b = b;
+	const int from = strcmp(transition_apps[transition_a->from], transition_apps[transition_b->from]);
+	if ( from != 0 )
+		return from;
+	return strcmp(transition_apps[transition_a->to], transition_apps[transition_b->to]);
+}
+
+/** Returns the path of --transitions with the suffix appended, NULL on error. */
+static char *transitions_suffixed_path (const char *suffix)
+{
+	const size_t len = strlen(transitions_path) + strlen(suffix) + 1;
+	char *path = malloc(len);
+	if ( path == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	snprintf(path, len, "%s%s", transitions_path, suffix);
+	return path;
+}
+
+/**
+ * Files are written to a temporary path and renamed once complete, so readers
+ * never see a partial file.
+ */
+static bool transitions_replace (FILE *f, const char *tmp_path, const char *path)
+{
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if ( ok && rename(tmp_path, path) == 0 )
+		return true;
+	fprintf(stderr, "ERROR: Can not write '%s': %s\n", path, strerror(errno));
+	unlink(tmp_path);
+	return false;
+}
+
+/**
+ * Write the decayed counts as JSON object of objects, from app-id to app-id
+ * to count, to the path of --transitions with ".json" appended.
+ */
+static void transitions_dump_json (void)
+{
+	char *path = transitions_suffixed_path(".json");
+	char *tmp_path = transitions_suffixed_path(".json.tmp");
+	struct Transition *sorted = malloc(( transitions_len + 1 ) * sizeof(struct Transition));
+	FILE *f = NULL;
+	if ( path == NULL || tmp_path == NULL || sorted == NULL )
+		goto out;
+	if ( (f = fopen(tmp_path, "w")) == NULL )
+	{
+		fprintf(stderr, "ERROR: Can not write '%s': %s\n", tmp_path, strerror(errno));
+		goto out;
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; i < transitions_capacity; i++)
+		if ( transitions[i].from != UINT32_MAX )
+			sorted[len++] = transitions[i];
+	qsort(sorted, len, sizeof(struct Transition), compare_transitions);
+
+	const double scale = transition_weight(wall_clock_s());
+	fprintf(f, "{\n    \"half-life\": %.0f,\n    \"transitions\": {", transitions_half_life);
+	for (size_t i = 0; i < len; i++)
+	{
+		const bool first = i == 0 || sorted[i].from != sorted[i-1].from;
+		if (first)
+		{
+			fputs(i == 0 ? "\n        " : "\n        },\n        ", f);
+			write_json(transition_apps[sorted[i].from], f);
+			fputs(": {", f);
+		}
+		fputs(first ? "\n            " : ",\n            ", f);
+		write_json(transition_apps[sorted[i].to], f);
+		fprintf(f, ": %.4g", sorted[i].weight / scale);
+	}
+	fputs(len > 0 ? "\n        }\n    }\n}\n" : "}\n}\n", f);
+	transitions_replace(f, tmp_path, path);
+
+out:
+	free(sorted);
+	free(tmp_path);
+	free(path);
+}
+
+/**
+ * Load the binary file of --transitions, if it exists. Prints error messages
+ * accordingly.
+ *
+ * The file holds the magic, the time it was saved as double, the app-id count
+ * as uint32_t, the app-ids as uint16_t length and bytes, the transition count
+ * as uint32_t and the transitions as two uint32_t app-id indices and a double
+ * count, decayed to the time of saving. All in native byte order.
+ */
+static bool transitions_load (void)
+{
+	transitions_epoch = wall_clock_s();
+	FILE *f = fopen(transitions_path, "r");
+	if ( f == NULL )
+	{
+		if ( errno == ENOENT )
+			return true;
+		fprintf(stderr, "ERROR: Can not open '%s': %s\n", transitions_path, strerror(errno));
+		return false;
+	}
+
+	bool ok = false;
+	uint32_t *apps = NULL;
+	char magic[8];
+	double saved;
+	uint32_t apps_len, len;
+	if ( fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, TRANSITIONS_MAGIC, sizeof(magic)) != 0
+			|| fread(&saved, sizeof(saved), 1, f) != 1
+			|| fread(&apps_len, sizeof(apps_len), 1, f) != 1 )
+		goto out;
+
+	apps = calloc(apps_len + 1, sizeof(uint32_t));
+	if ( apps == NULL )
+		goto out;
+	for (uint32_t i = 0; i < apps_len; i++)
+	{
+		uint16_t app_len;
+		char app_id[UINT16_MAX + 1];
+		if ( fread(&app_len, sizeof(app_len), 1, f) != 1
+				|| ( app_len > 0 && fread(app_id, app_len, 1, f) != 1 ) )
+			goto out;
+		app_id[app_len] = '\0';
+		apps[i] = transition_app(app_id);
+		if ( apps[i] == UINT32_MAX )
+			goto out;
+	}
+
+	if ( fread(&len, sizeof(len), 1, f) != 1 )
+		goto out;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		struct { uint32_t from, to; double count; } record;
+		if ( fread(&record.from, sizeof(record.from), 1, f) != 1
+				|| fread(&record.to, sizeof(record.to), 1, f) != 1
+				|| fread(&record.count, sizeof(record.count), 1, f) != 1
+				|| record.from >= apps_len || record.to >= apps_len )
+			goto out;
+		transitions_add(apps[record.from], apps[record.to], record.count, saved);
+	}
+	ok = true;
+
+out:
+	if (!ok)
+		fprintf(stderr, "ERROR: '%s' is not a valid transitions file.\n", transitions_path);
+	free(apps);
+	fclose(f);
+	return ok;
+}
+
+static void transitions_save (void)
+{
+	char *tmp_path = transitions_suffixed_path(".tmp");
+	if ( tmp_path == NULL )
+		return;
+	FILE *f = fopen(tmp_path, "w");
+	if ( f == NULL )
+	{
+		fprintf(stderr, "ERROR: Can not write '%s': %s\n", tmp_path, strerror(errno));
+		free(tmp_path);
+		return;
+	}
+
+	const double saved = wall_clock_s();
+	const double scale = transition_weight(saved);
+	fwrite(TRANSITIONS_MAGIC, 8, 1, f);
+	fwrite(&saved, sizeof(saved), 1, f);
+	fwrite(&transition_apps_len, sizeof(transition_apps_len), 1, f);
+	for (uint32_t i = 0; i < transition_apps_len; i++)
+	{
+		const size_t len = strlen(transition_apps[i]);
+		const uint16_t app_len = len > UINT16_MAX ? UINT16_MAX : (uint16_t)len;
+		fwrite(&app_len, sizeof(app_len), 1, f);
+		fwrite(transition_apps[i], app_len, 1, f);
+	}
+	const uint32_t len = (uint32_t)transitions_len;
+	fwrite(&len, sizeof(len), 1, f);
+	for (size_t i = 0; i < transitions_capacity; i++)
+	{
+		if ( transitions[i].from == UINT32_MAX )
+			continue;
+		const double count = transitions[i].weight / scale;
+		fwrite(&transitions[i].from, sizeof(uint32_t), 1, f);
+		fwrite(&transitions[i].to, sizeof(uint32_t), 1, f);
+		fwrite(&count, sizeof(count), 1, f);
+	}
+	transitions_replace(f, tmp_path, transitions_path);
+	free(tmp_path);
+}
+
+static void handle_dump_request (int signum)
+{
+	transitions_dump_requested = 1;
+}
+
+/** Called by the main loop of WATCH mode after every wake up. */
+static void transitions_tick (void)
+{
+	if (!transitions_dump_requested)
+		return;
+	transitions_dump_requested = 0;
+	transitions_dump_json();
+}
+
+static void transitions_finish (void)
+{
+	if ( transitions_path != NULL )
+	{
+		transitions_save();
+		transitions_dump_json();
+	}
+
+	for (uint32_t i = 0; i < transition_apps_len; i++)
+		free(transition_apps[i]);
+	free(transition_apps);
+	free(transition_app_table);
+	free(transitions);
+	transitions_path = NULL;
+}
+
+/*********************
+ *                   *
+ *    Aggregation    *
+ *                   *
+ *********************/
+/* --aggregate reads any number of --feed recordings and merges them into a
+ * single report of the focus time, number of toplevels and event rates per
+ * app-id, in JSON or CBOR. Recordings are memory mapped and parsed in place by
+ * a pool of worker threads. Each worker takes the next unprocessed recording
+ * and counts into tables of its own, which are only merged once all
+ * recordings are done, so the workers share nothing but the index of the next
+ * recording.
+ *
+ * A toplevel is focused while its state has the activated flag, from the
+ * record setting it to the next record of the same toplevel, a reset or the
+ * end of the recording. The time is credited to the app-id the toplevel had
+ * when the span started.
+ */
+struct Aggregate_app
+{
+	/**
+	 * Escaped app-id as in the recording, "\N" if unset, then as escaped by
+	 * aggregate_normalize(). Unescaped for the report, NULL if unset.
+	 */
+	char *app_id;
+	size_t len;
+	uint64_t hash;
+
+	uint64_t focus_us;
+	uint64_t toplevels;
+
+	/** Number of records of each enum Toplevel_event. */
+	uint64_t events[EVENT_FOCUS + 1];
+};
+
+struct Aggregate_toplevel
+{
+	uint64_t id;
+	bool used;
+	bool activated;
+
+	/** Index of the app-id, start of the current span. */
+	uint32_t app;
+	uint64_t since;
+};
+
+struct Aggregate_worker
+{
+	pthread_t thread;
+	bool started;
+
+	struct Aggregate_app *apps;
+	uint32_t apps_len;
+	uint32_t apps_capacity;
+
+	/** Hash table of indices into apps, UINT32_MAX if unused. */
+	uint32_t *app_table;
+	size_t app_table_capacity;
+
+	/** Hash table of the toplevels of the current recording, by id. */
+	struct Aggregate_toplevel *toplevels;
+	size_t toplevels_len;
+	size_t toplevels_capacity;
+
+	/** Time of the first and last record of the current recording. */
+	uint64_t first_time;
+	uint64_t last_time;
+
+	size_t recordings;
+	size_t failed;
+	uint64_t records;
+	uint64_t malformed;
+	uint64_t duration_us;
+};
+
+char **aggregate_paths = NULL;
+size_t aggregate_paths_len = 0;
+bool aggregate_cbor = false;
+
+/** Number of worker threads set by --jobs, 0 for one per core. */
+unsigned long aggregate_jobs = 0;
+
+/** Index of the next recording to be taken by a worker. */
+_Atomic size_t aggregate_next = 0;
+
+static bool aggregate_app_table_grow (struct Aggregate_worker *worker)
+{
+	const size_t capacity = worker->app_table_capacity == 0 ? 64 : worker->app_table_capacity * 2;
+	uint32_t *table = malloc(capacity * sizeof(uint32_t));
+	if ( table == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return false;
+	}
+	memset(table, 0xff, capacity * sizeof(uint32_t));
+	for (uint32_t i = 0; i < worker->apps_len; i++)
+	{
+		size_t slot = worker->apps[i].hash & ( capacity - 1 );
+		while ( table[slot] != UINT32_MAX )
+			slot = ( slot + 1 ) & ( capacity - 1 );
+		table[slot] = i;
+	}
+	free(worker->app_table);
+	worker->app_table = table;
+	worker->app_table_capacity = capacity;
+	return true;
+}
+
+/**
+ * Returns the index of the escaped app-id of len bytes, adding it if needed.
+ * UINT32_MAX on error.
+ */
+static uint32_t aggregate_app (struct Aggregate_worker *worker, const char *app_id, size_t len)
+{
+	if ( ( worker->apps_len + 1 ) * 2 > worker->app_table_capacity
+			&& !aggregate_app_table_grow(worker) )
+		return UINT32_MAX;
+
+	const uint64_t hash = hash_bytes(app_id, len, 0);
+	size_t slot = hash & ( worker->app_table_capacity - 1 );
+	for (; worker->app_table[slot] != UINT32_MAX; slot = ( slot + 1 ) & ( worker->app_table_capacity - 1 ))
+	{
+		const struct Aggregate_app *app = &worker->apps[worker->app_table[slot]];
+		if ( app->hash == hash && app->len == len && memcmp(app->app_id, app_id, len) == 0 )
+			return worker->app_table[slot];
+	}
+
+	if ( worker->apps_len == worker->apps_capacity )
+	{
+		const uint32_t capacity = worker->apps_capacity == 0 ? 32 : worker->apps_capacity * 2;
+		struct Aggregate_app *apps = realloc(worker->apps, capacity * sizeof(struct Aggregate_app));
+		if ( apps == NULL )
+		{
+			fprintf(stderr, "ERROR: realloc(): %s\n", strerror(errno));
+			return UINT32_MAX;
+		}
+		worker->apps = apps;
+		worker->apps_capacity = capacity;
+	}
+	char *copy = malloc(len + 1);
+	if ( copy == NULL )
+	{
+		fprintf(stderr, "ERROR: malloc(): %s\n", strerror(errno));
+		return UINT32_MAX;
+	}
+	memcpy(copy, app_id, len);
+	copy[len] = '\0';
+
+	worker->apps[worker->apps_len] = (struct Aggregate_app){
+		.app_id = copy,
+		.len = len,
+		.hash = hash,
+	};
+	worker->app_table[slot] = worker->apps_len;
+	return worker->apps_len++;
+}
+
+static size_t aggregate_toplevel_slot (uint64_t id, size_t capacity)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccd;
+	id ^= id >> 33;
+	return (size_t)id & ( capacity - 1 );
+}
+
+static bool aggregate_toplevels_grow (struct Aggregate_worker *worker)
+{
+	const size_t capacity = worker->toplevels_capacity == 0 ? 256 : worker->toplevels_capacity * 2;
+	struct Aggregate_toplevel *table = calloc(capacity, sizeof(struct Aggregate_toplevel));
+	if ( table == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		return false;
+	}
+	for (size_t i = 0; i < worker->toplevels_capacity; i++)
+	{
+		if (!worker->toplevels[i].used)
+			continue;
+		size_t slot = aggregate_toplevel_slot(worker->toplevels[i].id, capacity);
+		while (table[slot].used)
+			slot = ( slot + 1 ) & ( capacity - 1 );
+		table[slot] = worker->toplevels[i];
+	}
+	free(worker->toplevels);
+	worker->toplevels = table;
+	worker->toplevels_capacity = capacity;
+	return true;
+}
+
+/**
+ * Returns the toplevel with the id, adding an unused one if needed, in which
+ * case used is false. NULL on error.
+ */
+static struct Aggregate_toplevel *aggregate_toplevel (struct Aggregate_worker *worker, uint64_t id)
+{
+	if ( ( worker->toplevels_len + 1 ) * 2 > worker->toplevels_capacity
+			&& !aggregate_toplevels_grow(worker) )
+		return NULL;
+
+	size_t slot = aggregate_toplevel_slot(id, worker->toplevels_capacity);
+	for (; worker->toplevels[slot].used; slot = ( slot + 1 ) & ( worker->toplevels_capacity - 1 ))
+		if ( worker->toplevels[slot].id == id )
+			return &worker->toplevels[slot];
+	worker->toplevels[slot].id = id;
+	return &worker->toplevels[slot];
+}
+
+static void aggregate_end_focus (struct Aggregate_worker *worker, struct Aggregate_toplevel *toplevel,
+		uint64_t time)
+{
+	if ( toplevel->activated && time > toplevel->since )
+		worker->apps[toplevel->app].focus_us += time - toplevel->since;
+	toplevel->activated = false;
+}
+
+static void aggregate_end_all_focus (struct Aggregate_worker *worker, uint64_t time)
+{
+	for (size_t i = 0; i < worker->toplevels_capacity; i++)
+		if (worker->toplevels[i].used)
+			aggregate_end_focus(worker, &worker->toplevels[i], time);
+}
+
+/** Count a record of len bytes, without the newline. Returns false on error. */
+static bool aggregate_record (struct Aggregate_worker *worker, const char *line, size_t len)
+{
+	struct Record record;
+	switch (record_parse(line, len, &record))
+	{
+		case RECORD_VALID:
+			break;
+
+		case RECORD_UNKNOWN:
+			return true;
+
+		case RECORD_MALFORMED:
+			worker->malformed++;
+			return true;
+	}
+
+	if ( worker->first_time == 0 || record.time < worker->first_time )
+		worker->first_time = record.time;
+	if ( record.time > worker->last_time )
+		worker->last_time = record.time;
+
+	/* The present records following a reset restore the current state. */
+	if (record.reset)
+	{
+		aggregate_end_all_focus(worker, record.time);
+		return true;
+	}
+
+	/* A focus record also ends the focus of the previous toplevel. */
+	if ( record.event == EVENT_FOCUS && record.has_previous )
+	{
+		struct Aggregate_toplevel *previous = aggregate_toplevel(worker, record.previous);
+		if ( previous == NULL )
+			return false;
+		if (previous->used)
+			aggregate_end_focus(worker, previous, record.time);
+	}
+
+	struct Aggregate_toplevel *toplevel = aggregate_toplevel(worker, record.id);
+	const uint32_t app = aggregate_app(worker, record.app_id, record.app_id_len);
+	if ( toplevel == NULL || app == UINT32_MAX )
+		return false;
+	if (toplevel->used)
+		aggregate_end_focus(worker, toplevel, record.time);
+	else
+	{
+		toplevel->used = true;
+		worker->toplevels_len++;
+		worker->apps[app].toplevels++;
+	}
+	toplevel->app = app;
+	toplevel->since = record.time;
+	toplevel->activated = record.event != EVENT_CLOSED && ( record.flags & TOPLEVEL_ACTIVATED ) != 0;
+	if (!record.present)
+		worker->apps[app].events[record.event]++;
+	return true;
+}
+
+/** Count all records of a recording. Prints error messages accordingly. */
+static bool aggregate_recording (struct Aggregate_worker *worker, const char *path)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 )
+	{
+		fprintf(stderr, "ERROR: Can not open recording '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if ( fstat(fd, &st) != 0 )
+	{
+		fprintf(stderr, "ERROR: Can not stat recording '%s': %s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+	const size_t size = (size_t)st.st_size;
+	if ( size == 0 )
+	{
+		close(fd);
+		return true;
+	}
+	/* Prefaulting all pages at once is a lot faster than faulting them in
+	 * one by one while parsing.
+	 */
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	char *data = mmap(NULL, size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if ( data == MAP_FAILED )
+	{
+		fprintf(stderr, "ERROR: Can not map recording '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	if ( worker->toplevels_capacity > 0 )
+		memset(worker->toplevels, 0, worker->toplevels_capacity * sizeof(struct Aggregate_toplevel));
+	worker->toplevels_len = 0;
+	worker->first_time = 0;
+	worker->last_time = 0;
+
+	bool ok = true;
+	const char *const end = data + size;
+	for (const char *line = data; ok && line < end;)
+	{
+		const char *newline = memchr(line, '\n', (size_t)(end - line));
+		const char *line_end = newline != NULL ? newline : end;
+		if ( line_end > line )
+		{
+			worker->records++;
+			ok = aggregate_record(worker, line, (size_t)(line_end - line));
+		}
+		line = line_end + 1;
+	}
+	munmap(data, size);
+
+	aggregate_end_all_focus(worker, worker->last_time);
+	worker->duration_us += worker->last_time - worker->first_time;
+	return ok;
+}
+
+/** Process recordings until none are left. Run in worker threads. */
+static void *aggregate_work (void *data)
+{
+	struct Aggregate_worker *worker = (struct Aggregate_worker *)data;
+	for (;;)
+	{
+		const size_t i = atomic_fetch_add_explicit(&aggregate_next, 1, memory_order_relaxed);
+		if ( i >= aggregate_paths_len )
+			break;
+		if (aggregate_recording(worker, aggregate_paths[i]))
+			worker->recordings++;
+		else
+			worker->failed++;
+	}
+	return NULL;
+}
+
+static void aggregate_app_add (struct Aggregate_app *to, const struct Aggregate_app *from)
+{
+	to->focus_us += from->focus_us;
+	to->toplevels += from->toplevels;
+	for (size_t i = 0; i < sizeof(to->events) / sizeof(to->events[0]); i++)
+		to->events[i] += from->events[i];
+}
+
+/** Add the counts of the worker to those of total. */
+static bool aggregate_merge (struct Aggregate_worker *total, const struct Aggregate_worker *worker)
+{
+	for (uint32_t i = 0; i < worker->apps_len; i++)
+	{
+		const struct Aggregate_app *from = &worker->apps[i];
+		const uint32_t index = aggregate_app(total, from->app_id, from->len);
+		if ( index == UINT32_MAX )
+			return false;
+		aggregate_app_add(&total->apps[index], from);
+	}
+	total->recordings += worker->recordings;
+	total->failed += worker->failed;
+	total->records += worker->records;
+	total->malformed += worker->malformed;
+	total->duration_us += worker->duration_us;
+	return true;
+}
+
+static void aggregate_worker_free (struct Aggregate_worker *worker)
+{
+	for (uint32_t i = 0; i < worker->apps_len; i++)
+		free(worker->apps[i].app_id);
+	free(worker->apps);
+	free(worker->app_table);
+	free(worker->toplevels);
+}
+
+/**
+ * Merge the apps of total whose app-ids only differ in escaping or in invalid
+ * UTF-8, by keying them by the app-id as printed in the report, escaped again.
+ * Done once after merging the workers, so records are still counted by their
+ * app-id as written. Returns false on error.
+ */
+static bool aggregate_normalize (struct Aggregate_worker *total)
+{
+	struct Aggregate_worker normalized = { 0 };
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < total->apps_len; i++)
+	{
+		const struct Aggregate_app *from = &total->apps[i];
+		const char *app_id = unescape_tsv(from->app_id);
+		char *repaired = app_id != NULL ? utf8_repair(app_id) : NULL;
+
+		char *key = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&key, &len);
+		if ( f == NULL )
+		{
+			fprintf(stderr, "ERROR: open_memstream(): %s\n", strerror(errno));
+			free(repaired);
+			ok = false;
+			break;
+		}
+		write_tsv_value(repaired != NULL ? repaired : app_id, f);
+		free(repaired);
+		if ( fclose(f) != 0 )
+		{
+			fprintf(stderr, "ERROR: fclose(): %s\n", strerror(errno));
+			free(key);
+			ok = false;
+			break;
+		}
+
+		const uint32_t index = aggregate_app(&normalized, key, len);
+		free(key);
+		if ( index == UINT32_MAX )
+			ok = false;
+		else
+			aggregate_app_add(&normalized.apps[index], from);
+	}
+
+	for (uint32_t i = 0; i < total->apps_len; i++)
+		free(total->apps[i].app_id);
+	free(total->apps);
+	free(total->app_table);
+	total->apps = normalized.apps;
+	total->apps_len = normalized.apps_len;
+	total->apps_capacity = normalized.apps_capacity;
+	total->app_table = normalized.app_table;
+	total->app_table_capacity = normalized.app_table_capacity;
+	return ok;
+}
+
+/** Most focus time first, then most toplevels, then by app-id. */
+static int compare_aggregate_apps (const void *a, const void *b)
+{
+	const struct Aggregate_app *app_a = (const struct Aggregate_app *)a;
+	const struct Aggregate_app *app_b = (const struct Aggregate_app *)b;
+	if ( app_a->focus_us != app_b->focus_us )
+		return app_a->focus_us > app_b->focus_us ? -1 : 1;
+	if ( app_a->toplevels != app_b->toplevels )
+		return app_a->toplevels > app_b->toplevels ? -1 : 1;
+	return strcmp(app_a->app_id, app_b->app_id);
+}
+
+static uint64_t aggregate_app_events (const struct Aggregate_app *app)
+{
+	uint64_t events = 0;
+	for (size_t i = 0; i < sizeof(app->events) / sizeof(app->events[0]); i++)
+		events += app->events[i];
+	return events;
+}
+
+/** Write the head of a CBOR data item of the major type with its argument. */
+static void cbor_write_head (uint8_t major, uint64_t value, FILE *restrict f)
+{
+	uint8_t head[9];
+	size_t len = 1;
+	if ( value < 24 )
+		head[0] = (uint8_t)( ( major << 5 ) | value );
+	else
+	{
+		/* 1, 2, 4 or 8 bytes of argument, in network byte order. */
+		size_t bytes = 1;
+		uint8_t info = 24;
+		while ( bytes < 8 && ( value >> ( bytes * 8 ) ) != 0 )
+		{
+			bytes *= 2;
+			info++;
+		}
+		head[0] = (uint8_t)( ( major << 5 ) | info );
+		for (size_t i = 0; i < bytes; i++)
+			head[len++] = (uint8_t)( value >> ( ( bytes - 1 - i ) * 8 ) );
+	}
+	fwrite(head, 1, len, f);
+}
+
+/** Write a text string, or null if the string is NULL. */
+static void cbor_write_text (const char *str, FILE *restrict f)
+{
+	if ( str == NULL )
+	{
+		fputc(0xf6, f);
+		return;
+	}
+	const size_t len = strlen(str);
+	cbor_write_head(3, len, f);
+	fwrite(str, 1, len, f);
+}
+
+static void cbor_write_double (double value, FILE *restrict f)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	fputc(0xfb, f);
+	for (int shift = 56; shift >= 0; shift -= 8)
+		fputc((int)( ( bits >> shift ) & 0xff ), f);
+}
+
+static void aggregate_write_json (const struct Aggregate_worker *total, double hours, FILE *restrict f)
+{
+	fprintf(f,
+			"{\n"
+			"    \"recordings\": %zu,\n"
+			"    \"records\": %" PRIu64 ",\n"
+			"    \"malformed-records\": %" PRIu64 ",\n"
+			"    \"duration\": %.3f,\n"
+			"    \"apps\": [",
+			total->recordings, total->records, total->malformed,
+			(double)total->duration_us / 1e6);
+	for (uint32_t i = 0; i < total->apps_len; i++)
+	{
+		const struct Aggregate_app *app = &total->apps[i];
+		fputs(i == 0 ? "\n        {\n            \"app-id\": " : ",\n        {\n            \"app-id\": ", f);
+		write_json(app->app_id, f);
+		fprintf(f,
+				",\n"
+				"            \"focus-time\": %.3f,\n"
+				"            \"toplevels\": %" PRIu64 ",\n"
+				"            \"created\": %" PRIu64 ",\n"
+				"            \"changed\": %" PRIu64 ",\n"
+				"            \"closed\": %" PRIu64 ",\n"
+				"            \"focus\": %" PRIu64 ",\n"
+				"            \"events-per-hour\": %.3f\n"
+				"        }",
+				(double)app->focus_us / 1e6, app->toplevels,
+				app->events[EVENT_CREATED], app->events[EVENT_CHANGED],
+				app->events[EVENT_CLOSED], app->events[EVENT_FOCUS],
+				hours > 0 ? (double)aggregate_app_events(app) / hours : 0);
+	}
+	fputs(total->apps_len > 0 ? "\n    ]\n}\n" : "]\n}\n", f);
+}
+
+/** The same report as aggregate_write_json(), as CBOR. */
+static void aggregate_write_cbor (const struct Aggregate_worker *total, double hours, FILE *restrict f)
+{
+	cbor_write_head(5, 5, f);
+	cbor_write_text("recordings", f);
+	cbor_write_head(0, total->recordings, f);
+	cbor_write_text("records", f);
+	cbor_write_head(0, total->records, f);
+	cbor_write_text("malformed-records", f);
+	cbor_write_head(0, total->malformed, f);
+	cbor_write_text("duration", f);
+	cbor_write_double((double)total->duration_us / 1e6, f);
+	cbor_write_text("apps", f);
+	cbor_write_head(4, total->apps_len, f);
+	for (uint32_t i = 0; i < total->apps_len; i++)
+	{
+		const struct Aggregate_app *app = &total->apps[i];
+		cbor_write_head(5, 8, f);
+		cbor_write_text("app-id", f);
+		cbor_write_text(app->app_id, f);
+		cbor_write_text("focus-time", f);
+		cbor_write_double((double)app->focus_us / 1e6, f);
+		cbor_write_text("toplevels", f);
+		cbor_write_head(0, app->toplevels, f);
+		cbor_write_text("created", f);
+		cbor_write_head(0, app->events[EVENT_CREATED], f);
+		cbor_write_text("changed", f);
+		cbor_write_head(0, app->events[EVENT_CHANGED], f);
+		cbor_write_text("closed", f);
+		cbor_write_head(0, app->events[EVENT_CLOSED], f);
+		cbor_write_text("focus", f);
+		cbor_write_head(0, app->events[EVENT_FOCUS], f);
+		cbor_write_text("events-per-hour", f);
+		cbor_write_double(hours > 0 ? (double)aggregate_app_events(app) / hours : 0, f);
+	}
+}
+
+/**
+ * Aggregate the recordings of --aggregate and write the report to stdout.
+ * Prints error messages accordingly.
+ */
+static bool aggregate (void)
+{
+	long jobs = aggregate_jobs > 0 ? (long)aggregate_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if ( jobs < 1 )
+		jobs = 1;
+	if ( (size_t)jobs > aggregate_paths_len )
+		jobs = (long)aggregate_paths_len;
+
+	struct Aggregate_worker *workers = calloc((size_t)jobs, sizeof(struct Aggregate_worker));
+	if ( workers == NULL )
+	{
+		fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+		return false;
+	}
+
+	/* This thread is the first worker. Recordings are taken one at a time,
+	 * so the others pick up the work of threads which failed to start.
+	 */
+	const uint64_t start = monotonic_us();
+	for (long i = 1; i < jobs; i++)
+	{
+		const int err = pthread_create(&workers[i].thread, NULL, aggregate_work, &workers[i]);
+		if ( err != 0 && debug_log )
+			fprintf(stderr, "[pthread_create(): %s]\n", strerror(err));
+		workers[i].started = err == 0;
+	}
+	aggregate_work(&workers[0]);
+
+	bool ok = true;
+	for (long i = 1; i < jobs; i++)
+	{
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		if ( ok && !aggregate_merge(&workers[0], &workers[i]) )
+			ok = false;
+		aggregate_worker_free(&workers[i]);
+	}
+
+	struct Aggregate_worker *total = &workers[0];
+	if (debug_log)
+		fprintf(stderr, "[Aggregated %" PRIu64 " records of %zu recordings in %.1f ms with %ld threads.]\n",
+				total->records, total->recordings,
+				(double)( monotonic_us() - start ) / 1e3, jobs);
+
+	if ( ok && !aggregate_normalize(total) )
+		ok = false;
+	if (ok)
+	{
+		/* The hash table is not needed anymore, so the apps can be sorted
+		 * and their app-ids unescaped in place. They already are valid UTF-8.
+		 */
+		if ( total->apps_len > 0 )
+			qsort(total->apps, total->apps_len, sizeof(struct Aggregate_app), compare_aggregate_apps);
+		for (uint32_t i = 0; i < total->apps_len; i++)
+		{
+			if ( unescape_tsv(total->apps[i].app_id) == NULL )
+			{
+				free(total->apps[i].app_id);
+				total->apps[i].app_id = NULL;
+			}
+		}
+		const double hours = (double)total->duration_us / 3.6e9;
+		if (aggregate_cbor)
+			aggregate_write_cbor(total, hours, stdout);
+		else
+			aggregate_write_json(total, hours, stdout);
+	}
+	ok = ok && total->failed == 0;
+
+	aggregate_worker_free(total);
+	free(workers);
+	return ok;
+}
+
+/********************************
+ *                              *
+ *    main and Wayland logic    *
+ *                              *
+ ********************************/
+static void registry_handle_global (void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version)
+{
+	stats.globals++;
+
+	struct Global *global = NULL;
+	if ( strcmp(interface, zwlr_foreign_toplevel_manager_v1_interface.name) == 0 && version >= 3 )
+		global = &zwlr_toplevel_manager_global;
+	else if ( strcmp(interface, ext_foreign_toplevel_list_v1_interface.name) == 0 )
+		global = &ext_toplevel_list_global;
+	/* Version 1 predates ext-foreign-toplevel-list-v1. */
+	else if ( strcmp(interface, zcosmic_toplevel_info_v1_interface.name) == 0 && version >= 2 )
+		global = &cosmic_toplevel_info_global;
+	else
+		return;
+
+	global->advertised = true;
+	global->name = name;
+	global->version = version;
+}
+
+/** Bind the globals needed for used_protocol. */
+static void bind_globals (void)
+{
+	switch (used_protocol)
+	{
+		case ZWLR_FOREIGN_TOPLEVEL:
+			if (debug_log)
+				fputs("[Binding zwlr-foreign-toplevel-manager-v1.]\n", stderr);
+			zwlr_toplevel_manager = wl_registry_bind(wl_registry, zwlr_toplevel_manager_global.name,
+				&zwlr_foreign_toplevel_manager_v1_interface, 3);
+			zwlr_foreign_toplevel_manager_v1_add_listener(zwlr_toplevel_manager,
+					&zwlr_toplevel_manager_listener, NULL);
+			stats.bound++;
+			break;
+
+		case EXT_FOREIGN_TOPLEVEL:
+			/* Bind extensions first, so they are available when the
+			 * toplevels are advertised.
+			 */
+			if (cosmic_toplevel_info_global.advertised)
+			{
+				if (debug_log)
+					fputs("[Binding zcosmic-toplevel-info-v1.]\n", stderr);
+				cosmic_toplevel_info = wl_registry_bind(wl_registry, cosmic_toplevel_info_global.name,
+					&zcosmic_toplevel_info_v1_interface, 2);
+				zcosmic_toplevel_info_v1_add_listener(cosmic_toplevel_info,
+						&cosmic_toplevel_info_listener, NULL);
+				stats.bound++;
+			}
+			if (debug_log)
+				fputs("[Binding ext-foreign-toplevel-list-v1.]\n", stderr);
+			ext_toplevel_list = wl_registry_bind(wl_registry, ext_toplevel_list_global.name,
+				&ext_foreign_toplevel_list_v1_interface, 1);
+			ext_foreign_toplevel_list_v1_add_listener(ext_toplevel_list,
+					&ext_toplevel_list_listener, NULL);
+			stats.bound++;
+			break;
+
+		case NONE: /* Unreachable. */
+			assert(false);
+			break;
+	}
+}
+
+static void stats_report (void)
+{
+	if (!stats.enabled)
+		return;
+	fprintf(stderr,
+			"globals advertised:        %zu\n"
+			"globals bound:             %zu\n"
+			"sync round-trips:          %zu\n"
+			"toplevel handles received: %zu\n"
+			"toplevel events received:  %zu\n",
+			stats.globals, stats.bound, stats.syncs, stats.toplevels, stats.events);
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global        = registry_handle_global,
+	.global_remove = noop,
+};
+
+static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other_data);
+static const struct wl_callback_listener sync_callback_listener = {
+	.done = sync_handle_done,
+};
+
+static void sync_handle_done (void *data, struct wl_callback *wl_callback, uint32_t other_data)
+{
+	static int sync = 0;
+	if (debug_log)
+		fprintf(stderr, "[Sync callback: %d]\n", sync);
+	stats.syncs++;
+
+	wl_callback_destroy(wl_callback);
+	sync_callback = NULL;
+
+	if ( sync == 0 )
+	{
+		/* First sync: The registry finished advertising globals.
+		 * Now we can check whether we have everything we need.
+		 */
+		if ( requested_protocol != NONE )
+		{
+			const struct Global *global = requested_protocol == EXT_FOREIGN_TOPLEVEL ?
+				&ext_toplevel_list_global : &zwlr_toplevel_manager_global;
+			if (!global->advertised)
+			{
+				fputs("ERROR: Wayland server does not support the requested protocol.\n", stderr);
+				ret = EXIT_FAILURE;
+				loop = false;
+				return;
+			}
+			used_protocol = requested_protocol;
+		}
+		else if (ext_toplevel_list_global.advertised)
+			used_protocol = EXT_FOREIGN_TOPLEVEL;
+		else if (zwlr_toplevel_manager_global.advertised)
+			used_protocol = ZWLR_FOREIGN_TOPLEVEL;
+		if ( used_protocol == NONE )
+		{
+			const char *err_message =
+				"ERROR: Wayland server supports none of the protocol extensions required for getting toplevel information:\n"
+				"    -> zwlr-foreign-toplevel-management-unstable-v1, version 3 or higher\n"
+				"    -> ext-foreign-toplevel-list-v1, version 1 or higher\n"
+				"\n";
+			fputs(err_message, stderr);
+			ret = EXIT_FAILURE;
+			loop = false;
+			return;
+		}
+
+		bind_globals();
+		update_capabilities();
+
+		sync++;
+		sync_callback = wl_display_sync(wl_display);
+		wl_callback_add_listener(sync_callback, &sync_callback_listener, NULL);
+	}
+	else if ( sync == 1 && cosmic_toplevel_info != NULL )
+	{
+		/* Second sync: We have received all toplevel handles and
+		 * requested their extension objects, the initial events of which
+		 * need one more sync. Servers without extensions get away with
+		 * two syncs.
+		 */
+		sync++;
+		sync_callback = wl_display_sync(wl_display);
+		wl_callback_add_listener(sync_callback, &sync_callback_listener, NULL);
+	}
+	else if ( mode == LIST )
+	{
+		toplevels_known = true;
+
+		/* Last sync: Now we have received all toplevel handles and
+		 * their events. Time to leave the main loop, print all data and
+		 * exit.
+		 */
+		loop = false;
+	}
+	else
+	{
+		/* Last sync in WATCH mode: We now know about all toplevels
+		 * which existed when we connected, so answer the initial query
+		 * or write the initial snapshot.
+		 */
+		toplevels_known = true;
+		snapshot_outdated = true;
+		if ( search_query != NULL && output_format == NORMAL )
+			watch_write_search_results(search_query);
+	}
+}
+
+/**
+ * Read new search queries from stdin, one per line, and answer them. Returns
+ * false once stdin has been closed.
+ */
+static bool watch_read_search_queries (void)
+{
+	static char buffer[4096];
+	static size_t len = 0;
+
+	/** Set while skipping the rest of an overly long line. */
+	static bool discarding = false;
+
+	const ssize_t r = read(STDIN_FILENO, buffer + len, sizeof(buffer) - len - 1);
+	if ( r < 0 && errno == EINTR )
+		return true;
+	if ( r <= 0 )
+		return false;
+	len += (size_t)r;
+
+	char *line = buffer, *newline;
+	while ( (newline = memchr(line, '\n', len - (size_t)(line - buffer))) != NULL )
+	{
+		*newline = '\0';
+		if (discarding)
+		{
+			discarding = false;
+			line = newline + 1;
+			continue;
+		}
+		free(search_query);
+		search_query = strdup(line);
+		if ( search_query == NULL )
+		{
+			fprintf(stderr, "ERROR: strdup(): %s\n", strerror(errno));
+			return false;
+		}
+		if ( output_format == NORMAL )
+			watch_write_search_results(search_query);
+		else
+			snapshot_outdated = true;
+		line = newline + 1;
+	}
+
+	/* Keep the incomplete last line. Overly long lines are dropped. */
+	len -= (size_t)(line - buffer);
+	memmove(buffer, line, len);
+	if ( len == sizeof(buffer) - 1 )
+	{
+		len = 0;
+		discarding = true;
+	}
+	return true;
+}
+
+static void free_data (void)
+{
+	/* If we are in LIST mode, destroying a toplevel will print a message
+	 * to the user. However, in this case that message would be wrong,
+	 * because the toplevel isn't closed, we just destroy our internal
+	 * representation of it. So set mode to LIST for cleanup.
+	 */
+	mode = LIST;
+
+	for (uint32_t i = 0; i < toplevels_len; i++)
+		if (toplevel_has(&toplevels[i], TOPLEVEL_IN_USE))
+			toplevel_destroy(&toplevels[i]);
+	renderings_free();
+	free(toplevels);
+	memory_release(toplevels_capacity * sizeof(struct Toplevel));
+	toplevels = NULL;
+	toplevels_len = 0;
+	toplevels_capacity = 0;
+	free_slot = no_free_slot;
+}
+
+static int compare_toplevel_ids (const void *a, const void *b)
+{
+	const struct Toplevel *toplevel_a = *(struct Toplevel *const *)a;
+	const struct Toplevel *toplevel_b = *(struct Toplevel *const *)b;
+	if ( toplevel_a->id != toplevel_b->id )
+		return toplevel_a->id < toplevel_b->id ? -1 : 1;
+	return 0;
+}
+
+/** Write all (matching) toplevels in the current output format. */
+static void write_snapshot (void)
+{
+	snapshot_outdated = false;
+
+	struct Toplevel **list = NULL;
+	size_t len = 0;
+	if ( search_query != NULL )
+		list = search(search_query, &len);
+	else
+	{
+		/* Toplevels are never closed in LIST mode, so the slab holds
+		 * them in the order they have been advertised in.
+		 */
+		list = calloc((size_t)toplevels_len + 1, sizeof(struct Toplevel *));
+		if ( list == NULL )
+		{
+			fprintf(stderr, "ERROR: calloc(): %s\n", strerror(errno));
+			ret = EXIT_FAILURE;
+			return;
+		}
+		const uint64_t cutoff = changed_cutoff();
+		for (uint32_t i = 0; i < toplevels_len; i++)
+			if ( toplevel_has(&toplevels[i], TOPLEVEL_LISTED)
+					&& toplevels[i].changed_at.monotonic >= cutoff )
+				list[len++] = &toplevels[i];
+
+		/* In WATCH mode slots of closed toplevels get reused, so
+		 * restore the order in which they have been advertised.
+		 */
+		if ( mode == WATCH )
+			qsort(list, len, sizeof(struct Toplevel *), compare_toplevel_ids);
+	}
+
+	snapshot_expiry = UINT64_MAX;
+	if ( changed_within > 0 )
+		for (size_t i = 0; i < len; i++)
+			if ( list[i]->changed_at.monotonic + changed_within < snapshot_expiry )
+				snapshot_expiry = list[i]->changed_at.monotonic + changed_within;
+
+	if ( sort_fields_len > 0 || group_by != GROUP_NONE )
+		sort_toplevels(list, len);
+
+	out_start();
+	out_write_toplevels(list, len);
+	out_finish();
+
+	free(list);
+}
+
+/** Returns the poll() timeout until a toplevel drops out of the snapshot. */
+static int snapshot_timeout (void)
+{
+	if ( snapshot_expiry == UINT64_MAX )
+		return -1;
+	const uint64_t now = monotonic_us();
+	if ( snapshot_expiry <= now )
+		return 0;
+	const uint64_t ms = ( snapshot_expiry - now + 999 ) / 1000;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/** Called by the main loop of WATCH mode after every wake up. */
+static void snapshot_tick (void)
+{
+	if ( snapshot_expiry != UINT64_MAX && monotonic_us() >= snapshot_expiry )
+	{
+		snapshot_expiry = UINT64_MAX;
+		snapshot_outdated = true;
+	}
+}
+
+/** Returns the earlier of two poll() timeouts, -1 meaning none. */
+static int earliest_timeout (int a, int b)
+{
+	if ( a < 0 )
+		return b;
+	if ( b < 0 )
+		return a;
+	return a < b ? a : b;
+}
+
+static void dump_and_free_data (void)
+{
+	assert(mode == LIST);
+	write_snapshot();
+	free_data();
+}
+
+/**
+ * Main loop of WATCH mode. Unlike LIST mode, we may need to wait for more
+ * than just the Wayland socket, so poll() ourselves.
+ */
+static void watch_main_loop (void)
+{
+	/* Unused entries are -1 and ignored by poll(). */
+	struct pollfd fds[3 + FEED_MAX_CLIENTS] = {
+		{ .fd = wl_display_get_fd(wl_display),            .events = POLLIN },
+		{ .fd = search_query != NULL ? STDIN_FILENO : -1, .events = POLLIN },
+	};
+	const nfds_t nfds = sizeof(fds) / sizeof(fds[0]);
+
+	while (loop)
+	{
+		while ( wl_display_prepare_read(wl_display) != 0 )
+			if ( wl_display_dispatch_pending(wl_display) < 0 )
+				return;
+		wl_display_flush(wl_display);
+
+		/* All pending events are handled, so the state is consistent. */
+		focus_flush();
+		ring_update_snapshot();
+		if ( output_format != NORMAL && toplevels_known && snapshot_outdated )
+			write_snapshot();
+		fflush(stdout);
+
+		feed_prepare_poll(&fds[2]);
+		/* Wake up for whichever timer is due first. */
+		const int timeout = earliest_timeout(earliest_timeout(history_timeout(), ping_timeout()),
+				snapshot_timeout());
+		const int poll_ret = poll(fds, nfds, timeout);
+		snapshot_tick();
+		history_tick();
+		ping_tick();
+		transitions_tick();
+		if ( poll_ret < 0 )
+		{
+			wl_display_cancel_read(wl_display);
+			if ( errno == EINTR )
+				continue;
+			fprintf(stderr, "ERROR: poll(): %s\n", strerror(errno));
+			ret = EXIT_FAILURE;
+			return;
+		}
+
+		if ( fds[0].revents & POLLIN )
+		{
+			if ( wl_display_read_events(wl_display) < 0 )
+				return;
+		}
+		else
+			wl_display_cancel_read(wl_display);
+		if ( wl_display_dispatch_pending(wl_display) < 0 )
+			return;
+
+		if ( fds[1].revents != 0 && !watch_read_search_queries() )
+			fds[1].fd = -1;
+		feed_handle_poll(&fds[2]);
+	}
+}
+
+static void handle_interrupt (int signum)
+{
+	fputs("Killed.\n", stderr);
+	loop = false;
+
+	/* In WATCH mode, Ctrl-C is the expected way to exit lswt, so don't
+	 * set the return value to EXIT_FAILURE. However in LIST mode we
+	 * generally don't expect SIGINT, so we probably encountered an error
+	 * and should set the return value accordingly.
+	 */
+	if ( mode == LIST )
+		ret = EXIT_FAILURE;
+
+	longjmp(skip_main_loop, 1);
+}
+
+/**
+ * Intercept error signals (like SIGSEGV and SIGFPE) so that we can try to
+ * print a fancy error message and a backtracke before letting the system kill us.
+ */
+static void handle_error (int signum)
+{
+	const char *msg =
+		"\n"
+		"┌──────────────────────────────────────────┐\n"
+		"│                                          │\n"
+		"│             lswt has crashed.            │\n"
+		"│                                          │\n"
+		"│   This is most likely a bug, so please   │\n"
+		"│     report this to the mailing list.     │\n"
+		"│                                          │\n"
+		"│  ~leon_plickat/public-inbox@lists.sr.ht  │\n"
+		"│                                          │\n"
+		"└──────────────────────────────────────────┘\n"
+		"\n";
+	fputs(msg, stderr);
+
+	/* Set up the default handlers to deal with the rest. We do this before
+	 * attempting to get a backtrace, because sometimes that could also
+	 * cause a SEGFAULT and we don't want a funny signal loop to happen.
+	 */
+	signal(signum, SIG_DFL);
+
+#ifdef __linux__
+#ifdef __GLIBC__
+	fputs("Attempting to get backtrace:\n", stderr);
+	void *buffer[255];
+	const int calls = backtrace(buffer, sizeof(buffer) / sizeof(void *));
+	backtrace_symbols_fd(buffer, calls, fileno(stderr));
+	fputs("\n", stderr);
+#endif
+#endif
+
+	/* Easiest way of calling the default signal handler. */
+	kill(getpid(), signum);
+}
+
+// TODO replace this once landlock lands in libc.
+#ifdef __linux__
+#ifndef landlock_create_ruleset
+static inline long int landlock_create_ruleset(const struct landlock_ruleset_attr *const attr,
+		const size_t size, const __u32 flags)
+{
+	return syscall(__NR_landlock_create_ruleset, attr, size, flags);
+}
+#endif
+#endif
+
+static void init_landlock (void)
+{
+#ifdef __linux__
+	const long int abi_version = landlock_create_ruleset(NULL, 0, LANDLOCK_CREATE_RULESET_VERSION);
+	if (abi_version < 0)
+		return;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+	signal(SIGSEGV, handle_error);
+	signal(SIGFPE, handle_error);
+	signal(SIGINT, handle_interrupt);
+	init_landlock();
+
+	if ( argc > 0 ) for (int i = 1; i < argc; i++)
+	{
+		if ( strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--json") == 0 )
+		{
+			if ( output_format != NORMAL )
+			{
+				fputs("ERROR: Output format may only be specified once.", stderr);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			output_format = JSON;
+		}
+		else if ( strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tsv") == 0 )
+		{
+			if ( output_format != NORMAL )
+			{
+				fputs("ERROR: Output format may only be specified once.", stderr);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			output_format = TSV;
+		}
+		else if ( strcmp(argv[i], "-0") == 0 || strcmp(argv[i], "--null") == 0 )
+		{
+			if ( output_format != NORMAL )
+			{
+				fputs("ERROR: Output format may only be specified once.", stderr);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			output_format = NUL_SEPARATED;
+		}
+		else if ( strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--custom") == 0 )
+		{
+			if ( output_format != NORMAL )
+			{
+				fputs("ERROR: Output format may only be specified once.", stderr);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if (!out_check_custom_format(argv[i+1]))
+			{
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			output_format = CUSTOM;
+			custom_output_format = strdup(argv[i+1]);
+			i++;
+		}
+		else if ( strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--search") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			free(search_query);
+			search_query = strdup(argv[i+1]);
+			i++;
+		}
+		else if ( strcmp(argv[i], "--sort") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if (!parse_sort_fields(argv[i+1]))
+			{
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--group-by") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if ( strcmp(argv[i+1], "app-id") == 0 )
+				group_by = GROUP_APP_ID;
+			else if ( strcmp(argv[i+1], "normalized-app-id") == 0 )
+				group_by = GROUP_NORMALIZED_APP_ID;
+			else if ( strcmp(argv[i+1], "normalized-title") == 0 )
+				group_by = GROUP_NORMALIZED_TITLE;
+			else
+			{
+				fprintf(stderr, "ERROR: Can not group by '%s', only by 'app-id', "
+						"'normalized-app-id' or 'normalized-title'.\n", argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--normalize") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if ( normalize || !normalize_load(argv[i+1]) )
+			{
+				if (normalize)
+					fputs("ERROR: Rules may only be specified once.\n", stderr);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--changed-within") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			uint64_t seconds;
+			if ( !parse_duration(argv[i+1], &seconds) || seconds == 0 || seconds > UINT32_MAX )
+			{
+				fprintf(stderr, "ERROR: Invalid duration for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			changed_within = seconds * 1000000;
+			i++;
+		}
+		else if ( strcmp(argv[i], "--max-memory") == 0 || strcmp(argv[i], "--max-title-bytes") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			size_t *limit = strcmp(argv[i], "--max-memory") == 0 ? &memory_limit : &max_title_bytes;
+			if ( !parse_size(argv[i+1], limit) || *limit == 0 )
+			{
+				fprintf(stderr, "ERROR: Invalid size for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--on-created") == 0 || strcmp(argv[i], "--on-changed") == 0
+				|| strcmp(argv[i], "--on-closed") == 0 || strcmp(argv[i], "--on-focus") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			enum Toplevel_event event = EVENT_CREATED;
+			if ( strcmp(argv[i], "--on-changed") == 0 )
+				event = EVENT_CHANGED;
+			else if ( strcmp(argv[i], "--on-closed") == 0 )
+				event = EVENT_CLOSED;
+			else if ( strcmp(argv[i], "--on-focus") == 0 )
+				event = EVENT_FOCUS;
+			if (!emit_plan_compile(event, argv[i+1]))
+			{
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--feed") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			feed_path = argv[i+1];
+			i++;
+		}
+		else if ( strcmp(argv[i], "--feed-size") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			unsigned long records;
+			if ( !parse_number(argv[i+1], &records) || records > FEED_MAX_RECORDS )
+			{
+				fprintf(stderr, "ERROR: Invalid number for '%s', must be 1 to %d: %s\n",
+						argv[i], FEED_MAX_RECORDS, argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			journal_capacity = records;
+			i++;
+		}
+		else if ( strcmp(argv[i], "--ring") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			ring_name = argv[i+1];
+			i++;
+		}
+		else if ( strcmp(argv[i], "--ring-size") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if (!parse_size(argv[i+1], &ring_capacity))
+			{
+				fprintf(stderr, "ERROR: Invalid size for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--trace") == 0 )
+			trace = true;
+		else if ( strcmp(argv[i], "--replay") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			replay_path = argv[i+1];
+			i++;
+		}
+		else if ( strcmp(argv[i], "--history") == 0 || strcmp(argv[i], "--history-query") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if ( strcmp(argv[i], "--history") == 0 )
+				history_path = argv[i+1];
+			else
+				history_query = argv[i+1];
+			i++;
+		}
+		else if ( strcmp(argv[i], "--ping") == 0 || strcmp(argv[i], "--ping-count") == 0
+				|| strcmp(argv[i], "--ping-stall") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			unsigned long *number = &ping_interval;
+			if ( strcmp(argv[i], "--ping-count") == 0 )
+				number = &ping_count;
+			else if ( strcmp(argv[i], "--ping-stall") == 0 )
+				number = &ping_stall;
+			if (!parse_number(argv[i+1], number))
+			{
+				fprintf(stderr, "ERROR: Invalid number for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			if ( number != &ping_count && *number > PING_MAX_MS )
+			{
+				fprintf(stderr, "ERROR: Invalid number for '%s', must be 1 to %d: %s\n",
+						argv[i], PING_MAX_MS, argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--transitions") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			transitions_path = argv[i+1];
+			i++;
+		}
+		else if ( strcmp(argv[i], "--transitions-half-life") == 0 )
+		{
+			if ( argc == i + 1 )
+			{
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			unsigned long hours;
+			if (!parse_number(argv[i+1], &hours))
+			{
+				fprintf(stderr, "ERROR: Invalid number for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			transitions_half_life = (double)hours * 3600;
+			i++;
 		}
-		update_capabilities();
-
-		sync++;
-		sync_callback = wl_display_sync(wl_display);
-		wl_callback_add_listener(sync_callback, &sync_callback_listener, NULL);
-
-		// TODO if there are extension protocol for ext_foreign_toplevel_list
-		//      to get extra information, we may need one additional sync.
-		//      So check if any of those are bound and then add one step
-		//      if necessary.
-	}
-	else if ( mode == LIST )
-	{
-		/* Second sync: Now we have received all toplevel handles and
-		 * their events. Time to leave the main loop, print all data and
-		 * exit.
-		 */
-		loop = false;
-	}
-}
-
-static void dump_and_free_data (void)
-{
-	assert(mode == LIST);
-	out_start();
-	struct Toplevel *t, *tmp;
-	wl_list_for_each_reverse_safe(t, tmp, &toplevels, link)
-	{
-		out_write_toplevel(t);
-		toplevel_destroy(t);
-	}
-	out_finish();
-}
-
-static void free_data (void)
-{
-	/* If we are in LIST mode, destroying a toplevel will print a message
-	 * to the user. However, in this case that message would be wrong,
-	 * because the toplevel isn't closed, we just destroy our internal
-	 * representation of it. So set mode to LIST for cleanup.
-	 */
-	mode = LIST;
-
-	struct Toplevel *t, *tmp;
-	wl_list_for_each_safe(t, tmp, &toplevels, link)
-		toplevel_destroy(t);
-}
-
-static void handle_interrupt (int signum)
-{
-	fputs("Killed.\n", stderr);
-	loop = false;
-
-	/* In WATCH mode, Ctrl-C is the expected way to exit lswt, so don't
-	 * set the return value to EXIT_FAILURE. However in LIST mode we
-	 * generally don't expect SIGINT, so we probably encountered an error
-	 * and should set the return value accordingly.
-	 */
-	if ( mode == LIST )
-		ret = EXIT_FAILURE;
-
-	longjmp(skip_main_loop, 1);
-}
-
-/**
- * Intercept error signals (like SIGSEGV and SIGFPE) so that we can try to
- * print a fancy error message and a backtracke before letting the system kill us.
- */
-static void handle_error (int signum)
-{
-	const char *msg =
-		"\n"
-		"┌──────────────────────────────────────────┐\n"
-		"│                                          │\n"
-		"│             lswt has crashed.            │\n"
-		"│                                          │\n"
-		"│   This is most likely a bug, so please   │\n"
-		"│     report this to the mailing list.     │\n"
-		"│                                          │\n"
-		"│  ~leon_plickat/public-inbox@lists.sr.ht  │\n"
-		"│                                          │\n"
-		"└──────────────────────────────────────────┘\n"
-		"\n";
-	fputs(msg, stderr);
-
-	/* Set up the default handlers to deal with the rest. We do this before
-	 * attempting to get a backtrace, because sometimes that could also
-	 * cause a SEGFAULT and we don't want a funny signal loop to happen.
-	 */
-	signal(signum, SIG_DFL);
-
-#ifdef __linux__
-#ifdef __GLIBC__
-	fputs("Attempting to get backtrace:\n", stderr);
-	void *buffer[255];
-	const int calls = backtrace(buffer, sizeof(buffer) / sizeof(void *));
-	backtrace_symbols_fd(buffer, calls, fileno(stderr));
-	fputs("\n", stderr);
-#endif
-#endif
-
-	/* Easiest way of calling the default signal handler. */
-	kill(getpid(), signum);
-}
-
-// TODO replace this once landlock lands in libc.
-#ifdef __linux__
-#ifndef landlock_create_ruleset
-static inline long int landlock_create_ruleset(const struct landlock_ruleset_attr *const attr,
-		const size_t size, const __u32 flags)
-{
-	return syscall(__NR_landlock_create_ruleset, attr, size, flags);
-}
-#endif
-#endif
-
-static void init_landlock (void)
-{
-#ifdef __linux__
-	const long int abi_version = landlock_create_ruleset(NULL, 0, LANDLOCK_CREATE_RULESET_VERSION);
-	if (abi_version < 0)
-		return;
-#endif
-}
-
-int main(int argc, char *argv[])
-{
-	signal(SIGSEGV, handle_error);
-	signal(SIGFPE, handle_error);
-	signal(SIGINT, handle_interrupt);
-	init_landlock();
-
-	if ( argc > 0 ) for (int i = 1; i < argc; i++)
-	{
-		if ( strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--json") == 0 )
+		else if ( strcmp(argv[i], "--aggregate") == 0 )
 		{
-			if ( output_format != NORMAL )
+			/* All following arguments are recordings. */
+			if ( argc == i + 1 )
 			{
-				fputs("ERROR: Output format may only be specified once.", stderr);
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
 				ret = EXIT_FAILURE;
 				goto cleanup;
 			}
-			output_format = JSON;
+			aggregate_paths = &argv[i+1];
+			aggregate_paths_len = (size_t)( argc - i - 1 );
+			break;
 		}
-		else if ( strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--custom") == 0 )
+		else if ( strcmp(argv[i], "--cbor") == 0 )
+			aggregate_cbor = true;
+		else if ( strcmp(argv[i], "--jobs") == 0 )
 		{
-			if ( output_format != NORMAL )
+			if ( argc == i + 1 )
 			{
-				fputs("ERROR: Output format may only be specified once.", stderr);
+				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
 				ret = EXIT_FAILURE;
 				goto cleanup;
 			}
+			if (!parse_number(argv[i+1], &aggregate_jobs))
+			{
+				fprintf(stderr, "ERROR: Invalid number for '%s': %s\n", argv[i], argv[i+1]);
+				ret = EXIT_FAILURE;
+				goto cleanup;
+			}
+			i++;
+		}
+		else if ( strcmp(argv[i], "--protocol") == 0 )
+		{
 			if ( argc == i + 1 )
 			{
 				fprintf(stderr, "ERROR: Flag '%s' requires a parameter.", argv[i]);
 				ret = EXIT_FAILURE;
 				goto cleanup;
 			}
-			if (!out_check_custom_format(argv[i+1]))
+			if ( strcmp(argv[i+1], "ext") == 0 )
+				requested_protocol = EXT_FOREIGN_TOPLEVEL;
+			else if ( strcmp(argv[i+1], "zwlr") == 0 )
+				requested_protocol = ZWLR_FOREIGN_TOPLEVEL;
+			else if ( strcmp(argv[i+1], "auto") == 0 )
+				requested_protocol = NONE;
+			else
 			{
+				fprintf(stderr, "ERROR: Unknown protocol '%s', expected 'ext', 'zwlr' or 'auto'.\n", argv[i+1]);
 				ret = EXIT_FAILURE;
 				goto cleanup;
 			}
-			output_format = CUSTOM;
-			custom_output_format = strdup(argv[i+1]);
 			i++;
 		}
+		else if ( strcmp(argv[i], "--stats") == 0 )
+			stats.enabled = true;
 		else if ( strcmp(argv[i], "--debug") == 0 )
 			debug_log = true;
 		else if ( strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0 )
@@ -1100,11 +7593,162 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ( mode == WATCH && output_format != NORMAL )
+	if ( aggregate_paths != NULL )
+	{
+		if ( mode == WATCH || trace || ( output_format != NORMAL && output_format != JSON ) )
+		{
+			fputs("ERROR: --aggregate only writes its report in JSON or CBOR.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+
+		/* The signal may be handled by any of the worker threads, which can
+		 * not jump back to main(), so simply terminate.
+		 */
+		signal(SIGINT, SIG_DFL);
+		if (!aggregate())
+			ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	else if ( aggregate_cbor || aggregate_jobs > 0 )
+	{
+		fputs("ERROR: --cbor and --jobs require --aggregate.\n", stderr);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if ( mode != WATCH && event_templates )
+	{
+		fputs("ERROR: Event templates are only supported in watch mode.\n", stderr);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if ( event_templates && ( output_format != NORMAL || search_query != NULL ) )
+	{
+		fputs("ERROR: Event templates can not be combined with other output formats or --search.\n", stderr);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (trace)
+	{
+		if ( mode != WATCH && replay_path == NULL )
+		{
+			fputs("ERROR: --trace requires watch mode or --replay.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if ( output_format != NORMAL || event_templates )
+		{
+			fputs("ERROR: --trace can not be combined with other output formats.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		trace_start();
+		if ( replay_path != NULL )
+		{
+			if ( setjmp(skip_main_loop) == 0 && !trace_replay(replay_path) )
+				ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	else if ( replay_path != NULL )
+	{
+		fputs("ERROR: --replay requires --trace.\n", stderr);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if ( changed_within > 0 && ( mode != WATCH || ( output_format == NORMAL && search_query == NULL ) ) )
+	{
+		fputs("ERROR: --changed-within is only supported in watch mode with --search or another output format.\n", stderr);
+		ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if ( ping_interval > 0 && mode != WATCH )
+	{
+		if ( output_format != NORMAL || search_query != NULL || sort_fields_len > 0 || group_by != GROUP_NONE )
+		{
+			fputs("ERROR: --ping without --watch does not list toplevels.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if ( feed_path != NULL || ring_name != NULL || history_path != NULL
+				|| history_query != NULL || transitions_path != NULL )
+		{
+			fputs("ERROR: --ping without --watch does not follow toplevels.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		ping_only = true;
+		mode = WATCH;
+	}
+	if ( history_query != NULL )
+	{
+		if ( history_path == NULL || mode == WATCH )
+		{
+			fputs("ERROR: --history-query requires --history and can not be used in watch mode.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if ( !history_open(false) || !history_print(history_query) )
+			ret = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if ( history_path != NULL )
+	{
+		if ( mode != WATCH )
+		{
+			fputs("ERROR: Recording the history is only supported in watch mode.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if (!history_open(true))
+		{
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	if ( transitions_path != NULL )
+	{
+		if ( mode != WATCH )
+		{
+			fputs("ERROR: Counting focus transitions is only supported in watch mode.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if (!transitions_load())
+		{
+			transitions_path = NULL;
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		signal(SIGUSR1, handle_dump_request);
+	}
+	if ( ring_name != NULL )
+	{
+		if ( mode != WATCH )
+		{
+			fputs("ERROR: The ring is only supported in watch mode.\n", stderr);
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+		if (!ring_init())
+		{
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
+	}
+	if ( feed_path != NULL )
 	{
-			fputs("ERROR: Alternative output formats are not supported in watch mode.\n", stderr);
+		if ( mode != WATCH )
+		{
+			fputs("ERROR: The change feed is only supported in watch mode.\n", stderr);
 			ret = EXIT_FAILURE;
 			goto cleanup;
+		}
+		if (!feed_init())
+		{
+			ret = EXIT_FAILURE;
+			goto cleanup;
+		}
 	}
 
 	/* We query the display name here instead of letting wl_display_connect()
@@ -1134,7 +7778,6 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
-	wl_list_init(&toplevels);
 	wl_registry = wl_display_get_registry(wl_display);
 	wl_registry_add_listener(wl_registry, &registry_listener, NULL);
 
@@ -1144,7 +7787,12 @@ int main(int argc, char *argv[])
 	if (debug_log)
 		fputs("[Entering main loop.]\n", stderr);
 	if ( setjmp(skip_main_loop) == 0 )
-		while ( loop && wl_display_dispatch(wl_display) > 0 );
+	{
+		if ( mode == WATCH )
+			watch_main_loop();
+		else
+			while ( loop && wl_display_dispatch(wl_display) > 0 );
+	}
 
 	/* If nothing went wrong in the main loop we can print and free all data,
 	 * otherwise just free it.
@@ -1158,17 +7806,36 @@ int main(int argc, char *argv[])
 		fputs("[Cleaning up Wayland interfaces.]\n", stderr);
 	if ( sync_callback != NULL )
 		wl_callback_destroy(sync_callback);
+	if ( ping_callback != NULL )
+		wl_callback_destroy(ping_callback);
 	if ( zwlr_toplevel_manager != NULL )
 		zwlr_foreign_toplevel_manager_v1_destroy(zwlr_toplevel_manager);
+	if ( cosmic_toplevel_info != NULL )
+		zcosmic_toplevel_info_v1_destroy(cosmic_toplevel_info);
 	if ( ext_toplevel_list != NULL )
 		ext_foreign_toplevel_list_v1_destroy(ext_toplevel_list);
 	if ( wl_registry != NULL )
 		wl_registry_destroy(wl_registry);
 	wl_display_disconnect(wl_display);
+	memory_report();
+	repair_report();
+	stats_report();
+	ping_report();
 
 cleanup:
 	if ( custom_output_format != NULL )
 		free(custom_output_format);
+	if ( search_query != NULL )
+		free(search_query);
+	search_index_free();
+	for (size_t i = 0; i < sizeof(emit_plans) / sizeof(emit_plans[0]); i++)
+		emit_plan_free(&emit_plans[i]);
+	feed_finish();
+	ring_finish();
+	trace_finish();
+	history_close();
+	transitions_finish();
+	normalize_finish();
 
 	return ret;
 }